@@ -8,6 +8,7 @@
  */
 
 #include "Def.hpp"
+#include <unordered_map>
 
 /**
  * @brief Mapping of primitive function names to expression types
@@ -23,7 +24,7 @@
  * - Logic: not, and, or (and/or support short-circuit evaluation)
  * - Type predicates: eq?, boolean?, number?, null?, pair?, procedure?, symbol?, list?, string?
  * - I/O: display
- * - Control: void, exit
+ * - Control: void, exit, call/cc
  */
 std::map<std::string, ExprType> primitives = {
     // Arithmetic operations
@@ -67,10 +68,14 @@ std::map<std::string, ExprType> primitives = {
     
     // I/O operations
     {"display",   E_DISPLAY},
+    {"read",      E_READ},
     
     // Special values and control
     {"void",      E_VOID},
-    {"exit",      E_EXIT}
+    {"exit",      E_EXIT},
+    {"gc",        E_GC},
+    {"call/cc",   E_CALLCC},
+    {"call-with-current-continuation", E_CALLCC}
 };
 
 /**
@@ -113,3 +118,22 @@ std::map<std::string, ExprType> reserved_words = {
     // Assignment
     {"set!",    E_SET}      
 };
+
+SymbolEntry::SymbolEntry(const std::string &name, int id)
+    : name(name), id(id), primitive(-1), reserved(-1), cell(nullptr) {
+    auto prim = primitives.find(name);
+    if (prim != primitives.end()) primitive = prim->second;
+    auto word = reserved_words.find(name);
+    if (word != reserved_words.end()) reserved = word->second;
+}
+
+/**
+ * @brief Returns the unique entry for a name, creating it on first use
+ */
+SymbolId intern(const std::string &name) {
+    static std::unordered_map<std::string, SymbolId> table;
+    SymbolId &sym = table[name];
+    if (sym == nullptr)
+        sym = new SymbolEntry(name, (int)table.size() - 1);
+    return sym;
+}
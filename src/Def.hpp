@@ -20,8 +20,11 @@
 struct Syntax;
 struct Expr;
 struct Value;
-struct AssocList;
+struct Frame;
 struct Assoc;
+struct Scope;
+struct GlobalCell;
+struct Chunk;
 
 /**
  * @brief Expression types enumeration
@@ -33,6 +36,7 @@ enum ExprType {
     // Basic types and literals
     E_FIXNUM,          
     E_RATIONAL,        
+    E_BIGNUM,
     E_STRING,         
     E_TRUE,            
     E_FALSE,           
@@ -101,6 +105,13 @@ enum ExprType {
 
     // I/O operations
     E_DISPLAY,         
+    E_READ,
+
+    // Continuations
+    E_CALLCC,
+
+    // Memory management
+    E_GC,
 };
 
 /**
@@ -112,14 +123,40 @@ enum ExprType {
 enum ValueType {
     V_INT,              
     V_RATIONAL,         
+    V_BIGNUM,
+    V_BIGRATIONAL,
     V_BOOL,             
     V_SYM,              
     V_NULL,             
     V_STRING,           
     V_PAIR,             
     V_PROC,             
+    V_PRIMITIVE,        // a primitive used as a value, see PrimitiveProcedure
     V_VOID,            
-    V_TERMINATE        
+    V_TERMINATE,
+    V_CONTINUATION,
+    V_BOX,              // internal: shared storage of a captured, assigned local
+    V_TAILCALL          // internal: a pending tail call, never seen by programs
 };
 
+/**
+ * @brief Interned symbol
+ *
+ * The reader stores every distinct identifier once in a global table and
+ * hands out the entry's address, so symbols are compared and looked up by
+ * identity. The entry caches what the name means to the parser and the
+ * top-level cell bound to it.
+ */
+struct SymbolEntry {
+    std::string name;
+    int id;              ///< Dense index in interning order
+    int primitive;       ///< ExprType of the primitive with this name, or -1
+    int reserved;        ///< ExprType of the reserved word with this name, or -1
+    GlobalCell *cell;    ///< Top-level binding, created on first use
+    SymbolEntry(const std::string &, int);
+};
+typedef SymbolEntry *SymbolId;
+
+SymbolId intern(const std::string &);
+
 #endif // DEF_HPP
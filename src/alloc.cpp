@@ -0,0 +1,32 @@
+/**
+ * @file alloc.cpp
+ * @brief Slab refills and allocator statistics
+ */
+
+#include "alloc.hpp"
+#include <new>
+
+SizeClass slab_classes[SLAB_CLASSES];
+size_t slab_hits = 0;
+static size_t slab_misses = 0;
+
+// The free list of the class is empty: carve a cell, starting a new slab
+// when the current one is used up
+void *slabMiss(size_t n) {
+    ++slab_misses;
+    if (n > SLAB_CLASSES * SLAB_GRANULE) return ::operator new(n);
+    size_t cls = (n - 1) / SLAB_GRANULE;
+    size_t cell = (cls + 1) * SLAB_GRANULE;
+    SizeClass &c = slab_classes[cls];
+    if (c.bump == nullptr || (size_t)(c.end - c.bump) < cell) {
+        c.bump = static_cast<char *>(::operator new(SLAB_BYTES));
+        c.end = c.bump + SLAB_BYTES - SLAB_BYTES % cell;
+    }
+    void *p = c.bump;
+    c.bump += cell;
+    return p;
+}
+
+SlabStats slabStats() {
+    return SlabStats{slab_hits, slab_misses};
+}
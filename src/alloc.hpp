@@ -0,0 +1,68 @@
+#ifndef ALLOC_HPP
+#define ALLOC_HPP
+
+/**
+ * @file alloc.hpp
+ * @brief Size-class slab allocator for small runtime objects
+ *
+ * Pairs, frames, procedures and the other heap values are allocated and
+ * freed at a high rate, in a handful of sizes. Each size class (a multiple
+ * of 16 bytes) carves cells out of large slabs and keeps the cells freed
+ * since on a free list, so the common allocation is a pop and the common
+ * free a push. Slabs are never given back: a freed cell is only reused by
+ * its own class. Larger requests go to operator new.
+ */
+
+#include <cstddef>
+
+const size_t SLAB_GRANULE = 16;     ///< Size classes are multiples of this
+const size_t SLAB_CLASSES = 16;     ///< So cells are at most 256 bytes
+const size_t SLAB_BYTES = 64 * 1024;
+
+struct FreeCell {
+    FreeCell *next;
+};
+
+struct SizeClass {
+    FreeCell *free;     ///< Cells freed and not reused yet
+    char *bump;         ///< Unused part of the current slab
+    char *end;
+};
+
+struct SlabStats {
+    size_t hits;        ///< Allocations served from a free list
+    size_t misses;      ///< Allocations carved from a slab or too large for one
+};
+
+extern SizeClass slab_classes[SLAB_CLASSES];
+extern size_t slab_hits;
+
+void *slabMiss(size_t);
+SlabStats slabStats();
+
+inline void *slabAlloc(size_t n) {
+    if (n <= SLAB_CLASSES * SLAB_GRANULE) {
+        SizeClass &c = slab_classes[(n - 1) / SLAB_GRANULE];
+        if (c.free != nullptr) {
+            FreeCell *cell = c.free;
+            c.free = cell->next;
+            ++slab_hits;
+            return cell;
+        }
+    }
+    return slabMiss(n);
+}
+
+/// n must be the size the memory was allocated with
+inline void slabFree(void *p, size_t n) {
+    if (n > SLAB_CLASSES * SLAB_GRANULE) {
+        ::operator delete(p);
+        return;
+    }
+    SizeClass &c = slab_classes[(n - 1) / SLAB_GRANULE];
+    FreeCell *cell = static_cast<FreeCell *>(p);
+    cell->next = c.free;
+    c.free = cell;
+}
+
+#endif
@@ -0,0 +1,471 @@
+/**
+ * @file bigint.cpp
+ * @brief Magnitude arithmetic and the signed operations built on it
+ */
+
+#include "bigint.hpp"
+#include "RE.hpp"
+#include <algorithm>
+
+namespace {
+
+typedef std::vector<uint32_t> Limbs;
+
+/// Operands shorter than this (in limbs) are multiplied the schoolbook way
+const size_t KARATSUBA_CUTOFF = 32;
+
+/// Divisors shorter than this (in limbs) are divided with Knuth's algorithm D
+const size_t BZ_CUTOFF = 48;
+
+void trim(Limbs &a) {
+    while (!a.empty() && a.back() == 0) a.pop_back();
+}
+
+int compareMag(const Limbs &a, const Limbs &b) {
+    if (a.size() != b.size()) return a.size() < b.size() ? -1 : 1;
+    for (size_t i = a.size(); i-- > 0;)
+        if (a[i] != b[i]) return a[i] < b[i] ? -1 : 1;
+    return 0;
+}
+
+size_t bitLength(const Limbs &a) {
+    if (a.empty()) return 0;
+    return 32 * a.size() - __builtin_clz(a.back());
+}
+
+Limbs slice(const Limbs &a, size_t from, size_t to) {
+    from = std::min(from, a.size());
+    to = std::min(to, a.size());
+    Limbs r(a.begin() + from, a.begin() + to);
+    trim(r);
+    return r;
+}
+
+// a += b * 2^(32 * shift)
+void addTo(Limbs &a, const Limbs &b, size_t shift = 0) {
+    if (a.size() < b.size() + shift) a.resize(b.size() + shift, 0);
+    uint64_t carry = 0;
+    for (size_t i = 0; i < b.size(); ++i) {
+        carry += (uint64_t)a[i + shift] + b[i];
+        a[i + shift] = (uint32_t)carry;
+        carry >>= 32;
+    }
+    for (size_t i = b.size() + shift; carry != 0; ++i) {
+        if (i == a.size()) a.push_back(0);
+        carry += a[i];
+        a[i] = (uint32_t)carry;
+        carry >>= 32;
+    }
+}
+
+// a -= b, for a >= b
+void subFrom(Limbs &a, const Limbs &b) {
+    int64_t borrow = 0;
+    for (size_t i = 0; i < a.size() && (i < b.size() || borrow != 0); ++i) {
+        int64_t d = (int64_t)a[i] - (i < b.size() ? b[i] : 0) - borrow;
+        a[i] = (uint32_t)d;
+        borrow = d < 0;
+    }
+    trim(a);
+}
+
+// a -= 1, for a > 0
+void decrement(Limbs &a) {
+    for (size_t i = 0; a[i]-- == 0; ++i) {}
+    trim(a);
+}
+
+// 2^bits - 1
+Limbs allOnes(size_t bits) {
+    Limbs r(bits / 32, 0xffffffffu);
+    if (bits % 32 != 0) r.push_back((1u << bits % 32) - 1);
+    return r;
+}
+
+Limbs shiftLeft(const Limbs &a, size_t bits) {
+    if (a.empty()) return a;
+    size_t s = bits % 32;
+    Limbs r(bits / 32, 0);
+    r.reserve(r.size() + a.size() + 1);
+    if (s == 0) {
+        r.insert(r.end(), a.begin(), a.end());
+        return r;
+    }
+    uint32_t carry = 0;
+    for (uint32_t x : a) {
+        r.push_back(x << s | carry);
+        carry = x >> (32 - s);
+    }
+    if (carry != 0) r.push_back(carry);
+    return r;
+}
+
+Limbs shiftRight(const Limbs &a, size_t bits) {
+    size_t skip = bits / 32, s = bits % 32;
+    if (skip >= a.size()) return Limbs();
+    Limbs r(a.begin() + skip, a.end());
+    if (s != 0) {
+        for (size_t i = 0; i < r.size(); ++i)
+            r[i] = r[i] >> s | (i + 1 < r.size() ? r[i + 1] << (32 - s) : 0);
+    }
+    trim(r);
+    return r;
+}
+
+// a mod 2^bits
+Limbs lowBits(const Limbs &a, size_t bits) {
+    size_t whole = bits / 32, s = bits % 32;
+    Limbs r(a.begin(), a.begin() + std::min(a.size(), whole + (s != 0)));
+    if (s != 0 && r.size() == whole + 1) r[whole] &= (1u << s) - 1;
+    trim(r);
+    return r;
+}
+
+// a = a * m + c
+void mulAddSmall(Limbs &a, uint32_t m, uint32_t c) {
+    uint64_t carry = c;
+    for (uint32_t &x : a) {
+        carry += (uint64_t)x * m;
+        x = (uint32_t)carry;
+        carry >>= 32;
+    }
+    if (carry != 0) a.push_back((uint32_t)carry);
+}
+
+// a /= d, returning the remainder
+uint32_t divSmall(Limbs &a, uint32_t d) {
+    uint64_t rem = 0;
+    for (size_t i = a.size(); i-- > 0;) {
+        uint64_t cur = rem << 32 | a[i];
+        a[i] = (uint32_t)(cur / d);
+        rem = cur % d;
+    }
+    trim(a);
+    return (uint32_t)rem;
+}
+
+Limbs mulSchoolbook(const Limbs &a, const Limbs &b) {
+    Limbs r(a.size() + b.size(), 0);
+    for (size_t i = 0; i < a.size(); ++i) {
+        uint64_t x = a[i], carry = 0;
+        if (x == 0) continue;
+        for (size_t j = 0; j < b.size(); ++j) {
+            carry += x * b[j] + r[i + j];
+            r[i + j] = (uint32_t)carry;
+            carry >>= 32;
+        }
+        r[i + b.size()] = (uint32_t)carry;
+    }
+    trim(r);
+    return r;
+}
+
+Limbs mulMag(const Limbs &a, const Limbs &b) {
+    const Limbs &x = a.size() <= b.size() ? a : b;
+    const Limbs &y = a.size() <= b.size() ? b : a;
+    if (x.empty()) return Limbs();
+    if (x.size() < KARATSUBA_CUTOFF) return mulSchoolbook(x, y);
+    if (2 * x.size() <= y.size()) {
+        // Unbalanced: multiply by pieces of y as long as x
+        Limbs r;
+        for (size_t i = 0; i < y.size(); i += x.size())
+            addTo(r, mulMag(x, slice(y, i, i + x.size())), i);
+        trim(r);
+        return r;
+    }
+    // x = x1 B + x0 and y = y1 B + y0, with B = 2^(32h):
+    // xy = z2 B^2 + ((x0 + x1)(y0 + y1) - z2 - z0) B + z0
+    size_t h = y.size() / 2;
+    Limbs x0 = slice(x, 0, h), x1 = slice(x, h, x.size());
+    Limbs y0 = slice(y, 0, h), y1 = slice(y, h, y.size());
+    Limbs z0 = mulMag(x0, y0);
+    Limbs z2 = mulMag(x1, y1);
+    addTo(x0, x1);
+    addTo(y0, y1);
+    Limbs z1 = mulMag(x0, y0);
+    subFrom(z1, z0);
+    subFrom(z1, z2);
+    Limbs r = z0;
+    addTo(r, z1, h);
+    addTo(r, z2, 2 * h);
+    trim(r);
+    return r;
+}
+
+// Knuth's algorithm D, for v of at least two limbs and u >= v
+void divKnuth(const Limbs &u, const Limbs &v, Limbs &q, Limbs &r) {
+    const uint64_t BASE = (uint64_t)1 << 32;
+    size_t n = v.size(), m = u.size();
+    int s = __builtin_clz(v.back());
+    Limbs vn = shiftLeft(v, s);
+    Limbs un = shiftLeft(u, s);
+    un.resize(m + 1, 0);
+    q.assign(m - n + 1, 0);
+    for (size_t j = m - n + 1; j-- > 0;) {
+        uint64_t top = (uint64_t)un[j + n] << 32 | un[j + n - 1];
+        uint64_t qhat = top / vn[n - 1];
+        uint64_t rhat = top % vn[n - 1];
+        while (qhat >= BASE || qhat * vn[n - 2] > (rhat << 32 | un[j + n - 2])) {
+            --qhat;
+            rhat += vn[n - 1];
+            if (rhat >= BASE) break;
+        }
+        uint64_t carry = 0;
+        int64_t borrow = 0;
+        for (size_t i = 0; i < n; ++i) {
+            uint64_t p = qhat * vn[i] + carry;
+            carry = p >> 32;
+            int64_t t = (int64_t)un[i + j] - (int64_t)(uint32_t)p - borrow;
+            un[i + j] = (uint32_t)t;
+            borrow = t < 0;
+        }
+        int64_t t = (int64_t)un[j + n] - (int64_t)carry - borrow;
+        un[j + n] = (uint32_t)t;
+        if (t < 0) {
+            // qhat was one too large: add v back
+            --qhat;
+            uint64_t c = 0;
+            for (size_t i = 0; i < n; ++i) {
+                c += (uint64_t)un[i + j] + vn[i];
+                un[i + j] = (uint32_t)c;
+                c >>= 32;
+            }
+            un[j + n] += (uint32_t)c;
+        }
+        q[j] = (uint32_t)qhat;
+    }
+    trim(q);
+    un.resize(n);
+    r = shiftRight(un, s);
+}
+
+void divBasic(const Limbs &a, const Limbs &b, Limbs &q, Limbs &r) {
+    if (compareMag(a, b) < 0) {
+        q.clear();
+        r = a;
+    } else if (b.size() == 1) {
+        q = a;
+        uint32_t rem = divSmall(q, b[0]);
+        r.clear();
+        if (rem != 0) r.push_back(rem);
+    } else {
+        divKnuth(a, b, q, r);
+    }
+}
+
+void div3n2n(const Limbs &, const Limbs &, const Limbs &, const Limbs &, const Limbs &, size_t,
+             Limbs &, Limbs &);
+
+// Divides a < b 2^n by b of exactly n bits
+void div2n1n(const Limbs &a, const Limbs &b, size_t n, Limbs &q, Limbs &r) {
+    if (bitLength(a) <= n + 32 * BZ_CUTOFF) {
+        divBasic(a, b, q, r);
+        return;
+    }
+    bool pad = n % 2 != 0;
+    Limbs ap = pad ? shiftLeft(a, 1) : a;
+    Limbs bp = pad ? shiftLeft(b, 1) : b;
+    if (pad) ++n;
+    size_t half = n / 2;
+    Limbs b1 = shiftRight(bp, half), b2 = lowBits(bp, half);
+    Limbs q1, q2, rest;
+    div3n2n(shiftRight(ap, n), lowBits(shiftRight(ap, half), half), bp, b1, b2, half, q1, rest);
+    div3n2n(rest, lowBits(ap, half), bp, b1, b2, half, q2, r);
+    if (pad) r = shiftRight(r, 1);
+    q = shiftLeft(q1, half);
+    addTo(q, q2);
+}
+
+// Divides a12 2^n + a3 by b = b1 2^n + b2, where the quotient fits in n bits
+void div3n2n(const Limbs &a12, const Limbs &a3, const Limbs &b, const Limbs &b1, const Limbs &b2,
+             size_t n, Limbs &q, Limbs &r) {
+    Limbs t;
+    if (compareMag(shiftRight(a12, n), b1) == 0) {
+        q = allOnes(n);
+        t = a12;
+        addTo(t, b1);
+        subFrom(t, shiftLeft(b1, n));
+    } else {
+        div2n1n(a12, b1, n, q, t);
+    }
+    t = shiftLeft(t, n);
+    addTo(t, a3);
+    Limbs s = mulMag(q, b2);
+    while (compareMag(t, s) < 0) {
+        decrement(q);
+        addTo(t, b);
+    }
+    subFrom(t, s);
+    r = t;
+}
+
+void divMag(const Limbs &a, const Limbs &b, Limbs &q, Limbs &r) {
+    if (b.size() < BZ_CUTOFF || a.size() < b.size() + BZ_CUTOFF) {
+        divBasic(a, b, q, r);
+        return;
+    }
+    // Long division in base 2^n, each digit step recursive
+    size_t n = bitLength(b);
+    size_t digits = (bitLength(a) + n - 1) / n;
+    q.clear();
+    r.clear();
+    for (size_t i = digits; i-- > 0;) {
+        Limbs cur = shiftLeft(r, n);
+        addTo(cur, lowBits(shiftRight(a, i * n), n));
+        Limbs digit;
+        div2n1n(cur, b, n, digit, r);
+        q = shiftLeft(q, n);
+        addTo(q, digit);
+    }
+    trim(q);
+}
+
+BigInt make(bool neg, const Limbs &mag) {
+    BigInt r;
+    r.mag = mag;
+    r.neg = neg && !mag.empty();
+    return r;
+}
+
+} // namespace
+
+BigInt::BigInt() : neg(false) {}
+
+BigInt::BigInt(long long v) : neg(v < 0) {
+    unsigned long long m = neg ? 0 - (unsigned long long)v : (unsigned long long)v;
+    while (m != 0) {
+        mag.push_back((uint32_t)m);
+        m >>= 32;
+    }
+}
+
+bool BigInt::isZero() const {
+    return mag.empty();
+}
+
+bool BigInt::fitsInt() const {
+    if (mag.empty()) return true;
+    return mag.size() == 1 && mag[0] <= (neg ? 0x80000000u : 0x7fffffffu);
+}
+
+int BigInt::toInt() const {
+    if (mag.empty()) return 0;
+    return (int)(neg ? -(long long)mag[0] : (long long)mag[0]);
+}
+
+bool BigInt::fitsLong() const {
+    if (mag.size() <= 1) return true;
+    if (mag.size() > 2) return false;
+    uint64_t m = (uint64_t)mag[1] << 32 | mag[0];
+    return m <= (neg ? 0x8000000000000000ull : 0x7fffffffffffffffull);
+}
+
+long long BigInt::toLong() const {
+    uint64_t m = 0;
+    for (size_t i = mag.size(); i-- > 0;) m = m << 32 | mag[i];
+    return neg ? (long long)(0 - m) : (long long)m;
+}
+
+std::string BigInt::toString() const {
+    if (mag.empty()) return "0";
+    Limbs rest = mag;
+    std::vector<uint32_t> chunks;     // Base 10^9 digits, least significant first
+    while (!rest.empty()) chunks.push_back(divSmall(rest, 1000000000));
+    std::string s = neg ? "-" : "";
+    s += std::to_string(chunks.back());
+    for (size_t i = chunks.size() - 1; i-- > 0;) {
+        std::string digits = std::to_string(chunks[i]);
+        s.append(9 - digits.size(), '0');
+        s += digits;
+    }
+    return s;
+}
+
+BigInt BigInt::operator-() const {
+    return make(!neg, mag);
+}
+
+bool BigInt::parse(const std::string &s, BigInt &result) {
+    size_t i = 0;
+    bool negative = false;
+    if (!s.empty() && (s[0] == '+' || s[0] == '-')) {
+        negative = s[0] == '-';
+        i = 1;
+    }
+    if (i == s.size()) return false;
+    for (size_t j = i; j < s.size(); ++j)
+        if (s[j] < '0' || s[j] > '9') return false;
+    Limbs mag;
+    // Nine digits at a time, the first group taking the odd ones
+    size_t group = (s.size() - i) % 9;
+    if (group == 0) group = 9;
+    while (i < s.size()) {
+        uint32_t chunk = 0, scale = 1;
+        for (size_t end = i + group; i < end; ++i) {
+            chunk = chunk * 10 + (s[i] - '0');
+            scale *= 10;
+        }
+        mulAddSmall(mag, scale, chunk);
+        group = 9;
+    }
+    trim(mag);
+    result = make(negative, mag);
+    return true;
+}
+
+BigInt BigInt::fromInt128(__int128 v) {
+    unsigned __int128 m = v < 0 ? 0 - (unsigned __int128)v : (unsigned __int128)v;
+    Limbs mag;
+    for (; m != 0; m >>= 32) mag.push_back((uint32_t)m);
+    return make(v < 0, mag);
+}
+
+BigInt operator+(const BigInt &a, const BigInt &b) {
+    if (a.neg == b.neg) {
+        Limbs r = a.mag;
+        addTo(r, b.mag);
+        return make(a.neg, r);
+    }
+    if (compareMag(a.mag, b.mag) >= 0) {
+        Limbs r = a.mag;
+        subFrom(r, b.mag);
+        return make(a.neg, r);
+    }
+    Limbs r = b.mag;
+    subFrom(r, a.mag);
+    return make(b.neg, r);
+}
+
+BigInt operator-(const BigInt &a, const BigInt &b) {
+    return a + (-b);
+}
+
+BigInt operator*(const BigInt &a, const BigInt &b) {
+    return make(a.neg != b.neg, mulMag(a.mag, b.mag));
+}
+
+int compare(const BigInt &a, const BigInt &b) {
+    if (a.neg != b.neg) return a.neg ? -1 : 1;
+    int c = compareMag(a.mag, b.mag);
+    return a.neg ? -c : c;
+}
+
+void divMod(const BigInt &a, const BigInt &b, BigInt &q, BigInt &r) {
+    // divMag normalizes by the divisor's top limb, which a zero lacks
+    if (b.isZero()) throw RuntimeError("Division by zero");
+    Limbs qm, rm;
+    divMag(a.mag, b.mag, qm, rm);
+    q = make(a.neg != b.neg, qm);
+    r = make(a.neg, rm);
+}
+
+BigInt gcd(BigInt a, BigInt b) {
+    a.neg = b.neg = false;
+    while (!b.isZero()) {
+        BigInt q, r;
+        divMod(a, b, q, r);
+        a = b;
+        b = r;
+    }
+    return a;
+}
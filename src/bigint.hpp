@@ -0,0 +1,50 @@
+#ifndef BIGINT_HPP
+#define BIGINT_HPP
+
+/**
+ * @file bigint.hpp
+ * @brief Arbitrary-precision integers
+ *
+ * A BigInt is a sign and a magnitude of 32-bit limbs, least significant
+ * first, without leading zero limbs; zero has no limbs and is never
+ * negative. The evaluator only builds one when a fixnum result overflows,
+ * so the operations favour large operands: products of long operands use
+ * Karatsuba, and quotients by long divisors are computed recursively
+ * (Burnikel-Ziegler) on top of it.
+ */
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct BigInt {
+    bool neg;                       ///< Sign, false for zero
+    std::vector<uint32_t> mag;      ///< Magnitude, least significant limb first
+    BigInt();
+    explicit BigInt(long long);
+    bool isZero() const;
+    bool fitsInt() const;
+    int toInt() const;              ///< Only when fitsInt()
+    bool fitsLong() const;
+    long long toLong() const;       ///< Only when fitsLong()
+    std::string toString() const;
+    BigInt operator-() const;
+    static bool parse(const std::string &, BigInt &);
+    static BigInt fromInt128(__int128);
+};
+
+BigInt operator+(const BigInt &, const BigInt &);
+BigInt operator-(const BigInt &, const BigInt &);
+BigInt operator*(const BigInt &, const BigInt &);
+int compare(const BigInt &, const BigInt &);
+
+/**
+ * @brief Truncating division: a = q * b + r with r of the sign of a
+ * @throws RuntimeError if b is zero
+ */
+void divMod(const BigInt &a, const BigInt &b, BigInt &q, BigInt &r);
+
+/// Greatest common divisor, non-negative
+BigInt gcd(BigInt, BigInt);
+
+#endif
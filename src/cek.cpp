@@ -0,0 +1,560 @@
+/**
+ * @file cek.cpp
+ * @brief Explicit-continuation (CEK) evaluator
+ *
+ * The machine alternates between evaluating an expression in an environment
+ * and returning a value to the innermost continuation frame. Frames are kept
+ * in fixed-size segments linked towards the bottom of the stack. call/cc
+ * seals the current segment and shares it with the continuation; control
+ * that later returns into a shared segment works on a private copy of it,
+ * one segment at a time. A continuation that was only used to escape (or
+ * not used at all) is usually dead by then, so nothing gets copied.
+ */
+
+#include "cek.hpp"
+#include "RE.hpp"
+
+namespace {
+
+enum KontKind {
+    K_VALUE,        ///< An evaluated operand, waiting under the frame that needs it
+    K_BODY,         ///< Return from a closure body; v keeps the closure alive
+    K_IF,
+    K_SEQ,          ///< i: next expression of a Begin
+    K_COND,         ///< i: clause whose test is being evaluated
+    K_CLAUSE,       ///< i: clause, j: next expression of its body
+    K_AND,          ///< i: next operand
+    K_OR,           ///< i: next operand
+    K_UNARY,
+    K_BINARY,       ///< i = 1 once the first operand is in v
+    K_VARIADIC,     ///< i: operand just evaluated
+    K_APPLY,        ///< i: operand just evaluated, 0 being the operator (then in v)
+    K_LET,          ///< i: init just evaluated
+    K_LETREC,       ///< i: init just evaluated; env is the new frame
+    K_DEFINE,
+    K_SET,
+    K_CALLCC
+};
+
+struct Kont {
+    KontKind kind;
+    int i;
+    int j;
+    ExprBase *node;
+    Assoc env;
+    Value v;
+    Kont(KontKind kind, ExprBase *node, const Assoc &env, int i = 0, int j = 0)
+        : kind(kind), i(i), j(j), node(node), env(env), v(nullptr) {}
+};
+
+const size_t SEGMENT_SIZE = 1024;
+
+/**
+ * @brief Part of the continuation stack, owned by whoever refers to it: the
+ * machine (for its top segment), the segment above it, and continuations
+ */
+struct Segment : Collectable {
+    Segment *next;          ///< Older frames
+    std::vector<Kont> items;
+    explicit Segment(Segment *next) : next(next) { refs = 1; }
+    void trace(Tracer &t) override;
+    void clear() override;
+};
+
+void release(Segment *s) {
+    while (s != nullptr && --s->refs == 0) {
+        Segment *next = s->next;
+        delete s;
+        s = next;
+    }
+}
+
+void Segment::trace(Tracer &t) {
+    if (next != nullptr) t.visit(next);
+    for (Kont &k : items) {
+        visit(t, k.env);
+        visit(t, k.v);
+    }
+}
+
+void Segment::clear() {
+    items.clear();
+    release(next);
+    next = nullptr;
+}
+
+struct CekContinuation : Continuation {
+    Segment *seg;
+    Expr form;              ///< Top-level form the bottom frames belong to
+    CekContinuation(Segment *seg, const Expr &form) : seg(seg), form(form) {}
+    ~CekContinuation() { release(seg); }
+    void trace(Tracer &t) override {
+        if (seg != nullptr) t.visit(seg);
+    }
+    void clear() override {
+        release(seg);
+        seg = nullptr;
+    }
+};
+
+class KStack {
+    Segment *top;
+
+    // Step down into the older segment once the top one is used up
+    void underflow() {
+        while (top->items.empty() && top->next != nullptr) {
+            Segment *below = top->next;
+            top->next = nullptr;
+            release(top);
+            if (below->refs > 1) {
+                // Shared with a continuation: work on a copy
+                Segment *copy = new Segment(below->next);
+                if (below->next != nullptr) ++below->next->refs;
+                copy->items = below->items;
+                --below->refs;
+                below = copy;
+            }
+            top = below;
+        }
+    }
+
+public:
+    KStack() : top(new Segment(nullptr)) {}
+    ~KStack() { release(top); }
+
+    bool empty() {
+        underflow();
+        return top->items.empty();
+    }
+
+    void push(Kont &&k) {
+        if (top->items.size() == SEGMENT_SIZE) {
+            top = new Segment(top);
+            top->items.reserve(SEGMENT_SIZE);
+        }
+        top->items.push_back(std::move(k));
+    }
+
+    void pushValue(const Value &v) {
+        push(Kont(K_VALUE, nullptr, Assoc(nullptr)));
+        top->items.back().v = v;
+    }
+
+    Kont &back() {
+        underflow();
+        return top->items.back();
+    }
+
+    Kont pop() {
+        underflow();
+        Kont k = std::move(top->items.back());
+        top->items.pop_back();
+        return k;
+    }
+
+    /// Pops the n operand values under the top frame, oldest first
+    std::vector<Value> popValues(size_t n) {
+        std::vector<Value> vals(n, Value(nullptr));
+        for (size_t i = n; i > 0; --i) vals[i - 1] = std::move(pop().v);
+        return vals;
+    }
+
+    /// Seals everything pushed so far; the result owns one reference
+    Segment *capture() {
+        Segment *sealed = top;
+        ++sealed->refs;
+        top = new Segment(sealed);
+        return sealed;
+    }
+
+    void reinstate(Segment *seg) {
+        release(top);
+        ++seg->refs;
+        top = new Segment(seg);
+    }
+};
+
+struct Machine {
+    KStack k;
+    Expr form;
+    ExprBase *c;
+    Assoc env;
+    Value val;
+    bool returning;
+
+    Machine(const Expr &form, const Assoc &env)
+        : form(form), c(form.get()), env(env), val(nullptr), returning(false) {}
+
+    void eval(ExprBase *x, const Assoc &e) {
+        c = x;
+        if (env.get() != e.get()) env = e;
+        returning = false;
+    }
+
+    void ret(const Value &v) {
+        val = v;
+        returning = true;
+    }
+
+    void clause(Cond *cd, size_t i, const Assoc &e);
+    void clauseBody(Cond *cd, size_t i, size_t j, const Assoc &e);
+    void apply(const Value &f, size_t argc);
+    void evalStep();
+    void returnStep();
+    Value run();
+};
+
+void Machine::clause(Cond *cd, size_t i, const Assoc &e) {
+    static const SymbolId else_sym = intern("else");
+    if (i >= cd->clauses.size()) {
+        ret(VoidV());
+        return;
+    }
+    auto &cl = cd->clauses[i];
+    if (cl.size() > 1 && cl[0]->e_type == E_VAR && static_cast<Var *>(cl[0].get())->x == else_sym) {
+        clauseBody(cd, i, 1, e);
+        return;
+    }
+    k.push(Kont(K_COND, cd, e, (int)i));
+    eval(cl[0].get(), e);
+}
+
+void Machine::clauseBody(Cond *cd, size_t i, size_t j, const Assoc &e) {
+    auto &cl = cd->clauses[i];
+    if (j + 1 < cl.size()) k.push(Kont(K_CLAUSE, cd, e, (int)i, (int)j + 1));
+    eval(cl[j].get(), e);
+}
+
+// The arguments are the top argc operand values on the stack
+void Machine::apply(const Value &f, size_t argc) {
+    if (f.type() == V_CONTINUATION) {
+        CekContinuation *kont = dynamic_cast<CekContinuation *>(f.get());
+        if (kont == nullptr) throw RuntimeError("continuation can no longer be resumed");
+        if (argc != 1) throw RuntimeError("Wrong number of arguments");
+        Value v = std::move(k.pop().v);
+        Value hold = f;
+        k.reinstate(kont->seg);
+        form = kont->form;
+        ret(v);
+        return;
+    }
+    if (f.type() == V_PRIMITIVE) {
+        PrimitiveProcedure *prim = static_cast<PrimitiveProcedure *>(f.get());
+        if (!prim->accepts(argc)) throw RuntimeError("Wrong number of arguments");
+        if (prim->fn == nullptr) {
+            // call/cc as a value, as K_CALLCC
+            Value receiver = std::move(k.pop().v);
+            if (!isProcedure(receiver)) throw RuntimeError("Attempt to apply a non-procedure");
+            k.pushValue(Value(new CekContinuation(k.capture(), form)));
+            apply(receiver, 1);
+            return;
+        }
+        std::vector<Value> args = k.popValues(argc);
+        ret(prim->fn(args));
+        return;
+    }
+    Procedure *clos = static_cast<Procedure *>(f.get());
+    if (argc != clos->parameters.size()) throw RuntimeError("Wrong number of arguments");
+    Assoc frame = extend((int)argc + clos->locals, clos->env);
+    Value *slots = frame->slots();
+    for (size_t i = argc; i > 0; --i) slots[i - 1] = std::move(k.pop().v);
+    if (!clos->boxed.empty()) boxSlots(frame, clos->boxed);
+    gcSafePoint();
+    // A call made in tail position replaces the body it returns from
+    if (!k.empty() && k.back().kind == K_BODY) {
+        k.back().v = f;
+    } else {
+        k.push(Kont(K_BODY, nullptr, Assoc(nullptr)));
+        k.back().v = f;
+    }
+    eval(clos->e.get(), frame);
+}
+
+void Machine::evalStep() {
+    switch (c->e_type) {
+        case E_FIXNUM:
+        case E_BIGNUM:
+        case E_RATIONAL:
+        case E_STRING:
+        case E_TRUE:
+        case E_FALSE:
+        case E_VOID:
+        case E_EXIT:
+        case E_GC:
+        case E_READ:
+        case E_QUOTE:
+        case E_VAR:
+        case E_LAMBDA:
+            // No subexpressions to evaluate, so no continuation frame
+            ret(c->eval(env));
+            return;
+        case E_IF:
+            k.push(Kont(K_IF, c, env));
+            eval(static_cast<If *>(c)->cond.get(), env);
+            return;
+        case E_BEGIN: {
+            Begin *b = static_cast<Begin *>(c);
+            if (b->es.empty()) {
+                ret(VoidV());
+                return;
+            }
+            if (b->es.size() > 1) k.push(Kont(K_SEQ, c, env, 1));
+            eval(b->es[0].get(), env);
+            return;
+        }
+        case E_COND:
+            clause(static_cast<Cond *>(c), 0, env);
+            return;
+        case E_AND: {
+            AndVar *a = static_cast<AndVar *>(c);
+            if (a->rands.empty()) {
+                ret(BooleanV(true));
+                return;
+            }
+            if (a->rands.size() > 1) k.push(Kont(K_AND, c, env, 1));
+            eval(a->rands[0].get(), env);
+            return;
+        }
+        case E_OR: {
+            OrVar *o = static_cast<OrVar *>(c);
+            if (o->rands.empty()) {
+                ret(BooleanV(false));
+                return;
+            }
+            if (o->rands.size() > 1) k.push(Kont(K_OR, c, env, 1));
+            eval(o->rands[0].get(), env);
+            return;
+        }
+        case E_APPLY:
+            k.push(Kont(K_APPLY, c, env, 0));
+            eval(static_cast<Apply *>(c)->rator.get(), env);
+            return;
+        case E_LET: {
+            Let *l = static_cast<Let *>(c);
+            if (l->bind.empty()) {
+                Assoc frame = extend((int)l->locals.size(), env);
+                boxSlots(frame, l->boxed);
+                eval(l->body.get(), frame);
+                return;
+            }
+            k.push(Kont(K_LET, c, env, 0));
+            eval(l->bind[0].second.get(), env);
+            return;
+        }
+        case E_LETREC: {
+            Letrec *l = static_cast<Letrec *>(c);
+            Assoc frame = extend((int)(l->bind.size() + l->locals.size()), env);
+            boxSlots(frame, l->boxed);
+            if (l->bind.empty()) {
+                eval(l->body.get(), frame);
+                return;
+            }
+            k.push(Kont(K_LETREC, c, frame, 0));
+            eval(l->bind[0].second.get(), frame);
+            return;
+        }
+        case E_DEFINE: {
+            Define *d = static_cast<Define *>(c);
+            if (!d->local) d->cell->v = VoidV();
+            k.push(Kont(K_DEFINE, c, env));
+            eval(d->e.get(), env);
+            return;
+        }
+        case E_SET: {
+            Set *s = static_cast<Set *>(c);
+            const Value &target = s->local ? binding(locate(s->depth, s->slot, env), s->boxed) : s->cell->v;
+            if (target.unbound()) throw RuntimeError("set!: undefined variable");
+            k.push(Kont(K_SET, c, env));
+            eval(s->e.get(), env);
+            return;
+        }
+        case E_CALLCC:
+            k.push(Kont(K_CALLCC, c, env));
+            eval(static_cast<CallCC *>(c)->rand.get(), env);
+            return;
+        default:
+            break;
+    }
+    // Primitive operations evaluate their operands on the machine too
+    if (c->shape == S_UNARY) {
+        k.push(Kont(K_UNARY, c, env));
+        eval(static_cast<Unary *>(c)->rand.get(), env);
+    } else if (c->shape == S_BINARY) {
+        k.push(Kont(K_BINARY, c, env));
+        eval(static_cast<Binary *>(c)->rand1.get(), env);
+    } else if (c->shape == S_VARIADIC) {
+        Variadic *v = static_cast<Variadic *>(c);
+        if (v->rands.empty()) {
+            std::vector<Value> none;
+            ret(v->evalRator(none));
+            return;
+        }
+        k.push(Kont(K_VARIADIC, c, env, 0));
+        eval(v->rands[0].get(), env);
+    } else {
+        throw RuntimeError("cek: unknown expression");
+    }
+}
+
+void Machine::returnStep() {
+    Kont f = k.pop();
+    switch (f.kind) {
+        case K_BODY:
+            return;
+        case K_IF: {
+            If *i = static_cast<If *>(f.node);
+            eval(val.isFalse() ? i->alter.get() : i->conseq.get(), f.env);
+            return;
+        }
+        case K_SEQ: {
+            Begin *b = static_cast<Begin *>(f.node);
+            if ((size_t)f.i + 1 < b->es.size()) k.push(Kont(K_SEQ, f.node, f.env, f.i + 1));
+            eval(b->es[f.i].get(), f.env);
+            return;
+        }
+        case K_COND: {
+            Cond *cd = static_cast<Cond *>(f.node);
+            if (val.isFalse()) clause(cd, f.i + 1, f.env);
+            else if (cd->clauses[f.i].size() > 1) clauseBody(cd, f.i, 1, f.env);
+            return;
+        }
+        case K_CLAUSE:
+            clauseBody(static_cast<Cond *>(f.node), f.i, f.j, f.env);
+            return;
+        case K_AND: {
+            AndVar *a = static_cast<AndVar *>(f.node);
+            if (val.isFalse()) return;
+            if ((size_t)f.i + 1 < a->rands.size()) k.push(Kont(K_AND, f.node, f.env, f.i + 1));
+            eval(a->rands[f.i].get(), f.env);
+            return;
+        }
+        case K_OR: {
+            OrVar *o = static_cast<OrVar *>(f.node);
+            if (!val.isFalse()) return;
+            if ((size_t)f.i + 1 < o->rands.size()) k.push(Kont(K_OR, f.node, f.env, f.i + 1));
+            eval(o->rands[f.i].get(), f.env);
+            return;
+        }
+        case K_UNARY:
+            val = static_cast<Unary *>(f.node)->evalRator(val);
+            return;
+        case K_BINARY: {
+            Binary *b = static_cast<Binary *>(f.node);
+            if (f.i == 1) {
+                val = b->operate(f.v, val);
+                return;
+            }
+            Kont next(K_BINARY, f.node, f.env, 1);
+            next.v = val;
+            k.push(std::move(next));
+            eval(b->rand2.get(), f.env);
+            return;
+        }
+        case K_VARIADIC: {
+            Variadic *v = static_cast<Variadic *>(f.node);
+            k.pushValue(val);
+            size_t done = f.i + 1;
+            if (done < v->rands.size()) {
+                k.push(Kont(K_VARIADIC, f.node, f.env, (int)done));
+                eval(v->rands[done].get(), f.env);
+                return;
+            }
+            std::vector<Value> args = k.popValues(done);
+            val = v->evalRator(args);
+            return;
+        }
+        case K_APPLY: {
+            Apply *ap = static_cast<Apply *>(f.node);
+            if (f.i == 0) {
+                if (!isProcedure(val)) throw RuntimeError("Attempt to apply a non-procedure");
+                f.v = val;
+            } else {
+                k.pushValue(val);
+            }
+            size_t done = f.i;
+            if (done < ap->rand.size()) {
+                Kont next(K_APPLY, f.node, f.env, (int)done + 1);
+                next.v = std::move(f.v);
+                k.push(std::move(next));
+                eval(ap->rand[done].get(), f.env);
+                return;
+            }
+            apply(f.v, done);
+            return;
+        }
+        case K_LET: {
+            Let *l = static_cast<Let *>(f.node);
+            k.pushValue(val);
+            size_t done = f.i + 1;
+            if (done < l->bind.size()) {
+                k.push(Kont(K_LET, f.node, f.env, (int)done));
+                eval(l->bind[done].second.get(), f.env);
+                return;
+            }
+            std::vector<Value> inits = k.popValues(done);
+            Assoc frame = extend((int)(done + l->locals.size()), f.env);
+            Value *slots = frame->slots();
+            for (size_t i = 0; i < done; ++i) slots[i] = std::move(inits[i]);
+            boxSlots(frame, l->boxed);
+            eval(l->body.get(), frame);
+            return;
+        }
+        case K_LETREC: {
+            Letrec *l = static_cast<Letrec *>(f.node);
+            binding(f.env->slots()[f.i], l->isBoxed(f.i)) = val;
+            size_t next = f.i + 1;
+            if (next < l->bind.size()) {
+                k.push(Kont(K_LETREC, f.node, f.env, (int)next));
+                eval(l->bind[next].second.get(), f.env);
+                return;
+            }
+            eval(l->body.get(), f.env);
+            return;
+        }
+        case K_DEFINE: {
+            Define *d = static_cast<Define *>(f.node);
+            if (d->local) binding(locate(d->depth, d->slot, f.env), d->boxed) = val;
+            else {
+                settle(val);
+                d->cell->v = val;
+            }
+            val = SymbolV(d->var);
+            return;
+        }
+        case K_SET: {
+            Set *s = static_cast<Set *>(f.node);
+            if (s->local) binding(locate(s->depth, s->slot, f.env), s->boxed) = val;
+            else {
+                settle(val);
+                s->cell->v = val;
+            }
+            val = VoidV();
+            return;
+        }
+        case K_CALLCC: {
+            if (!isProcedure(val)) throw RuntimeError("Attempt to apply a non-procedure");
+            Value receiver = val;
+            k.pushValue(Value(new CekContinuation(k.capture(), form)));
+            apply(receiver, 1);
+            return;
+        }
+        case K_VALUE:
+            break;
+    }
+    throw RuntimeError("cek: corrupt continuation");
+}
+
+Value Machine::run() {
+    for (;;) {
+        if (!returning) evalStep();
+        else if (k.empty()) return val;
+        else returnStep();
+    }
+}
+
+} // namespace
+
+Value cekEval(const Expr &expr, Assoc &env) {
+    Machine m(expr, env);
+    return m.run();
+}
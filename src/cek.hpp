@@ -0,0 +1,21 @@
+#ifndef CEK_HPP
+#define CEK_HPP
+
+/**
+ * @file cek.hpp
+ * @brief Explicit-continuation (CEK) evaluator
+ *
+ * A third execution engine that walks the same Expr tree as the tree walker
+ * but never nests C++ calls: the machine state is the control expression,
+ * its environment and a continuation kept as frames in heap segments. Deep
+ * non-tail recursion is bounded by memory only, and call/cc captures the
+ * continuation in constant time.
+ */
+
+#include "Def.hpp"
+#include "expr.hpp"
+#include "value.hpp"
+
+Value cekEval(const Expr &, Assoc &);
+
+#endif
@@ -0,0 +1,340 @@
+/**
+ * @file compiler.cpp
+ * @brief Compilation of parsed expressions to bytecode
+ *
+ * Every construct is translated so that it leaves exactly one value on the
+ * VM stack, with the same evaluation order (and the same checks, at the same
+ * points) as its eval() in evaluation.cpp.
+ */
+
+#include "vm.hpp"
+#include "RE.hpp"
+
+namespace {
+
+/**
+ * @brief One step of compilation: an expression to translate, or an
+ * instruction to emit once the steps before it have run
+ */
+struct Task {
+    enum Kind {
+        EXPR,       ///< Translate *e, leaving its value on the stack
+        EMIT,       ///< Emit op a b
+        JUMP,       ///< Emit a forward jump op, remembering where as label a
+        PATCH       ///< Point the jump of label a at the next instruction
+    } kind;
+    Chunk *chunk;
+    const Expr *e;
+    bool tail;
+    OpCode op;
+    int a, b;
+};
+
+/**
+ * Expressions are translated through a stack of steps rather than by
+ * recursion, so a deeply nested tree compiles in heap memory. Expanding an
+ * expression plans, in order, the steps that make up its code, with its
+ * subexpressions as steps of their own; lambda bodies are planned into
+ * their own chunks.
+ */
+struct Compiler {
+    std::vector<Task> work;     ///< Steps left, the next one last
+    std::vector<Task> plan;     ///< Steps of the expression being expanded
+    std::vector<int> labels;    ///< Where each forward jump was emitted
+    Chunk *chunk;               ///< The chunk the planned steps are for
+
+    void run(Chunk &top, const Expr &e) {
+        work.push_back(Task{Task::EXPR, &top, &e, false, OP_RETURN, 0, 0});
+        while (!work.empty()) {
+            Task t = work.back();
+            work.pop_back();
+            std::vector<Instr> &out = t.chunk->code;
+            switch (t.kind) {
+                case Task::EXPR:
+                    chunk = t.chunk;
+                    plan.clear();
+                    expr(*t.e, t.tail);
+                    work.insert(work.end(), plan.rbegin(), plan.rend());
+                    break;
+                case Task::EMIT:
+                    out.push_back(Instr{t.op, t.a, t.b});
+                    break;
+                case Task::JUMP:
+                    labels[t.a] = (int)out.size();
+                    out.push_back(Instr{t.op, 0, 0});
+                    break;
+                case Task::PATCH:
+                    out[labels[t.a]].a = (int)out.size();
+                    break;
+            }
+        }
+    }
+
+    void code(const Expr &e, bool tail) {
+        plan.push_back(Task{Task::EXPR, chunk, &e, tail, OP_RETURN, 0, 0});
+    }
+
+    void emit(OpCode op, int a = 0, int b = 0) {
+        plan.push_back(Task{Task::EMIT, chunk, nullptr, false, op, a, b});
+    }
+
+    int jump(OpCode op) {
+        labels.push_back(-1);
+        plan.push_back(Task{Task::JUMP, chunk, nullptr, false, op, (int)labels.size() - 1, 0});
+        return (int)labels.size() - 1;
+    }
+
+    void patch(int label) {
+        plan.push_back(Task{Task::PATCH, chunk, nullptr, false, OP_RETURN, label, 0});
+    }
+
+    int constant(const Value &v) {
+        chunk->consts.push_back(v);
+        return (int)chunk->consts.size() - 1;
+    }
+
+    int node(const Expr &e) {
+        chunk->nodes.push_back(e);
+        return (int)chunk->nodes.size() - 1;
+    }
+
+    int cell(GlobalCell *c) {
+        chunk->cells.push_back(c);
+        return (int)chunk->cells.size() - 1;
+    }
+
+    void sequence(const std::vector<Expr> &es, size_t from, bool tail) {
+        if (from >= es.size()) {
+            emit(OP_CONST, constant(VoidV()));
+            return;
+        }
+        for (size_t i = from; i < es.size(); ++i) {
+            if (i > from) emit(OP_POP);
+            code(es[i], tail && i + 1 == es.size());
+        }
+    }
+
+    void lambda(const Expr &e) {
+        Lambda *lam = static_cast<Lambda *>(e.get());
+        std::shared_ptr<Chunk> body = std::make_shared<Chunk>();
+        emit(OP_CLOSURE, node(e), (int)chunk->chunks.size());
+        chunk->chunks.push_back(body);
+        Chunk *outer = chunk;
+        chunk = body.get();
+        code(lam->e, true);
+        emit(OP_RETURN);
+        chunk = outer;
+    }
+
+    void cond(Cond *c, bool tail) {
+        static const SymbolId else_sym = intern("else");
+        std::vector<int> exits;
+        for (auto &cl : c->clauses) {
+            if (cl.size() == 1) {
+                code(cl[0], false);
+                exits.push_back(jump(OP_OR_JUMP));
+                continue;
+            }
+            if (cl[0]->e_type == E_VAR && static_cast<Var *>(cl[0].get())->x == else_sym) {
+                sequence(cl, 1, tail);
+                exits.push_back(jump(OP_JUMP));
+                break;
+            }
+            code(cl[0], false);
+            int skip = jump(OP_JUMP_IF_FALSE);
+            sequence(cl, 1, tail);
+            exits.push_back(jump(OP_JUMP));
+            patch(skip);
+        }
+        // Reached only when no clause was taken
+        emit(OP_CONST, constant(VoidV()));
+        for (int at : exits) patch(at);
+    }
+
+    void apply(Apply *ap, bool tail) {
+        code(ap->rator, false);
+        emit(OP_CHECK_PROC);
+        for (auto &r : ap->rand) code(r, false);
+        emit(tail ? OP_TAIL_CALL : OP_CALL, (int)ap->rand.size());
+    }
+
+    void expr(const Expr &e, bool tail) {
+        switch (e->e_type) {
+            case E_FIXNUM:
+                emit(OP_CONST, constant(IntegerV(static_cast<Fixnum *>(e.get())->n)));
+                return;
+            case E_BIGNUM:
+                emit(OP_CONST, constant(pooled(static_cast<BignumExpr *>(e.get())->constant)));
+                return;
+            case E_RATIONAL:
+                emit(OP_CONST, constant(pooled(static_cast<RationalNum *>(e.get())->constant)));
+                return;
+            case E_STRING:
+                emit(OP_CONST, constant(pooled(static_cast<StringExpr *>(e.get())->constant)));
+                return;
+            case E_TRUE:
+                emit(OP_CONST, constant(BooleanV(true)));
+                return;
+            case E_FALSE:
+                emit(OP_CONST, constant(BooleanV(false)));
+                return;
+            case E_VOID:
+                emit(OP_CONST, constant(VoidV()));
+                return;
+            case E_EXIT:
+                emit(OP_CONST, constant(TerminateV()));
+                return;
+            case E_QUOTE: {
+                Quote *q = static_cast<Quote *>(e.get());
+                // A malformed datum fails each time it is evaluated
+                if (q->constant < 0) emit(OP_EVAL, node(e));
+                else emit(OP_CONST, constant(pooled(q->constant)));
+                return;
+            }
+            case E_GC:
+            case E_READ:
+                emit(OP_EVAL, node(e));
+                return;
+            case E_AND: {
+                AndVar *a = static_cast<AndVar *>(e.get());
+                if (a->rands.empty()) {
+                    emit(OP_CONST, constant(BooleanV(true)));
+                    return;
+                }
+                std::vector<int> exits;
+                for (size_t i = 0; i < a->rands.size(); ++i) {
+                    code(a->rands[i], false);
+                    if (i + 1 < a->rands.size()) exits.push_back(jump(OP_AND_JUMP));
+                }
+                for (int at : exits) patch(at);
+                return;
+            }
+            case E_OR: {
+                OrVar *o = static_cast<OrVar *>(e.get());
+                std::vector<int> exits;
+                for (auto &r : o->rands) {
+                    code(r, false);
+                    exits.push_back(jump(OP_OR_JUMP));
+                }
+                emit(OP_CONST, constant(BooleanV(false)));
+                for (int at : exits) patch(at);
+                return;
+            }
+            case E_BEGIN:
+                sequence(static_cast<Begin *>(e.get())->es, 0, tail);
+                return;
+            case E_IF: {
+                If *i = static_cast<If *>(e.get());
+                code(i->cond, false);
+                int skip = jump(OP_JUMP_IF_FALSE);
+                code(i->conseq, tail);
+                int done = jump(OP_JUMP);
+                patch(skip);
+                code(i->alter, tail);
+                patch(done);
+                return;
+            }
+            case E_COND:
+                cond(static_cast<Cond *>(e.get()), tail);
+                return;
+            case E_VAR: {
+                Var *v = static_cast<Var *>(e.get());
+                if (v->local) {
+                    emit(OP_LOCAL, v->depth, v->slot);
+                    if (v->boxed) emit(OP_UNBOX);
+                } else {
+                    emit(OP_GLOBAL, cell(v->cell), node(e));
+                }
+                return;
+            }
+            case E_APPLY:
+                apply(static_cast<Apply *>(e.get()), tail);
+                return;
+            case E_LAMBDA:
+                lambda(e);
+                return;
+            case E_CALLCC:
+                code(static_cast<CallCC *>(e.get())->rand, false);
+                emit(OP_CALLCC);
+                return;
+            case E_DEFINE: {
+                Define *d = static_cast<Define *>(e.get());
+                if (d->local) {
+                    code(d->e, false);
+                    emit(d->boxed ? OP_STORE_BOX : OP_STORE_LOCAL, d->depth, d->slot);
+                } else {
+                    int at = cell(d->cell);
+                    emit(OP_DECLARE, at);
+                    code(d->e, false);
+                    emit(OP_STORE_GLOBAL, at);
+                }
+                emit(OP_CONST, constant(SymbolV(d->var)));
+                return;
+            }
+            case E_SET: {
+                Set *s = static_cast<Set *>(e.get());
+                emit(OP_CHECK_SET, node(e));
+                code(s->e, false);
+                if (s->local) emit(s->boxed ? OP_STORE_BOX : OP_STORE_LOCAL, s->depth, s->slot);
+                else emit(OP_STORE_GLOBAL, cell(s->cell));
+                emit(OP_CONST, constant(VoidV()));
+                return;
+            }
+            case E_LET: {
+                Let *l = static_cast<Let *>(e.get());
+                for (auto &b : l->bind) code(b.second, false);
+                emit(OP_ENTER, (int)l->bind.size(), (int)l->locals.size());
+                for (int slot : l->boxed) emit(OP_BOX, slot);
+                code(l->body, tail);
+                emit(OP_LEAVE);
+                return;
+            }
+            case E_LETREC: {
+                Letrec *l = static_cast<Letrec *>(e.get());
+                emit(OP_ENTER, 0, (int)(l->bind.size() + l->locals.size()));
+                for (int slot : l->boxed) emit(OP_BOX, slot);
+                for (size_t i = 0; i < l->bind.size(); ++i) {
+                    code(l->bind[i].second, false);
+                    emit(l->isBoxed(i) ? OP_STORE_BOX : OP_STORE_LOCAL, 0, (int)i);
+                }
+                code(l->body, tail);
+                emit(OP_LEAVE);
+                return;
+            }
+            default:
+                break;
+        }
+        // Everything else is a primitive operation
+        switch (e->shape) {
+            case S_UNARY:
+                code(static_cast<Unary *>(e.get())->rand, false);
+                emit(OP_PRIM1, node(e));
+                break;
+            case S_BINARY: {
+                Binary *b = static_cast<Binary *>(e.get());
+                code(b->rand1, false);
+                code(b->rand2, false);
+                emit(OP_PRIM2, node(e));
+                break;
+            }
+            case S_VARIADIC: {
+                Variadic *v = static_cast<Variadic *>(e.get());
+                for (auto &r : v->rands) code(r, false);
+                emit(OP_PRIMN, node(e), (int)v->rands.size());
+                break;
+            }
+            default:
+                throw RuntimeError("compile: unknown expression");
+        }
+    }
+};
+
+} // namespace
+
+std::shared_ptr<Chunk> compile(const Expr &e) {
+    std::shared_ptr<Chunk> chunk = std::make_shared<Chunk>();
+    Compiler c;
+    c.run(*chunk, e);
+    chunk->code.push_back(Instr{OP_RETURN, 0, 0});
+    return chunk;
+}
@@ -16,21 +16,74 @@
 #include <vector>
 #include <map>
 #include <climits>
-#include <functional>
+#include <algorithm>
 
-extern std::map<std::string, ExprType> primitives;
-extern std::map<std::string, ExprType> reserved_words;
+/**
+ * @brief Evaluator core: dispatches on the node's tag
+ *
+ * Variables and constants make up most of the nodes the tree walker
+ * visits, so they are evaluated right here; every other node goes through
+ * its eval(). Forced inline: it is on every path, and GCC's unit growth
+ * limits would otherwise leave it out of line in this large file.
+ */
+static inline __attribute__((always_inline)) Value evaluate(ExprBase *x, Assoc &env) {
+    switch (x->e_type) {
+        case E_VAR: {
+            Var *v = static_cast<Var*>(x);
+            const Value &bound = v->local ? binding(locate(v->depth, v->slot, env), v->boxed) : v->cell->v;
+            if (!bound.unbound()) return bound;
+            return v->Var::eval(env);   // Reports it, or wraps a primitive
+        }
+        case E_FIXNUM:
+            return IntegerV(static_cast<Fixnum*>(x)->n);
+        default:
+            return x->eval(env);
+    }
+}
+
+/**
+ * @brief Fixnum arithmetic with overflow checks
+ *
+ * The common case is one machine operation and no allocation; a result
+ * outside the fixnum range is recomputed in 64 bits (which cannot
+ * overflow for int operands) and promoted to a bignum, out of line.
+ */
+static Value __attribute__((noinline, cold)) promote(long long n) {
+    return IntegerV(BigInt(n));
+}
+
+static inline Value fixnumAdd(int a, int b) {
+    int r;
+    if (__builtin_add_overflow(a, b, &r)) return promote((long long)a + b);
+    return IntegerV(r);
+}
+
+static inline Value fixnumSub(int a, int b) {
+    int r;
+    if (__builtin_sub_overflow(a, b, &r)) return promote((long long)a - b);
+    return IntegerV(r);
+}
+
+static inline Value fixnumMul(int a, int b) {
+    int r;
+    if (__builtin_mul_overflow(a, b, &r)) return promote((long long)a * b);
+    return IntegerV(r);
+}
 
 Value Fixnum::eval(Assoc &e) { // evaluation of a fixnum
     return IntegerV(n);
 }
 
+Value BignumExpr::eval(Assoc &e) { // evaluation of a large integer
+    return pooled(constant);
+}
+
 Value RationalNum::eval(Assoc &e) { // evaluation of a rational number
-    return RationalV(numerator, denominator);
+    return pooled(constant);
 }
 
 Value StringExpr::eval(Assoc &e) { // evaluation of a string
-    return StringV(s);
+    return pooled(constant);
 }
 
 Value True::eval(Assoc &e) { // evaluation of #t
@@ -49,21 +102,186 @@ Value Exit::eval(Assoc &e) { // (exit)
     return TerminateV();
 }
 
+Value Collect::eval(Assoc &e) { // (gc)
+    collect();
+    return VoidV();
+}
+
+Value Read::eval(Assoc &e) { // (read)
+    return readDatum();
+}
+
 Value Unary::eval(Assoc &e) { // evaluation of single-operator primitive
-    return evalRator(rand->eval(e));
+    return evalRator(evaluate(rand.get(), e));
 }
 
 Value Binary::eval(Assoc &e) { // evaluation of two-operators primitive
-    return evalRator(rand1->eval(e), rand2->eval(e));
+    Value lhs = evaluate(rand1.get(), e);
+    return operate(lhs, evaluate(rand2.get(), e));
+}
+
+static SpecStats spec_stats = {0, 0, 0};
+
+SpecStats specStats() {
+    return spec_stats;
+}
+
+/**
+ * @brief Applies the operator, adapting the node to its operand types
+ *
+ * A fixnum arithmetic or comparison node starts unspecialized. Fixnum
+ * operands on the first run specialize it to the int-int path below, which
+ * skips the virtual evalRator. Anything else, then or later, rewrites it to
+ * the generic evalRator for good, so sites mixing in rationals stop
+ * paying for the check.
+ */
+Value Binary::operate(const Value &lhs, const Value &rhs) {
+    if (spec == SPEC_GENERIC) return evalRator(lhs, rhs);
+    bool ints = lhs.type() == V_INT && rhs.type() == V_INT;
+    if (spec == SPEC_NONE) {
+        spec = ints ? SPEC_INT : SPEC_GENERIC;
+        ++(ints ? spec_stats.monomorphic : spec_stats.generic);
+    } else if (!ints) {
+        spec = SPEC_GENERIC;
+        --spec_stats.monomorphic;
+        ++spec_stats.generic;
+        ++spec_stats.rewrites;
+    }
+    if (!ints) return evalRator(lhs, rhs);
+    int a = lhs.asInt();
+    int b = rhs.asInt();
+    switch (e_type) {
+        case E_PLUS:  return fixnumAdd(a, b);
+        case E_MINUS: return fixnumSub(a, b);
+        case E_MUL:   return fixnumMul(a, b);
+        case E_LT:    return BooleanV(a < b);
+        case E_LE:    return BooleanV(a <= b);
+        case E_EQ:    return BooleanV(a == b);
+        case E_GE:    return BooleanV(a >= b);
+        case E_GT:    return BooleanV(a > b);
+        default:      return evalRator(lhs, rhs);
+    }
 }
 
 Value Variadic::eval(Assoc &e) { // evaluation of multi-operator primitive
     std::vector<Value> args;
     args.reserve(rands.size());
-    for (auto &ex : rands) args.push_back(ex->eval(e));
+    for (auto &ex : rands) args.push_back(evaluate(ex.get(), e));
     return evalRator(args);
 }
 
+// Entry points of the primitives called as procedures. Each runs the
+// evalRator of a node made once for the purpose, so a primitive behaves
+// the same whether it is called by name or as a value.
+
+template <typename Node>
+static Value unaryEntry(const std::vector<Value> &args) {
+    static Node node(Expr(nullptr));
+    return node.evalRator(args[0]);
+}
+
+template <typename Node>
+static Value binaryEntry(const std::vector<Value> &args) {
+    static Node node(Expr(nullptr), Expr(nullptr));
+    return node.evalRator(args[0], args[1]);
+}
+
+template <typename Node>
+static Value variadicEntry(const std::vector<Value> &args) {
+    static Node node((std::vector<Expr>()));
+    return node.evalRator(args);
+}
+
+// and/or as procedures get their operands already evaluated
+static Value andEntry(const std::vector<Value> &args) {
+    for (const Value &v : args)
+        if (v.isFalse()) return BooleanV(false);
+    return args.empty() ? BooleanV(true) : args.back();
+}
+
+static Value orEntry(const std::vector<Value> &args) {
+    for (const Value &v : args)
+        if (!v.isFalse()) return v;
+    return BooleanV(false);
+}
+
+static Value voidEntry(const std::vector<Value> &) {
+    return VoidV();
+}
+
+static Value exitEntry(const std::vector<Value> &) {
+    return TerminateV();
+}
+
+static Value collectEntry(const std::vector<Value> &) {
+    collect();
+    return VoidV();
+}
+
+static Value readEntry(const std::vector<Value> &) {
+    return readDatum();
+}
+
+/**
+ * @brief The procedure a primitive name evaluates to when not shadowed
+ * One per primitive, so (eq? car car) holds.
+ */
+static Value primitiveProcedure(ExprType op) {
+    static std::map<ExprType, Value> *table = nullptr;
+    if (table == nullptr) {
+        struct Entry {
+            ExprType op;
+            PrimitiveEntry fn;
+            int min_args;
+            int max_args;
+        };
+        static const Entry entries[] = {
+            {E_PLUS,     variadicEntry<PlusVar>,      0, -1},
+            {E_MINUS,    variadicEntry<MinusVar>,     1, -1},
+            {E_MUL,      variadicEntry<MultVar>,      0, -1},
+            {E_DIV,      variadicEntry<DivVar>,       1, -1},
+            {E_MODULO,   binaryEntry<Modulo>,         2, 2},
+            {E_EXPT,     binaryEntry<Expt>,           2, 2},
+            {E_LT,       variadicEntry<LessVar>,      0, -1},
+            {E_LE,       variadicEntry<LessEqVar>,    0, -1},
+            {E_EQ,       variadicEntry<EqualVar>,     0, -1},
+            {E_GE,       variadicEntry<GreaterEqVar>, 0, -1},
+            {E_GT,       variadicEntry<GreaterVar>,   0, -1},
+            {E_CONS,     binaryEntry<Cons>,           2, 2},
+            {E_CAR,      unaryEntry<Car>,             1, 1},
+            {E_CDR,      unaryEntry<Cdr>,             1, 1},
+            {E_LIST,     variadicEntry<ListFunc>,     0, -1},
+            {E_SETCAR,   binaryEntry<SetCar>,         2, 2},
+            {E_SETCDR,   binaryEntry<SetCdr>,         2, 2},
+            {E_NOT,      unaryEntry<Not>,             1, 1},
+            {E_AND,      andEntry,                    0, -1},
+            {E_OR,       orEntry,                     0, -1},
+            {E_EQQ,      binaryEntry<IsEq>,           2, 2},
+            {E_BOOLQ,    unaryEntry<IsBoolean>,       1, 1},
+            {E_INTQ,     unaryEntry<IsFixnum>,        1, 1},
+            {E_NULLQ,    unaryEntry<IsNull>,          1, 1},
+            {E_PAIRQ,    unaryEntry<IsPair>,          1, 1},
+            {E_PROCQ,    unaryEntry<IsProcedure>,     1, 1},
+            {E_SYMBOLQ,  unaryEntry<IsSymbol>,        1, 1},
+            {E_LISTQ,    unaryEntry<IsList>,          1, 1},
+            {E_STRINGQ,  unaryEntry<IsString>,        1, 1},
+            {E_DISPLAY,  unaryEntry<Display>,         1, 1},
+            {E_READ,     readEntry,                   0, 0},
+            {E_VOID,     voidEntry,                   0, 0},
+            {E_EXIT,     exitEntry,                   0, 0},
+            {E_GC,       collectEntry,                0, 0},
+            {E_CALLCC,   nullptr,                     1, 1},
+        };
+        // Never destroyed, like the constant pool
+        table = new std::map<ExprType, Value>();
+        for (const Entry &en : entries)
+            table->emplace(en.op, PrimitiveProcedureV(en.op, en.fn, en.min_args, en.max_args));
+    }
+    auto it = table->find(op);
+    if (it == table->end()) throw RuntimeError("undefined variable is undefined in the current scope");
+    return it->second;
+}
+
 Value Var::eval(Assoc &e) { // evaluation of variable
     // TODO: TO identify the invalid variable
     // We request all valid variable just need to be a symbol,you should promise:
@@ -73,277 +291,306 @@ Value Var::eval(Assoc &e) { // evaluation of variable
     //Variable names can contain any non-whitespace characters except #, ', ", `, but the first character cannot be a digit
     //When a variable is not defined in the current scope, your interpreter should output RuntimeError
     
-    Value matched_value = find(x, e);
-    if (matched_value.get() == nullptr) {
-        if (primitives.count(x)) {
-             static std::map<ExprType, std::pair<Expr, std::vector<std::string>>> primitive_map = {
-                    {E_VOID,     {new MakeVoid(), {}}},
-                    {E_EXIT,     {new Exit(), {}}},
-                    {E_BOOLQ,    {new IsBoolean(new Var("parm")), {"parm"}}},
-                    {E_INTQ,     {new IsFixnum(new Var("parm")), {"parm"}}},
-                    {E_NULLQ,    {new IsNull(new Var("parm")), {"parm"}}},
-                    {E_PAIRQ,    {new IsPair(new Var("parm")), {"parm"}}},
-                    {E_PROCQ,    {new IsProcedure(new Var("parm")), {"parm"}}},
-                    {E_SYMBOLQ,  {new IsSymbol(new Var("parm")), {"parm"}}},
-                    {E_STRINGQ,  {new IsString(new Var("parm")), {"parm"}}},
-                    {E_DISPLAY,  {new Display(new Var("parm")), {"parm"}}},
-                    {E_PLUS,     {new PlusVar({}),  {}}},
-                    {E_MINUS,    {new MinusVar({}), {}}},
-                    {E_MUL,      {new MultVar({}),  {}}},
-                    {E_DIV,      {new DivVar({}),   {}}},
-                    {E_MODULO,   {new Modulo(new Var("parm1"), new Var("parm2")), {"parm1","parm2"}}},
-                    {E_EXPT,     {new Expt(new Var("parm1"), new Var("parm2")), {"parm1","parm2"}}},
-                    {E_EQQ,      {new IsEq(new Var("parm1"), new Var("parm2")), {"parm1","parm2"}}},
-            };
-
-            auto it = primitive_map.find(primitives[x]);
-            //TOD0:to PASS THE parameters correctly;
-            //COMPLETE THE CODE WITH THE HINT IN IF SENTENCE WITH CORRECT RETURN VALUE
-            if (it != primitive_map.end()) {
-                const auto &param_names = it->second.second;
-                const auto &body_expr = it->second.first;
-                return ProcedureV(param_names, body_expr, empty());
-            }
-      }
+    if (local) {
+        Value &v = binding(locate(depth, slot, e), boxed);
+        if (v.unbound()) throw RuntimeError("variable used before its definition");
+        return v;
     }
-    if (matched_value.get() == nullptr) {
+    Value &matched_value = cell->v;
+    if (matched_value.unbound() && x->primitive >= 0) return primitiveProcedure((ExprType)x->primitive);
+    if (matched_value.unbound()) {
         throw RuntimeError("undefined variable is undefined in the current scope");
     }
     return matched_value;
 }
 
-Value Plus::evalRator(const Value &rand1, const Value &rand2) { // +
-    if (rand1->v_type == V_INT && rand2->v_type == V_INT) {
-        int a = dynamic_cast<Integer*>(rand1.get())->n;
-        int b = dynamic_cast<Integer*>(rand2.get())->n;
-        return IntegerV(a + b);
-    }
-    int n1, d1, n2, d2;
-    if (rand1->v_type == V_INT) { n1 = dynamic_cast<Integer*>(rand1.get())->n; d1 = 1; }
-    else if (rand1->v_type == V_RATIONAL) { n1 = dynamic_cast<Rational*>(rand1.get())->numerator; d1 = dynamic_cast<Rational*>(rand1.get())->denominator; }
-    else throw RuntimeError("Wrong typename");
-    if (rand2->v_type == V_INT) { n2 = dynamic_cast<Integer*>(rand2.get())->n; d2 = 1; }
-    else if (rand2->v_type == V_RATIONAL) { n2 = dynamic_cast<Rational*>(rand2.get())->numerator; d2 = dynamic_cast<Rational*>(rand2.get())->denominator; }
-    else throw RuntimeError("Wrong typename");
-    return RationalV(n1 * d2 + n2 * d1, d1 * d2);
+static bool isExactInteger(const Value &v) {
+    return v.type() == V_INT || v.type() == V_BIGNUM;
 }
 
-Value Minus::evalRator(const Value &rand1, const Value &rand2) { // -
-    if (rand1->v_type == V_INT && rand2->v_type == V_INT) {
-        int a = dynamic_cast<Integer*>(rand1.get())->n;
-        int b = dynamic_cast<Integer*>(rand2.get())->n;
-        return IntegerV(a - b);
-    }
-    int n1, d1, n2, d2;
-    if (rand1->v_type == V_INT) { n1 = dynamic_cast<Integer*>(rand1.get())->n; d1 = 1; }
-    else if (rand1->v_type == V_RATIONAL) { n1 = dynamic_cast<Rational*>(rand1.get())->numerator; d1 = dynamic_cast<Rational*>(rand1.get())->denominator; }
-    else throw RuntimeError("Wrong typename");
-    if (rand2->v_type == V_INT) { n2 = dynamic_cast<Integer*>(rand2.get())->n; d2 = 1; }
-    else if (rand2->v_type == V_RATIONAL) { n2 = dynamic_cast<Rational*>(rand2.get())->numerator; d2 = dynamic_cast<Rational*>(rand2.get())->denominator; }
-    else throw RuntimeError("Wrong typename");
-    return RationalV(n1 * d2 - n2 * d1, d1 * d2);
+static BigInt toBigInt(const Value &v) {
+    if (v.type() == V_INT) return BigInt(v.asInt());
+    return static_cast<Bignum*>(v.get())->n;
 }
 
-Value Mult::evalRator(const Value &rand1, const Value &rand2) { // *
-    if (rand1->v_type == V_INT && rand2->v_type == V_INT) {
-        int a = dynamic_cast<Integer*>(rand1.get())->n;
-        int b = dynamic_cast<Integer*>(rand2.get())->n;
+// The number as num/den with den > 0
+static void toFraction(const Value &v, BigInt &num, BigInt &den) {
+    if (v.type() == V_RATIONAL) {
+        num = BigInt(static_cast<Rational*>(v.get())->numerator);
+        den = BigInt(static_cast<Rational*>(v.get())->denominator);
+    } else if (v.type() == V_BIGRATIONAL) {
+        num = static_cast<BigRational*>(v.get())->numerator;
+        den = static_cast<BigRational*>(v.get())->denominator;
+    } else if (isExactInteger(v)) {
+        num = toBigInt(v);
+        den = BigInt(1);
+    } else {
+        throw RuntimeError("Wrong typename");
+    }
+}
+
+static Value fromFraction(BigInt num, BigInt den) {
+    if (den.neg) {
+        num = -num;
+        den = -den;
+    }
+    BigInt g = gcd(num, den), rem;
+    divMod(num, g, num, rem);
+    divMod(den, g, den, rem);
+    if (compare(den, BigInt(1)) == 0) return IntegerV(num);
+    if (!num.fitsLong() || !den.fitsLong()) return BigRationalV(num, den);
+    return RationalV(num.toLong(), den.toLong());
+}
+
+/**
+ * @brief + - * / where an operand is a bignum or a big rational
+ *
+ * Integer operands stay integers; with a rational in the mix the result is
+ * computed as an exact fraction.
+ */
+static Value bignumArith(ExprType op, const Value &rand1, const Value &rand2) {
+    if (op != E_DIV && isExactInteger(rand1) && isExactInteger(rand2)) {
+        BigInt a = toBigInt(rand1), b = toBigInt(rand2);
+        if (op == E_PLUS) return IntegerV(a + b);
+        if (op == E_MINUS) return IntegerV(a - b);
         return IntegerV(a * b);
     }
-    int n1, d1, n2, d2;
-    if (rand1->v_type == V_INT) { n1 = dynamic_cast<Integer*>(rand1.get())->n; d1 = 1; }
-    else if (rand1->v_type == V_RATIONAL) { n1 = dynamic_cast<Rational*>(rand1.get())->numerator; d1 = dynamic_cast<Rational*>(rand1.get())->denominator; }
-    else throw RuntimeError("Wrong typename");
-    if (rand2->v_type == V_INT) { n2 = dynamic_cast<Integer*>(rand2.get())->n; d2 = 1; }
-    else if (rand2->v_type == V_RATIONAL) { n2 = dynamic_cast<Rational*>(rand2.get())->numerator; d2 = dynamic_cast<Rational*>(rand2.get())->denominator; }
-    else throw RuntimeError("Wrong typename");
-    return RationalV(n1 * n2, d1 * d2);
+    BigInt n1, d1, n2, d2;
+    toFraction(rand1, n1, d1);
+    toFraction(rand2, n2, d2);
+    switch (op) {
+        case E_PLUS:  return fromFraction(n1 * d2 + n2 * d1, d1 * d2);
+        case E_MINUS: return fromFraction(n1 * d2 - n2 * d1, d1 * d2);
+        case E_MUL:   return fromFraction(n1 * n2, d1 * d2);
+        default:
+            if (n2.isZero()) throw RuntimeError("Division by zero");
+            return fromFraction(n1 * d2, d1 * n2);
+    }
 }
 
-Value Div::evalRator(const Value &rand1, const Value &rand2) { // /
-    int n1, d1, n2, d2;
-    if (rand1->v_type == V_INT) { n1 = dynamic_cast<Integer*>(rand1.get())->n; d1 = 1; }
-    else if (rand1->v_type == V_RATIONAL) { n1 = dynamic_cast<Rational*>(rand1.get())->numerator; d1 = dynamic_cast<Rational*>(rand1.get())->denominator; }
-    else throw RuntimeError("Wrong typename");
-    if (rand2->v_type == V_INT) { n2 = dynamic_cast<Integer*>(rand2.get())->n; d2 = 1; }
-    else if (rand2->v_type == V_RATIONAL) { n2 = dynamic_cast<Rational*>(rand2.get())->numerator; d2 = dynamic_cast<Rational*>(rand2.get())->denominator; }
+static bool isBig(const Value &v) {
+    return v.type() == V_BIGNUM || v.type() == V_BIGRATIONAL;
+}
+
+static bool anyBig(const Value &rand1, const Value &rand2) {
+    return isBig(rand1) || isBig(rand2);
+}
+
+typedef __int128 Wide;
+
+static bool fitsLong(Wide x) {
+    return x == (long long)x;
+}
+
+// A fixnum or rational operand as num/den, with den > 0
+static void fraction(const Value &v, long long &num, long long &den) {
+    if (v.type() == V_INT) { num = v.asInt(); den = 1; }
+    else if (v.type() == V_RATIONAL) { num = static_cast<Rational*>(v.get())->numerator; den = static_cast<Rational*>(v.get())->denominator; }
     else throw RuntimeError("Wrong typename");
+}
+
+/**
+ * @brief Result of rational arithmetic on 64-bit parts
+ *
+ * The operations compute in 128 bits, where the cross products of 64-bit
+ * parts cannot overflow. The fraction is kept in whatever terms it came
+ * out in while they fit in 64 bits; only a result that does not is
+ * reduced, and becomes a big rational (or a bignum) if it still does not.
+ */
+static Value rational(Wide num, Wide den) {
+    if (den < 0) {
+        num = -num;
+        den = -den;
+    }
+    if (!fitsLong(num) || !fitsLong(den)) {
+        unsigned __int128 magnitude = num < 0 ? -(unsigned __int128)num : (unsigned __int128)num;
+        Wide g = (Wide)binaryGcd(magnitude, (unsigned __int128)den);
+        num /= g;
+        den /= g;
+        if (!fitsLong(num) || !fitsLong(den)) return fromFraction(BigInt::fromInt128(num), BigInt::fromInt128(den));
+    }
+    return RationalV((long long)num, (long long)den);
+}
+
+// The binary operators, shared with the folds of their variadic forms
+
+static Value add(const Value &rand1, const Value &rand2) {
+    if (rand1.type() == V_INT && rand2.type() == V_INT) {
+        return fixnumAdd(rand1.asInt(), rand2.asInt());
+    }
+    if (anyBig(rand1, rand2)) return bignumArith(E_PLUS, rand1, rand2);
+    long long n1, d1, n2, d2;
+    fraction(rand1, n1, d1);
+    fraction(rand2, n2, d2);
+    if (d1 == d2) return rational((Wide)n1 + n2, d1);
+    return rational((Wide)n1 * d2 + (Wide)n2 * d1, (Wide)d1 * d2);
+}
+
+static Value subtract(const Value &rand1, const Value &rand2) {
+    if (rand1.type() == V_INT && rand2.type() == V_INT) {
+        return fixnumSub(rand1.asInt(), rand2.asInt());
+    }
+    if (anyBig(rand1, rand2)) return bignumArith(E_MINUS, rand1, rand2);
+    long long n1, d1, n2, d2;
+    fraction(rand1, n1, d1);
+    fraction(rand2, n2, d2);
+    if (d1 == d2) return rational((Wide)n1 - n2, d1);
+    return rational((Wide)n1 * d2 - (Wide)n2 * d1, (Wide)d1 * d2);
+}
+
+static Value multiply(const Value &rand1, const Value &rand2) {
+    if (rand1.type() == V_INT && rand2.type() == V_INT) {
+        return fixnumMul(rand1.asInt(), rand2.asInt());
+    }
+    if (anyBig(rand1, rand2)) return bignumArith(E_MUL, rand1, rand2);
+    long long n1, d1, n2, d2;
+    fraction(rand1, n1, d1);
+    fraction(rand2, n2, d2);
+    return rational((Wide)n1 * n2, (Wide)d1 * d2);
+}
+
+static Value divide(const Value &rand1, const Value &rand2) {
+    if (anyBig(rand1, rand2)) return bignumArith(E_DIV, rand1, rand2);
+    long long n1, d1, n2, d2;
+    fraction(rand1, n1, d1);
+    fraction(rand2, n2, d2);
     if (n2 == 0) throw RuntimeError("Division by zero");
-    return RationalV(n1 * d2, d1 * n2);
+    return rational((Wide)n1 * d2, (Wide)d1 * n2);
+}
+
+Value Plus::evalRator(const Value &rand1, const Value &rand2) { // +
+    return add(rand1, rand2);
+}
+
+Value Minus::evalRator(const Value &rand1, const Value &rand2) { // -
+    return subtract(rand1, rand2);
+}
+
+Value Mult::evalRator(const Value &rand1, const Value &rand2) { // *
+    return multiply(rand1, rand2);
+}
+
+Value Div::evalRator(const Value &rand1, const Value &rand2) { // /
+    return divide(rand1, rand2);
 }
 
 Value Modulo::evalRator(const Value &rand1, const Value &rand2) { // modulo
-    if (rand1->v_type == V_INT && rand2->v_type == V_INT) {
-        int dividend = dynamic_cast<Integer*>(rand1.get())->n;
-        int divisor = dynamic_cast<Integer*>(rand2.get())->n;
+    if (rand1.type() == V_INT && rand2.type() == V_INT) {
+        int dividend = rand1.asInt();
+        int divisor = rand2.asInt();
         if (divisor == 0) {
             throw(RuntimeError("Division by zero"));
         }
+        if (divisor == -1) return IntegerV(0);  // INT_MIN % -1 would trap
         return IntegerV(dividend % divisor);
     }
+    if (isExactInteger(rand1) && isExactInteger(rand2)) {
+        BigInt divisor = toBigInt(rand2), q, r;
+        if (divisor.isZero()) throw(RuntimeError("Division by zero"));
+        divMod(toBigInt(rand1), divisor, q, r);
+        return IntegerV(r);
+    }
     throw(RuntimeError("modulo is only defined for integers"));
 }
 
 Value PlusVar::evalRator(const std::vector<Value> &args) { // + with multiple args
     // 0 args -> 0
-    if (args.empty()) return IntegerV(0);
-    // Accumulate manually
-    int n = 0; int num = 0, den = 1; bool isRat = false;
-    for (auto &v : args) {
-        if (v->v_type == V_INT && !isRat) {
-            n += dynamic_cast<Integer*>(v.get())->n;
-        } else {
-            int a, b;
-            if (v->v_type == V_INT) { a = dynamic_cast<Integer*>(v.get())->n; b = 1; }
-            else if (v->v_type == V_RATIONAL) { a = dynamic_cast<Rational*>(v.get())->numerator; b = dynamic_cast<Rational*>(v.get())->denominator; }
-            else throw RuntimeError("Wrong typename");
-            if (!isRat) { num = n; den = 1; isRat = true; }
-            num = num * b + a * den;
-            den = den * b;
-        }
-    }
-    if (!isRat) return IntegerV(n);
-    return RationalV(num, den);
+    Value sum = IntegerV(0);
+    for (auto &v : args) sum = add(sum, v);
+    return sum;
 }
 
 Value MinusVar::evalRator(const std::vector<Value> &args) { // - with multiple args
     if (args.empty()) throw RuntimeError("- expects at least 1 argument");
-    if (args.size() == 1) {
-        // unary negation
-        if (args[0]->v_type == V_INT) {
-            int a = dynamic_cast<Integer*>(args[0].get())->n;
-            return IntegerV(-a);
-        } else if (args[0]->v_type == V_RATIONAL) {
-            int a = dynamic_cast<Rational*>(args[0].get())->numerator;
-            int b = dynamic_cast<Rational*>(args[0].get())->denominator;
-            return RationalV(-a, b);
-        } else {
-            throw RuntimeError("Wrong typename");
-        }
-    }
-    // Implement fold-left manually
-    int num, den; bool isRat;
-    auto init = args[0];
-    if (init->v_type == V_INT) { num = dynamic_cast<Integer*>(init.get())->n; den = 1; isRat = false; }
-    else if (init->v_type == V_RATIONAL) { num = dynamic_cast<Rational*>(init.get())->numerator; den = dynamic_cast<Rational*>(init.get())->denominator; isRat = true; }
-    else throw RuntimeError("Wrong typename");
-    for (size_t i = 1; i < args.size(); ++i) {
-        int a, b;
-        if (args[i]->v_type == V_INT) { a = dynamic_cast<Integer*>(args[i].get())->n; b = 1; }
-        else if (args[i]->v_type == V_RATIONAL) { a = dynamic_cast<Rational*>(args[i].get())->numerator; b = dynamic_cast<Rational*>(args[i].get())->denominator; }
-        else throw RuntimeError("Wrong typename");
-        if (!isRat && b != 1) { isRat = true; }
-        num = num * b - a * den;
-        den = den * b;
-    }
-    if (!isRat && den == 1) return IntegerV(num);
-    return RationalV(num, den);
+    // unary negation
+    if (args.size() == 1) return subtract(IntegerV(0), args[0]);
+    Value difference = args[0];
+    for (size_t i = 1; i < args.size(); ++i) difference = subtract(difference, args[i]);
+    return difference;
 }
 
 Value MultVar::evalRator(const std::vector<Value> &args) { // * with multiple args
-    if (args.empty()) return IntegerV(1);
-    long long num = 1, den = 1; bool isRat = false;
-    for (auto &v : args) {
-        int a, b;
-        if (v->v_type == V_INT) { a = dynamic_cast<Integer*>(v.get())->n; b = 1; }
-        else if (v->v_type == V_RATIONAL) { a = dynamic_cast<Rational*>(v.get())->numerator; b = dynamic_cast<Rational*>(v.get())->denominator; isRat = true; }
-        else throw RuntimeError("Wrong typename");
-        num *= a; den *= b;
-    }
-    if (!isRat && den == 1) return IntegerV((int)num);
-    return RationalV((int)num, (int)den);
+    Value product = IntegerV(1);
+    for (auto &v : args) product = multiply(product, v);
+    return product;
 }
 
 Value DivVar::evalRator(const std::vector<Value> &args) { // / with multiple args
     if (args.empty()) throw RuntimeError("/ expects at least 1 argument");
-    if (args.size() == 1) {
-        // reciprocal
-        int a, b;
-        if (args[0]->v_type == V_INT) { a = dynamic_cast<Integer*>(args[0].get())->n; b = 1; }
-        else if (args[0]->v_type == V_RATIONAL) { a = dynamic_cast<Rational*>(args[0].get())->numerator; b = dynamic_cast<Rational*>(args[0].get())->denominator; }
-        else throw RuntimeError("Wrong typename");
-        if (a == 0) throw RuntimeError("Division by zero");
-        return RationalV(b, a);
-    }
-    int num, den; bool isRat;
-    if (args[0]->v_type == V_INT) { num = dynamic_cast<Integer*>(args[0].get())->n; den = 1; isRat = false; }
-    else if (args[0]->v_type == V_RATIONAL) { num = dynamic_cast<Rational*>(args[0].get())->numerator; den = dynamic_cast<Rational*>(args[0].get())->denominator; isRat = true; }
-    else throw RuntimeError("Wrong typename");
+    // reciprocal
+    if (args.size() == 1) return divide(IntegerV(1), args[0]);
+    // A fixnum divided by fixnums whose product is 1 stays a fixnum
+    bool units = args[0].type() == V_INT;
+    int sign = 1;
+    Value quotient = args[0];
     for (size_t i = 1; i < args.size(); ++i) {
-        int a, b;
-        if (args[i]->v_type == V_INT) { a = dynamic_cast<Integer*>(args[i].get())->n; b = 1; }
-        else if (args[i]->v_type == V_RATIONAL) { a = dynamic_cast<Rational*>(args[i].get())->numerator; b = dynamic_cast<Rational*>(args[i].get())->denominator; isRat = true; }
-        else throw RuntimeError("Wrong typename");
-        if (a == 0) throw RuntimeError("Division by zero");
-        num = num * b; den = den * a;
+        quotient = divide(quotient, args[i]);
+        if (args[i].type() == V_INT && (args[i].asInt() == 1 || args[i].asInt() == -1)) sign *= args[i].asInt();
+        else units = false;
     }
-    if (!isRat && den == 1) return IntegerV(num);
-    return RationalV(num, den);
+    if (units && sign == 1) return args[0];
+    return quotient;
 }
 
 Value Expt::evalRator(const Value &rand1, const Value &rand2) { // expt
-    if (rand1->v_type == V_INT && rand2->v_type == V_INT) {
-        int base = dynamic_cast<Integer*>(rand1.get())->n;
-        int exponent = dynamic_cast<Integer*>(rand2.get())->n;
+    if (isExactInteger(rand1) && rand2.type() == V_INT) {
+        int exponent = rand2.asInt();
         
         if (exponent < 0) {
             throw(RuntimeError("Negative exponent not supported for integers"));
         }
-        if (base == 0 && exponent == 0) {
+        if (rand1.type() == V_INT && rand1.asInt() == 0 && exponent == 0) {
             throw(RuntimeError("0^0 is undefined"));
         }
         
-        long long result = 1;
-        long long b = base;
-        int exp = exponent;
-        
-        while (exp > 0) {
-            if (exp % 2 == 1) {
-                result *= b;
-                if (result > INT_MAX || result < INT_MIN) {
-                    throw(RuntimeError("Integer overflow in expt"));
-                }
+        // Square and multiply, in 64 bits while the result fits
+        if (rand1.type() == V_INT) {
+            long long result = 1;
+            long long b = rand1.asInt();
+            int exp = exponent;
+            bool fits = true;
+            while (exp > 0 && fits) {
+                if (exp % 2 == 1) fits = !__builtin_mul_overflow(result, b, &result);
+                exp /= 2;
+                if (exp > 0 && fits) fits = !__builtin_mul_overflow(b, b, &b);
             }
-            b *= b;
-            if (b > INT_MAX || b < INT_MIN) {
-                if (exp > 1) {
-                    throw(RuntimeError("Integer overflow in expt"));
-                }
-            }
-            exp /= 2;
+            if (fits) return IntegerV(BigInt(result));
         }
-        
-        return IntegerV((int)result);
+        BigInt result(1);
+        BigInt b = toBigInt(rand1);
+        for (int exp = exponent; exp > 0; exp /= 2) {
+            if (exp % 2 == 1) result = result * b;
+            if (exp > 1) b = b * b;
+        }
+        return IntegerV(result);
+    }
+    if (isExactInteger(rand1) && rand2.type() == V_BIGNUM) {
+        throw(RuntimeError("Exponent too large in expt"));
     }
     throw(RuntimeError("Wrong typename"));
 }
 
 //A FUNCTION TO SIMPLIFY THE COMPARISON WITH INTEGER AND RATIONAL NUMBER
 int compareNumericValues(const Value &v1, const Value &v2) {
-    if (v1->v_type == V_INT && v2->v_type == V_INT) {
-        int n1 = dynamic_cast<Integer*>(v1.get())->n;
-        int n2 = dynamic_cast<Integer*>(v2.get())->n;
+    if (v1.type() == V_INT && v2.type() == V_INT) {
+        int n1 = v1.asInt();
+        int n2 = v2.asInt();
         return (n1 < n2) ? -1 : (n1 > n2) ? 1 : 0;
     }
-    else if (v1->v_type == V_RATIONAL && v2->v_type == V_INT) {
-        Rational* r1 = dynamic_cast<Rational*>(v1.get());
-        int n2 = dynamic_cast<Integer*>(v2.get())->n;
-        int left = r1->numerator;
-        int right = n2 * r1->denominator;
-        return (left < right) ? -1 : (left > right) ? 1 : 0;
+    else if (anyBig(v1, v2)) {
+        if (isExactInteger(v1) && isExactInteger(v2)) return compare(toBigInt(v1), toBigInt(v2));
+        BigInt n1, d1, n2, d2;
+        toFraction(v1, n1, d1);
+        toFraction(v2, n2, d2);
+        return compare(n1 * d2, n2 * d1);
     }
-    else if (v1->v_type == V_INT && v2->v_type == V_RATIONAL) {
-        int n1 = dynamic_cast<Integer*>(v1.get())->n;
-        Rational* r2 = dynamic_cast<Rational*>(v2.get());
-        int left = n1 * r2->denominator;
-        int right = r2->numerator;
-        return (left < right) ? -1 : (left > right) ? 1 : 0;
-    }
-    else if (v1->v_type == V_RATIONAL && v2->v_type == V_RATIONAL) {
-        Rational* r1 = dynamic_cast<Rational*>(v1.get());
-        Rational* r2 = dynamic_cast<Rational*>(v2.get());
-        int left = r1->numerator * r2->denominator;
-        int right = r2->numerator * r1->denominator;
+    else if ((v1.type() == V_INT || v1.type() == V_RATIONAL) && (v2.type() == V_INT || v2.type() == V_RATIONAL)) {
+        // Cross-multiplied in 128 bits, so neither side needs reducing
+        long long n1, d1, n2, d2;
+        fraction(v1, n1, d1);
+        fraction(v2, n2, d2);
+        Wide left = (Wide)n1 * d2;
+        Wide right = (Wide)n2 * d1;
         return (left < right) ? -1 : (left > right) ? 1 : 0;
     }
     throw RuntimeError("Wrong typename in numeric comparison");
@@ -410,114 +657,121 @@ Value ListFunc::evalRator(const std::vector<Value> &args) { // list function
 }
 
 Value IsList::evalRator(const Value &rand) { // list?
-    if (rand->v_type == V_NULL) return BooleanV(true);
-    if (rand->v_type != V_PAIR) return BooleanV(false);
+    if (rand.type() == V_NULL) return BooleanV(true);
+    if (rand.type() != V_PAIR) return BooleanV(false);
     // Follow cdr chain to ensure it ends with null
     Value cur = rand;
-    while (cur->v_type == V_PAIR) {
-        cur = dynamic_cast<Pair*>(cur.get())->cdr;
+    while (cur.type() == V_PAIR) {
+        cur = static_cast<Pair*>(cur.get())->cdr;
     }
-    return BooleanV(cur->v_type == V_NULL);
+    return BooleanV(cur.type() == V_NULL);
 }
 
 Value Car::evalRator(const Value &rand) { // car
-    if (rand->v_type != V_PAIR) throw RuntimeError("car expects a pair");
-    return dynamic_cast<Pair*>(rand.get())->car;
+    if (rand.type() != V_PAIR) throw RuntimeError("car expects a pair");
+    return static_cast<Pair*>(rand.get())->car;
 }
 
 Value Cdr::evalRator(const Value &rand) { // cdr
-    if (rand->v_type != V_PAIR) throw RuntimeError("cdr expects a pair");
-    return dynamic_cast<Pair*>(rand.get())->cdr;
+    if (rand.type() != V_PAIR) throw RuntimeError("cdr expects a pair");
+    return static_cast<Pair*>(rand.get())->cdr;
 }
 
 Value SetCar::evalRator(const Value &rand1, const Value &rand2) { // set-car!
-    if (rand1->v_type != V_PAIR) throw RuntimeError("set-car! expects a pair");
-    dynamic_cast<Pair*>(rand1.get())->car = rand2;
+    if (rand1.type() != V_PAIR) throw RuntimeError("set-car! expects a pair");
+    static_cast<Pair*>(rand1.get())->car = rand2;
     return VoidV();
 }
 
 Value SetCdr::evalRator(const Value &rand1, const Value &rand2) { // set-cdr!
-   if (rand1->v_type != V_PAIR) throw RuntimeError("set-cdr! expects a pair");
-   dynamic_cast<Pair*>(rand1.get())->cdr = rand2;
+   if (rand1.type() != V_PAIR) throw RuntimeError("set-cdr! expects a pair");
+   static_cast<Pair*>(rand1.get())->cdr = rand2;
    return VoidV();
 }
 
 Value IsEq::evalRator(const Value &rand1, const Value &rand2) { // eq?
-    // Check if type is Integer
-    if (rand1->v_type == V_INT && rand2->v_type == V_INT) {
-        return BooleanV((dynamic_cast<Integer*>(rand1.get())->n) == (dynamic_cast<Integer*>(rand2.get())->n));
-    }
-    // Check if type is Boolean
-    else if (rand1->v_type == V_BOOL && rand2->v_type == V_BOOL) {
-        return BooleanV((dynamic_cast<Boolean*>(rand1.get())->b) == (dynamic_cast<Boolean*>(rand2.get())->b));
-    }
-    // Check if type is Symbol
-    else if (rand1->v_type == V_SYM && rand2->v_type == V_SYM) {
-        return BooleanV((dynamic_cast<Symbol*>(rand1.get())->s) == (dynamic_cast<Symbol*>(rand2.get())->s));
-    }
-    // Check if type is Null or Void
-    else if ((rand1->v_type == V_NULL && rand2->v_type == V_NULL) ||
-             (rand1->v_type == V_VOID && rand2->v_type == V_VOID)) {
-        return BooleanV(true);
-    } else {
-        return BooleanV(rand1.get() == rand2.get());
+    // Integers, booleans, () and void are inline, so equal words are eq?
+    if (rand1.bits == rand2.bits) return BooleanV(true);
+    // Check if type is Symbol (interned, so identity is equality)
+    if (rand1.type() == V_SYM && rand2.type() == V_SYM) {
+        return BooleanV((static_cast<Symbol*>(rand1.get())->s) == (static_cast<Symbol*>(rand2.get())->s));
     }
+    return BooleanV(false);
 }
 
 Value IsBoolean::evalRator(const Value &rand) { // boolean?
-    return BooleanV(rand->v_type == V_BOOL);
+    return BooleanV(rand.type() == V_BOOL);
 }
 
 Value IsFixnum::evalRator(const Value &rand) { // number?
-    return BooleanV(rand->v_type == V_INT);
+    return BooleanV(rand.type() == V_INT || rand.type() == V_BIGNUM);
 }
 
 Value IsNull::evalRator(const Value &rand) { // null?
-    return BooleanV(rand->v_type == V_NULL);
+    return BooleanV(rand.type() == V_NULL);
 }
 
 Value IsPair::evalRator(const Value &rand) { // pair?
-    return BooleanV(rand->v_type == V_PAIR);
+    return BooleanV(rand.type() == V_PAIR);
 }
 
 Value IsProcedure::evalRator(const Value &rand) { // procedure?
-    return BooleanV(rand->v_type == V_PROC);
+    return BooleanV(isProcedure(rand));
 }
 
 Value IsSymbol::evalRator(const Value &rand) { // symbol?
-    return BooleanV(rand->v_type == V_SYM);
+    return BooleanV(rand.type() == V_SYM);
 }
 
 Value IsString::evalRator(const Value &rand) { // string?
-    return BooleanV(rand->v_type == V_STRING);
+    return BooleanV(rand.type() == V_STRING);
 }
 
 Value Begin::eval(Assoc &e) {
     if (es.empty()) return VoidV();
     Value last = VoidV();
-    for (size_t i = 0; i < es.size(); ++i) last = es[i]->eval(e);
+    for (size_t i = 0; i < es.size(); ++i) last = evaluate(es[i].get(), e);
     return last;
 }
 
-Value Quote::eval(Assoc& e) {
-    // Convert Syntax tree to a quoted Value
-    std::function<Value(const Syntax&)> quoteToValue = [&](const Syntax &s) -> Value {
-        if (auto num = dynamic_cast<Number*>(s.get())) {
-            return IntegerV(num->n);
-        }
-        if (auto rat = dynamic_cast<RationalSyntax*>(s.get())) {
-            return RationalV(rat->numerator, rat->denominator);
-        }
-        if (dynamic_cast<TrueSyntax*>(s.get())) return BooleanV(true);
-        if (dynamic_cast<FalseSyntax*>(s.get())) return BooleanV(false);
-        if (auto str = dynamic_cast<StringSyntax*>(s.get())) return StringV(str->s);
-        if (auto sym = dynamic_cast<SymbolSyntax*>(s.get())) return SymbolV(sym->s);
-        if (auto lst = dynamic_cast<List*>(s.get())) {
+// Pools a datum that is not a list
+static int atomDatum(const Syntax &s) {
+    if (auto num = dynamic_cast<Number*>(s.get())) return poolImmediate(IntegerV(num->n));
+    if (auto big = dynamic_cast<BignumSyntax*>(s.get())) return poolBignum(big->n);
+    if (auto rat = dynamic_cast<RationalSyntax*>(s.get())) return poolRational(rat->numerator, rat->denominator);
+    if (dynamic_cast<TrueSyntax*>(s.get())) return poolImmediate(BooleanV(true));
+    if (dynamic_cast<FalseSyntax*>(s.get())) return poolImmediate(BooleanV(false));
+    if (auto str = dynamic_cast<StringSyntax*>(s.get())) return poolString(str->s);
+    if (auto sym = dynamic_cast<SymbolSyntax*>(s.get())) return poolSymbol(sym->s);
+    if (auto dat = dynamic_cast<DatumSyntax*>(s.get())) return dat->constant;
+    throw RuntimeError("Unsupported quote syntax");
+}
+
+/**
+ * A list is built from its (dotted) tail back to its first element. The
+ * lists still being built are kept on a stack of their own, so a datum
+ * may nest as deep as memory allows.
+ */
+int Quote::datum(const Syntax &s) {
+    static const SymbolId dot = intern(".");
+    struct Pending {
+        List *lst;
+        int next;       ///< Index of the next element to pool, counting down
+        int tail;       ///< The list built so far, or -1 before its dotted tail
+    };
+    std::vector<Pending> stack;
+    const Syntax *cur = &s;
+    for (;;) {
+        int done = -1;
+        List *lst = dynamic_cast<List*>(cur->get());
+        if (lst == nullptr) {
+            done = atomDatum(*cur);
+        } else {
             // Handle dotted list if exists
             int dotIndex = -1;
             for (size_t i = 0; i < lst->stxs.size(); ++i) {
                 if (auto sym = dynamic_cast<SymbolSyntax*>(lst->stxs[i].get())) {
-                    if (sym->s == ".") {
+                    if (sym->s == dot) {
                         dotIndex = (int)i;
                         break;
                     }
@@ -525,29 +779,42 @@ Value Quote::eval(Assoc& e) {
             }
             if (dotIndex == -1) {
                 // proper list
-                Value res = NullV();
-                for (int i = (int)lst->stxs.size() - 1; i >= 0; --i)
-                    res = PairV(quoteToValue(lst->stxs[i]), res);
-                return res;
+                stack.push_back(Pending{lst, (int)lst->stxs.size() - 1, poolImmediate(NullV())});
             } else {
                 // dotted list: (a b . c)
                 if (!(dotIndex + 1 < (int)lst->stxs.size())) throw RuntimeError("invalid dotted list");
-                Value tail = quoteToValue(lst->stxs[dotIndex + 1]);
-                for (int i = dotIndex - 1; i >= 0; --i) tail = PairV(quoteToValue(lst->stxs[i]), tail);
-                return tail;
+                stack.push_back(Pending{lst, dotIndex - 1, -1});
+                cur = &lst->stxs[dotIndex + 1];
+                continue;
             }
         }
-        throw RuntimeError("Unsupported quote syntax");
-    };
-    return quoteToValue(s);
+        // Add what was just pooled to the innermost list, and finish the
+        // lists that have no element left
+        for (;;) {
+            if (stack.empty()) return done;
+            Pending &p = stack.back();
+            if (done >= 0) p.tail = p.tail < 0 ? done : poolPair(done, p.tail);
+            if (p.next >= 0) {
+                cur = &p.lst->stxs[p.next--];
+                break;
+            }
+            done = p.tail;
+            stack.pop_back();
+        }
+    }
+}
+
+Value Quote::eval(Assoc& e) {
+    if (constant < 0) constant = datum(s);
+    return pooled(constant);
 }
 
 Value AndVar::eval(Assoc &e) { // and with short-circuit evaluation
     if (rands.empty()) return BooleanV(true);
     Value last = BooleanV(true);
     for (auto &ex : rands) {
-        last = ex->eval(e);
-        if (last->v_type == V_BOOL && !dynamic_cast<Boolean*>(last.get())->b) return BooleanV(false);
+        last = evaluate(ex.get(), e);
+        if (last.isFalse()) return BooleanV(false);
     }
     return last;
 }
@@ -555,47 +822,48 @@ Value AndVar::eval(Assoc &e) { // and with short-circuit evaluation
 Value OrVar::eval(Assoc &e) { // or with short-circuit evaluation
     if (rands.empty()) return BooleanV(false);
     for (auto &ex : rands) {
-        Value v = ex->eval(e);
-        if (!(v->v_type == V_BOOL && dynamic_cast<Boolean*>(v.get())->b == false)) return v;
+        Value v = evaluate(ex.get(), e);
+        if (!v.isFalse()) return v;
     }
     return BooleanV(false);
 }
 
 Value Not::evalRator(const Value &rand) { // not
-    bool is_false = (rand->v_type == V_BOOL && dynamic_cast<Boolean*>(rand.get())->b == false);
+    bool is_false = rand.isFalse();
     return BooleanV(is_false);
 }
 
 Value If::eval(Assoc &e) {
-    Value c = cond->eval(e);
-    bool truthy = !(c->v_type == V_BOOL && dynamic_cast<Boolean*>(c.get())->b == false);
-    if (truthy) return conseq->eval(e);
-    return alter->eval(e);
+    Value c = evaluate(cond.get(), e);
+    bool truthy = !c.isFalse();
+    if (truthy) return evaluate(conseq.get(), e);
+    return evaluate(alter.get(), e);
 }
 
 Value Cond::eval(Assoc &env) {
+    static const SymbolId else_sym = intern("else");
     for (auto &cl : clauses) {
         // Single element clause: return predicate value
         if (cl.size() == 1) {
-            Value pv = cl[0]->eval(env);
-            bool truthy = !(pv->v_type == V_BOOL && dynamic_cast<Boolean*>(pv.get())->b == false);
+            Value pv = evaluate(cl[0].get(), env);
+            bool truthy = !pv.isFalse();
             if (truthy) return pv;
             else continue;
         }
         // else clause detection
-        if (auto v = dynamic_cast<Var*>(cl[0].get())) {
-            if (v->x == "else") {
+        if (cl[0]->e_type == E_VAR) {
+            if (static_cast<Var*>(cl[0].get())->x == else_sym) {
                 // evaluate sequence and return last
                 Value last = VoidV();
-                for (size_t i = 1; i < cl.size(); ++i) last = cl[i]->eval(env);
+                for (size_t i = 1; i < cl.size(); ++i) last = evaluate(cl[i].get(), env);
                 return last;
             }
         }
-        Value pv = cl[0]->eval(env);
-        bool truthy = !(pv->v_type == V_BOOL && dynamic_cast<Boolean*>(pv.get())->b == false);
+        Value pv = evaluate(cl[0].get(), env);
+        bool truthy = !pv.isFalse();
         if (truthy) {
             Value last = VoidV();
-            for (size_t i = 1; i < cl.size(); ++i) last = cl[i]->eval(env);
+            for (size_t i = 1; i < cl.size(); ++i) last = evaluate(cl[i].get(), env);
             return last;
         }
     }
@@ -603,80 +871,262 @@ Value Cond::eval(Assoc &env) {
 }
 
 Value Lambda::eval(Assoc &env) { 
-    return ProcedureV(x, e, env);
+    // Flat closure: copy each free variable (or the box it lives in)
+    Assoc captured = empty();
+    if (!captures.empty()) {
+        captured = extend((int)captures.size(), empty());
+        Value *slots = captured->slots();
+        for (size_t i = 0; i < captures.size(); ++i)
+            slots[i] = locate(captures[i].first, captures[i].second, env);
+    }
+    return ProcedureV(x, e, captured, (int)locals.size(), boxed);
+}
+
+// Trampoline registers: the call a tail-position Apply left for its driver
+static Value pending_proc(nullptr);
+static Assoc pending_env(nullptr);
+
+// Runs a prepared call, driving the tail calls it hands back
+static Value runCall(Value proc, Assoc env) {
+    gcSafePoint();
+    Value result = evaluate(static_cast<Procedure*>(proc.get())->e.get(), env);
+    while (result.type() == V_TAILCALL) {
+        proc = std::move(pending_proc);
+        env = std::move(pending_env);
+        gcSafePoint();
+        result = evaluate(static_cast<Procedure*>(proc.get())->e.get(), env);
+    }
+    return result;
+}
+
+/**
+ * The tree walker keeps its continuation on the C++ stack, so it cannot
+ * copy it: a continuation can only be used to escape to its call/cc while
+ * that call/cc is still running, by unwinding with a C++ exception.
+ */
+struct EscapeContinuation : Continuation {
+    bool active = true;
+};
+
+struct ContinuationThrow {
+    EscapeContinuation *k;
+    Value v;
+};
+
+static void throwTo(const Value &k, std::vector<Value> &args) {
+    EscapeContinuation *esc = dynamic_cast<EscapeContinuation*>(k.get());
+    if (esc == nullptr || !esc->active) throw RuntimeError("continuation can no longer be resumed");
+    if (args.size() != 1) throw RuntimeError("Wrong number of arguments");
+    throw ContinuationThrow{esc, args[0]};
+}
+
+static Value callWithCurrentContinuation(const Value &f);
+
+// The arity has been checked
+static Value enterPrimitive(PrimitiveProcedure *prim, std::vector<Value> &args) {
+    if (prim->fn == nullptr) return callWithCurrentContinuation(args[0]);
+    return prim->fn(args);
+}
+
+static Value applyPrimitive(const Value &rator_val, std::vector<Value> &args) {
+    PrimitiveProcedure *prim = static_cast<PrimitiveProcedure*>(rator_val.get());
+    if (!prim->accepts(args.size())) throw RuntimeError("Wrong number of arguments");
+    return enterPrimitive(prim, args);
+}
+
+static Value applyValue(const Value &rator_val, std::vector<Value> &args) {
+    if (rator_val.type() == V_CONTINUATION) throwTo(rator_val, args);
+    if (rator_val.type() == V_PRIMITIVE) return applyPrimitive(rator_val, args);
+    if (rator_val.type() != V_PROC) throw RuntimeError("Attempt to apply a non-procedure");
+    Procedure* clos_ptr = static_cast<Procedure*>(rator_val.get());
+    if (args.size() != clos_ptr->parameters.size()) throw RuntimeError("Wrong number of arguments");
+    Assoc param_env = extend((int)args.size() + clos_ptr->locals, clos_ptr->env);
+    Value *slots = param_env->slots();
+    for (size_t i = 0; i < args.size(); ++i) slots[i] = std::move(args[i]);
+    if (!clos_ptr->boxed.empty()) boxSlots(param_env, clos_ptr->boxed);
+    return runCall(rator_val, std::move(param_env));
+}
+
+// Sites that have missed their cache at least once, for dumpCallSites.
+// Never destroyed: Apply nodes held by statics unregister after main returns
+static std::vector<Apply*> &callSites() {
+    static std::vector<Apply*> *sites = new std::vector<Apply*>();
+    return *sites;
+}
+
+static size_t retired_sites = 0;
+static size_t retired_hits = 0;
+static size_t retired_misses = 0;
+
+Apply::~Apply() {
+    if (site < 0) return;
+    std::vector<Apply*> &sites = callSites();
+    sites[site] = sites.back();
+    sites[site]->site = site;
+    sites.pop_back();
+    ++retired_sites;
+    retired_hits += hits;
+    retired_misses += misses;
+}
+
+const CallTarget *Apply::miss() {
+    ++misses;
+    if (site < 0) {
+        site = (int)callSites().size();
+        callSites().push_back(this);
+    }
+    return nullptr;
+}
+
+// Once the cache is full, later callees are checked on every call
+const CallTarget *Apply::remember(const void *code, const Expr &body, int frame, bool boxed) {
+    if (ntargets == CALL_CACHE_SIZE) return nullptr;
+    CallTarget &t = targets[ntargets++];
+    t.code = code;
+    t.body = body;
+    t.frame = frame;
+    t.boxed = boxed;
+    return &t;
+}
+
+void dumpCallSites(std::ostream &os) {
+    std::vector<Apply*> sites = callSites();
+    std::sort(sites.begin(), sites.end(), [](const Apply *a, const Apply *b) {
+        return a->hits + a->misses > b->hits + b->misses;
+    });
+    for (const Apply *ap : sites) {
+        SymbolId name = ap->rator->e_type == E_VAR ? static_cast<Var*>(ap->rator.get())->x : nullptr;
+        size_t calls = ap->hits + ap->misses;
+        os << "call " << (name ? name->name : std::string("(computed)")) << ": " << calls << " calls, "
+           << ap->hits * 100 / calls << "% hits, " << ap->ntargets << " targets"
+           << (ap->ntargets == CALL_CACHE_SIZE ? " (full)" : "") << std::endl;
+    }
+    size_t retired_calls = retired_hits + retired_misses;
+    if (retired_calls > 0)
+        os << "call sites freed: " << retired_sites << " sites, " << retired_calls << " calls, "
+           << retired_hits * 100 / retired_calls << "% hits" << std::endl;
 }
 
 Value Apply::eval(Assoc &e) {
-    Value rator_val = rator->eval(e);
-    if (rator_val->v_type != V_PROC) {throw RuntimeError("Attempt to apply a non-procedure");}
+    Value rator_val = evaluate(rator.get(), e);
+    if (rator_val.type() == V_CONTINUATION || rator_val.type() == V_PRIMITIVE) {
+        std::vector<Value> args;
+        args.reserve(rand.size());
+        for (auto &ex : rand) args.push_back(evaluate(ex.get(), e));
+        if (rator_val.type() == V_CONTINUATION) throwTo(rator_val, args);
+        PrimitiveProcedure *prim = static_cast<PrimitiveProcedure*>(rator_val.get());
+        if (lookup(prim) == nullptr) {
+            if (!prim->accepts(args.size())) throw RuntimeError("Wrong number of arguments");
+            remember(prim, Expr(nullptr), 0, false);
+        }
+        return enterPrimitive(prim, args);
+    }
+    if (rator_val.type() != V_PROC) {throw RuntimeError("Attempt to apply a non-procedure");}
 
     // Closure pointer
-    Procedure* clos_ptr = dynamic_cast<Procedure*>(rator_val.get());
-    
-    //TODO: TO COMPLETE THE ARGUMENT PARSER LOGIC
-    std::vector<Value> args;
-    args.reserve(rand.size());
-    for (auto &ex : rand) args.push_back(ex->eval(e));
-    if (auto varNode = dynamic_cast<Variadic*>(clos_ptr->e.get())) {
-        return varNode->evalRator(args);
+    Procedure* clos_ptr = static_cast<Procedure*>(rator_val.get());
+    int frame;
+    bool boxed;
+    if (const CallTarget *target = lookup(clos_ptr->e.get())) {
+        frame = target->frame;
+        boxed = target->boxed;
+    } else {
+        if (rand.size() != clos_ptr->parameters.size()) throw RuntimeError("Wrong number of arguments");
+        frame = (int)rand.size() + clos_ptr->locals;
+        boxed = !clos_ptr->boxed.empty();
+        remember(clos_ptr->e.get(), clos_ptr->e, frame, boxed);
     }
-    if (args.size() != clos_ptr->parameters.size()) throw RuntimeError("Wrong number of arguments");
     
-    //TODO: TO COMPLETE THE PARAMETERS' ENVIRONMENT LOGIC
-    Assoc param_env = clos_ptr->env;
-    for (size_t i = 0; i < clos_ptr->parameters.size(); ++i) {
-        param_env = extend(clos_ptr->parameters[i], args[i], param_env);
+    // Arguments are evaluated straight into the callee's frame
+    Assoc param_env = extend(frame, clos_ptr->env);
+    Value *slots = param_env->slots();
+    for (size_t i = 0; i < rand.size(); ++i) slots[i] = evaluate(rand[i].get(), e);
+    if (boxed) boxSlots(param_env, clos_ptr->boxed);
+
+    if (tail) {
+        // Unwind to the driver instead of growing the C++ stack
+        pending_proc = std::move(rator_val);
+        pending_env = std::move(param_env);
+        return ImmediateV(V_TAILCALL, 0);
+    }
+    return runCall(std::move(rator_val), std::move(param_env));
+}
+
+// Calls f with an escape-only continuation, see EscapeContinuation
+static Value callWithCurrentContinuation(const Value &f) {
+    EscapeContinuation *k = new EscapeContinuation();
+    Value held(k);
+    std::vector<Value> args(1, held);
+    try {
+        Value result = applyValue(f, args);
+        k->active = false;
+        return result;
+    } catch (const ContinuationThrow &thrown) {
+        k->active = false;
+        if (thrown.k != k) throw;
+        return thrown.v;
+    } catch (...) {
+        k->active = false;
+        throw;
     }
+}
 
-    return clos_ptr->e->eval(param_env);
+Value CallCC::eval(Assoc &e) {
+    return callWithCurrentContinuation(evaluate(rand.get(), e));
 }
 
 Value Define::eval(Assoc &env) {
+    if (local) {
+        // Internal define: fill the slot reserved on entry to the body
+        Value val = evaluate(e.get(), env);
+        binding(locate(depth, slot, env), boxed) = val;
+        return SymbolV(var);
+    }
     // Placeholder binding first (for recursion), then evaluate and update
-    env = extend(var, VoidV(), env);
-    Value val = e->eval(env);
-    modify(var, val, env);
+    cell->v = VoidV();
+    cell->v = evaluate(e.get(), env);
+    settle(cell->v);
     return SymbolV(var);
 }
 
 Value Let::eval(Assoc &env) {
     // let ((p1 v1) ...) body
-    Assoc new_env = env;
-    for (auto &b : bind) {
-        Value v = b.second->eval(env);
-        new_env = extend(b.first, v, new_env);
-    }
-    return body->eval(new_env);
+    Assoc new_env = extend((int)(bind.size() + locals.size()), env);
+    Value *slots = new_env->slots();
+    for (size_t i = 0; i < bind.size(); ++i) slots[i] = evaluate(bind[i].second.get(), env);
+    if (!boxed.empty()) boxSlots(new_env, boxed);
+    return evaluate(body.get(), new_env);
 }
 
 Value Letrec::eval(Assoc &env) {
-    // Create env1 with placeholders
-    Assoc env1 = env;
-    for (auto &b : bind) env1 = extend(b.first, Value(nullptr), env1);
-    // Evaluate expressions in env1
-    std::vector<Value> vals; vals.reserve(bind.size());
-    for (auto &b : bind) vals.push_back(b.second->eval(env1));
-    // Create env2 with actual bindings
-    Assoc env2 = env;
-    for (size_t i = 0; i < bind.size(); ++i) env2 = extend(bind[i].first, vals[i], env2);
-    return body->eval(env2);
+    // The inits are evaluated inside the new frame, so closures they create
+    // see every binding; each slot is filled as soon as its init is done
+    Assoc new_env = extend((int)(bind.size() + locals.size()), env);
+    if (!boxed.empty()) boxSlots(new_env, boxed);
+    Value *slots = new_env->slots();
+    for (size_t i = 0; i < bind.size(); ++i) {
+        Value val = evaluate(bind[i].second.get(), new_env);
+        binding(slots[i], isBoxed(i)) = val;
+    }
+    return evaluate(body.get(), new_env);
 }
 
 Value Set::eval(Assoc &env) {
     // set! var expr
-    Value cur = find(var, env);
-    if (cur.get() == nullptr) throw RuntimeError("set!: undefined variable");
-    Value val = e->eval(env);
-    modify(var, val, env);
+    Value *target = local ? &binding(locate(depth, slot, env), boxed) : &cell->v;
+    if (target->unbound()) throw RuntimeError("set!: undefined variable");
+    Value val = evaluate(e.get(), env);
+    if (!local) settle(val);
+    *target = val;
     return VoidV();
 }
 
 Value Display::evalRator(const Value &rand) { // display function
-    if (rand->v_type == V_STRING) {
-        String* str_ptr = dynamic_cast<String*>(rand.get());
+    if (rand.type() == V_STRING) {
+        String* str_ptr = static_cast<String*>(rand.get());
         std::cout << str_ptr->s;
     } else {
-        rand->show(std::cout);
+        rand.show(std::cout);
     }
     
     return VoidV();
@@ -1,7 +1,10 @@
 #include "Def.hpp"
 #include "expr.hpp"
+#include "value.hpp"
+#include "RE.hpp"
 #include <cstring>
 #include <cstdlib>
+#include <algorithm>
 #include <vector>
 using std::vector;
 using std::string;
@@ -17,17 +20,35 @@ int gcd(int a, int b) {
     return a;
 }
 
-ExprBase::ExprBase(ExprType et) : e_type(et) {}
-
-Expr::Expr(ExprBase * eb) : ptr(eb) {}
-ExprBase* Expr::operator->() const { return ptr.get(); }
-ExprBase& Expr::operator*() { return *ptr; }
-ExprBase* Expr::get() const { return ptr.get(); }
+ExprBase::ExprBase(ExprType et, ExprShape shape) : e_type(et), shape(shape), refs(0) {}
+
+// The subexpressions whose last handle goes with a node are deleted by the
+// outermost freeExpr, one at a time, so freeing a deep tree does not
+// recurse, like List::~List
+void freeExpr(ExprBase *e) {
+    // Never destroyed: nodes held by statics may be freed after main returns
+    static vector<ExprBase *> *orphans = new vector<ExprBase *>();
+    static bool freeing = false;
+    if (freeing) {
+        orphans->push_back(e);
+        return;
+    }
+    freeing = true;
+    delete e;
+    while (!orphans->empty()) {
+        ExprBase *orphan = orphans->back();
+        orphans->pop_back();
+        delete orphan;
+    }
+    freeing = false;
+}
 
 //BASIC TYPES AND LITERALS
 
 Fixnum::Fixnum(int x) : ExprBase(E_FIXNUM), n(x) {}
 
+BignumExpr::BignumExpr(const BigInt &n) : ExprBase(E_BIGNUM), n(n), constant(poolBignum(n)) {}
+
 RationalNum::RationalNum(int num, int den) : ExprBase(E_RATIONAL), numerator(num), denominator(den) {
     // Simplify fraction
     int g = gcd(abs(numerator), abs(denominator));
@@ -39,9 +60,10 @@ RationalNum::RationalNum(int num, int den) : ExprBase(E_RATIONAL), numerator(num
         numerator = -numerator;
         denominator = -denominator;
     }
+    constant = poolRational(numerator, denominator);
 }
 
-StringExpr::StringExpr(const std::string &str) : ExprBase(E_STRING), s(str) {}
+StringExpr::StringExpr(const std::string &str) : ExprBase(E_STRING), s(str), constant(poolString(str)) {}
 
 True::True() : ExprBase(E_TRUE) {}
 
@@ -51,13 +73,29 @@ MakeVoid::MakeVoid() : ExprBase(E_VOID) {}
 
 Exit::Exit() : ExprBase(E_EXIT) {}
 
+Collect::Collect() : ExprBase(E_GC) {}
+
+Read::Read() : ExprBase(E_READ) {}
+
 //BASIC ABSTRACT TYPES FOR PARAMETERS
 
-Unary::Unary(ExprType et, const Expr &expr) : ExprBase(et), rand(expr) {}
+Unary::Unary(ExprType et, const Expr &expr) : ExprBase(et, S_UNARY), rand(expr) {}
+
+// Fixnum arithmetic and comparison specialize themselves, see Binary::operate
+static Specialization initialSpec(ExprType et) {
+    switch (et) {
+        case E_PLUS: case E_MINUS: case E_MUL:
+        case E_LT: case E_LE: case E_EQ: case E_GE: case E_GT:
+            return SPEC_NONE;
+        default:
+            return SPEC_GENERIC;
+    }
+}
 
-Binary::Binary(ExprType et, const Expr &r1, const Expr &r2) : ExprBase(et), rand1(r1), rand2(r2) {}
+Binary::Binary(ExprType et, const Expr &r1, const Expr &r2)
+    : ExprBase(et, S_BINARY), rand1(r1), rand2(r2), spec(initialSpec(et)) {}
 
-Variadic::Variadic(ExprType et, const std::vector<Expr> &rands) : ExprBase(et), rands(rands) {}
+Variadic::Variadic(ExprType et, const std::vector<Expr> &rands) : ExprBase(et, S_VARIADIC), rands(rands) {}
 
 //ARITHMETIC OPERATIONS
 
@@ -149,7 +187,13 @@ IsString::IsString(const Expr &r1) : Unary(E_STRINGQ, r1) {}
 
 Begin::Begin(const vector<Expr> &vec) : ExprBase(E_BEGIN), es(vec) {}
 
-Quote::Quote(const Syntax &t) : ExprBase(E_QUOTE), s(t) {}
+Quote::Quote(const Syntax &t) : ExprBase(E_QUOTE), s(t), constant(-1) {
+    try {
+        constant = datum(t);
+    } catch (const RuntimeError &) {
+        // Reported when the quotation is evaluated
+    }
+}
 
 //CONDITIONAL
 
@@ -159,24 +203,41 @@ Cond::Cond(const std::vector<std::vector<Expr>> &cls) : ExprBase(E_COND), clause
 
 //VARIABLE AND FUNCITON DEFINITION
 
-Var::Var(const string &s) : ExprBase(E_VAR), x(s) {}
+Var::Var(SymbolId s) : ExprBase(E_VAR), x(s), depth(0), slot(0), local(false), boxed(false), cell(globalCell(s)) {}
+
+Var::Var(SymbolId s, int d, int i) : ExprBase(E_VAR), x(s), depth(d), slot(i), local(true), boxed(false), cell(nullptr) {}
 
-Apply::Apply(const Expr &expr, const vector<Expr> &vec) : ExprBase(E_APPLY), rator(expr), rand(vec) {}
+Apply::Apply(const Expr &expr, const vector<Expr> &vec)
+    : ExprBase(E_APPLY), rator(expr), rand(vec), tail(false), ntargets(0), hits(0), misses(0), site(-1) {}
 
-Lambda::Lambda(const vector<string> &vec, const Expr &expr) : ExprBase(E_LAMBDA), x(vec), e(expr) {}
+Lambda::Lambda(const vector<SymbolId> &vec, const vector<SymbolId> &defs, const Expr &expr,
+               const vector<pair<int, int>> &caps, const vector<int> &boxes)
+    : ExprBase(E_LAMBDA), x(vec), locals(defs), e(expr), captures(caps), boxed(boxes) {}
 
-Define::Define(const string &variable, const Expr &expr) : ExprBase(E_DEFINE), var(variable), e(expr) {}
+Define::Define(SymbolId variable, const Expr &expr) : ExprBase(E_DEFINE), var(variable), depth(0), slot(0), local(false), boxed(false), cell(globalCell(variable)), e(expr) {}
+
+Define::Define(SymbolId variable, int d, int i, const Expr &expr) : ExprBase(E_DEFINE), var(variable), depth(d), slot(i), local(true), boxed(false), cell(nullptr), e(expr) {}
 
 //BINDING CONSTRUCTS
 
-Let::Let(const vector<pair<string, Expr>> &vec, const Expr &e) : ExprBase(E_LET), bind(vec), body(e) {}
+Let::Let(const vector<pair<SymbolId, Expr>> &vec, const vector<SymbolId> &defs, const Expr &e, const vector<int> &boxes) : ExprBase(E_LET), bind(vec), locals(defs), body(e), boxed(boxes) {}
 
-Letrec::Letrec(const vector<pair<string, Expr>> &vec, const Expr &expr) : ExprBase(E_LETREC), bind(vec), body(expr) {}
+Letrec::Letrec(const vector<pair<SymbolId, Expr>> &vec, const vector<SymbolId> &defs, const Expr &expr, const vector<int> &boxes) : ExprBase(E_LETREC), bind(vec), locals(defs), body(expr), boxed(boxes) {}
+
+bool Letrec::isBoxed(size_t i) const {
+    return std::find(boxed.begin(), boxed.end(), (int)i) != boxed.end();
+}
 
 //ASSIGNMENT
 
-Set::Set(const std::string &var, const Expr &e) : ExprBase(E_SET), var(var), e(e) {}
+Set::Set(SymbolId var, const Expr &e) : ExprBase(E_SET), var(var), depth(0), slot(0), local(false), boxed(false), cell(globalCell(var)), e(e) {}
+
+Set::Set(SymbolId var, int d, int i, const Expr &e) : ExprBase(E_SET), var(var), depth(d), slot(i), local(true), boxed(false), cell(nullptr), e(e) {}
 
 //I/O OPERATIONS
 
-Display::Display(const Expr &r) : Unary(E_DISPLAY, r) {}
\ No newline at end of file
+Display::Display(const Expr &r) : Unary(E_DISPLAY, r) {}
+
+//CONTINUATIONS
+
+CallCC::CallCC(const Expr &r) : ExprBase(E_CALLCC), rand(r) {}
\ No newline at end of file
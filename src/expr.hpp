@@ -23,22 +23,93 @@ public:
 #include <cstring>
 #include <vector>
 
+/**
+ * @brief How a node is evaluated, so engines can dispatch without RTTI
+ * Primitive operations share one e_type between shapes (Plus and PlusVar
+ * are both E_PLUS), so the shape is kept next to it.
+ */
+enum ExprShape {
+    S_SPECIAL,          ///< Literal, variable or special form: see e_type
+    S_UNARY,            ///< A Unary primitive
+    S_BINARY,           ///< A Binary primitive
+    S_VARIADIC          ///< A Variadic primitive
+};
+
 struct ExprBase{
     ExprType e_type;
-    ExprBase(ExprType);
+    ExprShape shape;
+    int refs;           ///< Number of Expr handles referring to this node
+    ExprBase(ExprType, ExprShape = S_SPECIAL);
     virtual Value eval(Assoc &) = 0;
     virtual ~ExprBase() = default;
 };
 
-class Expr {
-    std::shared_ptr<ExprBase> ptr;
-public:
+/// Deletes a node whose last handle is gone, without recursing into its subexpressions
+void freeExpr(ExprBase *);
+
+/**
+ * @brief Reference-counted handle to an expression node
+ * Single-threaded, so the count is a plain int inside the node.
+ */
+struct Expr {
+    ExprBase *ptr;
     Expr(ExprBase *);
+    Expr(const Expr &);
+    Expr(Expr &&);
+    Expr &operator=(const Expr &);
+    Expr &operator=(Expr &&);
+    ~Expr();
     ExprBase* operator->() const;
     ExprBase& operator*();
     ExprBase* get() const;
 };
 
+inline Expr::Expr(ExprBase *x) : ptr(x) {
+    if (ptr != nullptr) ++ptr->refs;
+}
+
+inline Expr::Expr(const Expr &other) : ptr(other.ptr) {
+    if (ptr != nullptr) ++ptr->refs;
+}
+
+inline Expr::Expr(Expr &&other) : ptr(other.ptr) {
+    other.ptr = nullptr;
+}
+
+inline Expr &Expr::operator=(const Expr &other) {
+    if (other.ptr != nullptr) ++other.ptr->refs;
+    ExprBase *old = ptr;
+    ptr = other.ptr;
+    if (old != nullptr && --old->refs == 0) freeExpr(old);
+    return *this;
+}
+
+inline Expr &Expr::operator=(Expr &&other) {
+    if (this != &other) {
+        ExprBase *old = ptr;
+        ptr = other.ptr;
+        other.ptr = nullptr;
+        if (old != nullptr && --old->refs == 0) freeExpr(old);
+    }
+    return *this;
+}
+
+inline Expr::~Expr() {
+    if (ptr != nullptr && --ptr->refs == 0) freeExpr(ptr);
+}
+
+inline ExprBase* Expr::operator->() const {
+    return ptr;
+}
+
+inline ExprBase& Expr::operator*() {
+    return *ptr;
+}
+
+inline ExprBase* Expr::get() const {
+    return ptr;
+}
+
 // ================================================================================
 //                             BASIC TYPES AND LITERALS
 // ================================================================================
@@ -53,6 +124,16 @@ struct Fixnum : ExprBase {
   virtual Value eval(Assoc &) override;
 };
 
+/**
+ * @brief Integer literal expression beyond the fixnum range
+ */
+struct BignumExpr : ExprBase {
+  BigInt n;
+  int constant;     ///< Index of the value in the constant pool
+  BignumExpr(const BigInt &);
+  virtual Value eval(Assoc &) override;
+};
+
 /**
  * @brief Rational number literal expression
  * Represents rational numbers as numerator/denominator
@@ -60,6 +141,7 @@ struct Fixnum : ExprBase {
 struct RationalNum : ExprBase {
   int numerator;
   int denominator;
+  int constant;     ///< Index of the value in the constant pool
   RationalNum(int num, int den);
   virtual Value eval(Assoc &) override;
 };
@@ -70,6 +152,7 @@ struct RationalNum : ExprBase {
  */
 struct StringExpr : ExprBase {
   std::string s;
+  int constant;     ///< Index of the value in the constant pool
   StringExpr(const std::string &);
   virtual Value eval(Assoc &) override;
 };
@@ -100,6 +183,22 @@ struct Exit : ExprBase {
     virtual Value eval(Assoc &) override;
 };
 
+/**
+ * @brief (gc): runs a cycle collection right away
+ */
+struct Collect : ExprBase {
+    Collect();
+    virtual Value eval(Assoc &) override;
+};
+
+/**
+ * @brief (read): the next datum of the program's input, see readDatum
+ */
+struct Read : ExprBase {
+    Read();
+    virtual Value eval(Assoc &) override;
+};
+
 // ================================================================================
 //                             BASIC ABSTRACT TYPES FOR PARAMETERS
 // ================================================================================
@@ -111,14 +210,36 @@ struct Unary : ExprBase {
     virtual Value eval(Assoc &) override;
 };
 
+/**
+ * @brief Operand types a Binary node has seen, see Binary::operate
+ */
+enum Specialization {
+    SPEC_NONE,          ///< Not run yet
+    SPEC_INT,           ///< Only ever applied to two fixnums
+    SPEC_GENERIC        ///< Seen something else, or not specializable
+};
+
 struct Binary : ExprBase {
     Expr rand1;
     Expr rand2;
+    Specialization spec;
     Binary(ExprType, const Expr &, const Expr &);
+    Value operate(const Value &, const Value &);
     virtual Value evalRator(const Value &, const Value &) = 0;
     virtual Value eval(Assoc &) override;
 };
 
+/**
+ * @brief How the specializing Binary nodes ended up, counted per site
+ */
+struct SpecStats {
+    size_t monomorphic;     ///< Sites only ever applied to fixnums
+    size_t generic;         ///< Sites that saw a rational or a type error
+    size_t rewrites;        ///< Of those, sites that were fixnum-only at first
+};
+
+SpecStats specStats();
+
 struct Variadic : ExprBase {
     std::vector<Expr> rands;
     Variadic(ExprType, const std::vector<Expr> &);
@@ -348,9 +469,15 @@ struct Begin : ExprBase {
     virtual Value eval(Assoc &) override;
 };
 
+/**
+ * @brief Quotation; the datum is built into the constant pool once, when
+ * the node is made, unless it is malformed: then each evaluation fails
+ */
 struct Quote : ExprBase {
   Syntax s;
+  int constant;     ///< Index of the datum in the constant pool, or -1
   Quote(const Syntax &);
+  static int datum(const Syntax &);   ///< Pools a datum, throws if malformed
   virtual Value eval(Assoc &) override;
 };
 
@@ -376,30 +503,111 @@ struct Cond : ExprBase {
 //                             VARIABLE AND FUNCITION DEFINITION
 // ================================================================================
 
+/**
+ * @brief Variable reference with a lexical address resolved at parse time
+ * A local lives in slot `slot` of the frame `depth` levels up (or in the Box
+ * held there, if it is boxed); a global is linked to its top-level cell.
+ */
 struct Var : ExprBase {
-    std::string x;
-    Var(const std::string &);
+    SymbolId x;
+    int depth;
+    int slot;
+    bool local;
+    bool boxed;
+    GlobalCell *cell;
+    Var(SymbolId);
+    Var(SymbolId, int, int);
     virtual Value eval(Assoc &) override;
 };
 
+/**
+ * @brief A callee an Apply has checked once, see Apply::eval
+ * The closures made by one lambda share its body, so the body stands for
+ * all of them; a primitive stands for itself.
+ */
+struct CallTarget {
+    const void *code;       ///< The closures' body, or the PrimitiveProcedure
+    Expr body;              ///< Holds that body, so its address is not reused
+    int frame;              ///< Slots of a call frame; unused for a primitive
+    bool boxed;             ///< Whether the frame has slots to box
+    CallTarget() : code(nullptr), body(nullptr), frame(0), boxed(false) {}
+};
+
+/// Callees an Apply remembers; calls to any other one take the slow path
+const int CALL_CACHE_SIZE = 4;
+
+/**
+ * @brief Procedure application
+ * A call in tail position of a lambda body (marked by the parser) does not
+ * run the callee itself: it hands the prepared frame back to the nearest
+ * enclosing non-tail call, which runs it in a loop (a trampoline).
+ *
+ * Each site keeps an inline cache of the callees it has seen, with their
+ * arity already checked and their frame layout, so calls to one of them
+ * skip the checks.
+ */
 struct Apply : ExprBase {
     Expr rator;
     std::vector<Expr> rand;
+    bool tail;
+    CallTarget targets[CALL_CACHE_SIZE];
+    int ntargets;           ///< Entries of targets in use
+    size_t hits;
+    size_t misses;
+    int site;               ///< Index among the sites called so far, or -1
     Apply(const Expr &, const std::vector<Expr> &);
+    ~Apply();
+    const CallTarget *lookup(const void *code);
+    const CallTarget *miss();
+    const CallTarget *remember(const void *code, const Expr &body, int frame, bool boxed);
     virtual Value eval(Assoc &) override;
 };
 
+inline const CallTarget *Apply::lookup(const void *code) {
+    for (int i = 0; i < ntargets; ++i) {
+        if (targets[i].code == code) {
+            ++hits;
+            return &targets[i];
+        }
+    }
+    return miss();
+}
+
+/**
+ * @brief Writes the inline cache hit rate of every call site still alive,
+ * busiest first, and a total for the sites freed since
+ */
+void dumpCallSites(std::ostream &);
+
+/**
+ * @brief Lambda; the closure copies just the variables the body uses from
+ * outside into a flat frame, which becomes the parent of its call frames
+ */
 struct Lambda : ExprBase {
-    std::vector<std::string> x;
+    std::vector<SymbolId> x;
+    std::vector<SymbolId> locals;   ///< Internal defines of the body
     Expr e;
-    Lambda(const std::vector<std::string> &, const Expr &);
+    std::vector<std::pair<int, int>> captures;  ///< (depth, slot) of each free variable
+    std::vector<int> boxed;         ///< Slots of the call frame that hold a Box
+    Lambda(const std::vector<SymbolId> &, const std::vector<SymbolId> &, const Expr &,
+           const std::vector<std::pair<int, int>> &, const std::vector<int> &);
     virtual Value eval(Assoc &) override;
 };
 
+/**
+ * @brief Definition; a top-level define fills the variable's global cell, an
+ * internal one fills the slot its body reserved (see Var for depth/local)
+ */
 struct Define : ExprBase {
-    std::string var;
+    SymbolId var;
+    int depth;
+    int slot;
+    bool local;
+    bool boxed;
+    GlobalCell *cell;
     Expr e;
-    Define(const std::string &, const Expr &);
+    Define(SymbolId, const Expr &);
+    Define(SymbolId, int, int, const Expr &);
     virtual Value eval(Assoc &) override;
 };
 
@@ -408,16 +616,23 @@ struct Define : ExprBase {
 // ================================================================================
 
 struct Let : ExprBase {
-    std::vector<std::pair<std::string, Expr>> bind;
+    std::vector<std::pair<SymbolId, Expr>> bind;
+    std::vector<SymbolId> locals;   ///< Internal defines of the body
     Expr body;
-    Let(const std::vector<std::pair<std::string, Expr>> &, const Expr &);
+    std::vector<int> boxed;         ///< Slots of the new frame that hold a Box
+    Let(const std::vector<std::pair<SymbolId, Expr>> &, const std::vector<SymbolId> &, const Expr &,
+        const std::vector<int> &);
     virtual Value eval(Assoc &) override;
 };
 
 struct Letrec : ExprBase {
-    std::vector<std::pair<std::string, Expr>> bind;
+    std::vector<std::pair<SymbolId, Expr>> bind;
+    std::vector<SymbolId> locals;   ///< Internal defines of the body
     Expr body;
-    Letrec(const std::vector<std::pair<std::string, Expr>> &, const Expr &);
+    std::vector<int> boxed;         ///< Slots of the new frame that hold a Box
+    Letrec(const std::vector<std::pair<SymbolId, Expr>> &, const std::vector<SymbolId> &, const Expr &,
+           const std::vector<int> &);
+    bool isBoxed(size_t) const;
     virtual Value eval(Assoc &) override;
 };
 
@@ -426,9 +641,15 @@ struct Letrec : ExprBase {
 // ================================================================================
 
 struct Set : ExprBase {
-    std::string var;
+    SymbolId var;
+    int depth;         ///< Lexical address, see Var
+    int slot;
+    bool local;
+    bool boxed;
+    GlobalCell *cell;
     Expr e;
-    Set(const std::string &, const Expr &);
+    Set(SymbolId, const Expr &);
+    Set(SymbolId, int, int, const Expr &);
     virtual Value eval(Assoc &) override;
 };
 
@@ -441,4 +662,19 @@ struct Display : Unary {
     virtual Value evalRator(const Value &) override;
 };
 
+// ================================================================================
+//                              CONTINUATIONS
+// ================================================================================
+
+/**
+ * @brief (call/cc f): calls f with the continuation of this expression
+ * Not a Unary: applying f is up to the engine, and so is how much of the
+ * continuation can be captured (the tree walker can only escape with it).
+ */
+struct CallCC : ExprBase {
+    Expr rand;
+    CallCC(const Expr &);
+    virtual Value eval(Assoc &) override;
+};
+
 #endif
@@ -0,0 +1,124 @@
+/**
+ * @file gc.cpp
+ * @brief Heap registry and cycle collection
+ *
+ * A collection works on a snapshot of the registry in three passes: count
+ * the references each object receives from inside the heap, mark from the
+ * objects that also have references from outside, then cut the cycles
+ * among the unmarked ones so that reference counting frees them.
+ */
+
+#include "gc.hpp"
+#include <algorithm>
+#include <vector>
+
+namespace {
+
+/// Heap size below which no collection is started
+const size_t MIN_THRESHOLD = 1 << 16;
+
+// Never destroyed: objects held by statics are freed after main returns
+std::vector<Collectable *> &registry() {
+    static std::vector<Collectable *> *objects = new std::vector<Collectable *>();
+    return *objects;
+}
+
+size_t collections = 0;
+size_t reclaimed = 0;
+size_t peak = 0;
+
+// Leaves in count[i] the references to object i from outside the heap
+struct InternalRefs : Tracer {
+    std::vector<int> &count;
+    explicit InternalRefs(std::vector<int> &count) : count(count) {}
+    void visit(Collectable *o) override { --count[o->gc_index]; }
+};
+
+struct Marker : Tracer {
+    std::vector<char> &marked;
+    std::vector<Collectable *> &work;
+    Marker(std::vector<char> &marked, std::vector<Collectable *> &work) : marked(marked), work(work) {}
+    void visit(Collectable *o) override {
+        if (marked[o->gc_index]) return;
+        marked[o->gc_index] = 1;
+        work.push_back(o);
+    }
+};
+
+} // namespace
+
+size_t gc_live = 0;
+size_t gc_threshold = MIN_THRESHOLD;
+
+Collectable::Collectable() : refs(0) {
+    std::vector<Collectable *> &objects = registry();
+    gc_index = (int)objects.size();
+    objects.push_back(this);
+    gc_live = objects.size();
+    if (gc_live > peak) peak = gc_live;
+}
+
+void Collectable::trace(Tracer &) {}
+
+void Collectable::clear() {}
+
+void Collectable::destroy() {
+    delete this;
+}
+
+Collectable::~Collectable() {
+    std::vector<Collectable *> &objects = registry();
+    Collectable *last = objects.back();
+    objects[gc_index] = last;
+    last->gc_index = gc_index;
+    objects.pop_back();
+    gc_live = objects.size();
+}
+
+/**
+ * @brief Frees every object only reachable from cycles
+ * @return the number of objects freed
+ */
+size_t collect() {
+    std::vector<Collectable *> &objects = registry();
+    size_t n = objects.size();
+
+    std::vector<int> count(n);
+    for (size_t i = 0; i < n; ++i) count[i] = objects[i]->refs;
+    InternalRefs internal(count);
+    for (size_t i = 0; i < n; ++i) objects[i]->trace(internal);
+
+    std::vector<char> marked(n, 0);
+    std::vector<Collectable *> work;
+    for (size_t i = 0; i < n; ++i) {
+        if (count[i] > 0) {
+            marked[i] = 1;
+            work.push_back(objects[i]);
+        }
+    }
+    Marker marker(marked, work);
+    while (!work.empty()) {
+        Collectable *o = work.back();
+        work.pop_back();
+        o->trace(marker);
+    }
+
+    std::vector<Collectable *> garbage;
+    for (size_t i = 0; i < n; ++i)
+        if (!marked[i]) garbage.push_back(objects[i]);
+    // Hold every garbage object while the cycles are cut, so that
+    // each is freed exactly once, by the last loop
+    for (Collectable *o : garbage) ++o->refs;
+    for (Collectable *o : garbage) o->clear();
+    for (Collectable *o : garbage)
+        if (--o->refs == 0) o->destroy();
+
+    ++collections;
+    reclaimed += garbage.size();
+    gc_threshold = std::max(MIN_THRESHOLD, 2 * gc_live);
+    return garbage.size();
+}
+
+GcStats gcStats() {
+    return GcStats{collections, reclaimed, gc_live, peak};
+}
@@ -0,0 +1,69 @@
+#ifndef GC_HPP
+#define GC_HPP
+
+/**
+ * @file gc.hpp
+ * @brief Cycle collector for the reference-counted runtime heap
+ *
+ * Values, frames and continuation segments free themselves when their last
+ * reference goes away. The collector reclaims what reference counting
+ * cannot: cycles, such as a closure kept in a box of a frame it captures,
+ * or a list closed on itself by set-cdr!.
+ *
+ * It needs no root set from the evaluators. Every heap object is
+ * registered, and a collection subtracts from each reference count the
+ * references found inside the heap. Whatever is left comes from outside
+ * (a C++ local, a VM or CEK stack, a global cell), so that object and
+ * everything it reaches are live; the rest is garbage.
+ */
+
+#include <cstddef>
+
+struct Collectable;
+
+/**
+ * @brief Visitor over the references an object holds to other objects
+ */
+struct Tracer {
+    virtual void visit(Collectable *) = 0;
+};
+
+/**
+ * @brief Header of every object the collector manages
+ */
+struct Collectable {
+    int refs;           ///< Number of handles (Value, Assoc, ...) pointing here
+    int gc_index;       ///< Position in the heap registry
+    Collectable();
+    Collectable(const Collectable &) = delete;
+    Collectable &operator=(const Collectable &) = delete;
+    virtual void trace(Tracer &);   ///< Visit every object this one refers to
+    virtual void clear();           ///< Drop those references
+    virtual void destroy();         ///< Free the object once its count drops to 0
+    virtual ~Collectable();
+};
+
+struct GcStats {
+    size_t collections;
+    size_t reclaimed;   ///< Objects freed by collections, in total
+    size_t live;        ///< Objects registered right now
+    size_t peak;        ///< Most objects registered at once
+};
+
+extern size_t gc_live;
+extern size_t gc_threshold;
+
+size_t collect();
+GcStats gcStats();
+
+/**
+ * @brief Collects if the heap has grown enough since the last collection
+ *
+ * Called by the evaluators where every object they still use is held by
+ * a counted handle, i.e. when entering a procedure.
+ */
+inline void gcSafePoint() {
+    if (gc_live >= gc_threshold) collect();
+}
+
+#endif
@@ -3,79 +3,272 @@
 #include "expr.hpp"
 #include "value.hpp"
 #include "RE.hpp"
+#include "vm.hpp"
+#include "cek.hpp"
+#include "optimizer.hpp"
 #include <sstream>
 #include <iostream>
 #include <map>
+#include <cstring>
+#include <memory>
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
 
-extern std::map<std::string, ExprType> primitives;
-extern std::map<std::string, ExprType> reserved_words;
-
+// The forms whose value can be the whole form's are kept on a stack of
+// their own, so a deeply nested form is walked without recursion
 bool isExplicitVoidCall(Expr expr) {
-    MakeVoid* make_void_expr = dynamic_cast<MakeVoid*>(expr.get());
-    if (make_void_expr != nullptr) {
-        return true;
-    }
-    
-    Apply* apply_expr = dynamic_cast<Apply*>(expr.get());
-    if (apply_expr != nullptr) {
-        Var* var_expr = dynamic_cast<Var*>(apply_expr->rator.get());
-        if (var_expr != nullptr && var_expr->x == "void") {
+    static const SymbolId void_sym = intern("void");
+    std::vector<ExprBase *> work(1, expr.get());
+    while (!work.empty()) {
+        ExprBase *e = work.back();
+        work.pop_back();
+
+        if (e->e_type == E_VOID) {
             return true;
         }
-    }
-    
-    Begin* begin_expr = dynamic_cast<Begin*>(expr.get());
-    if (begin_expr != nullptr && !begin_expr->es.empty()) {
-        return isExplicitVoidCall(begin_expr->es.back());
-    }
-    
-    If* if_expr = dynamic_cast<If*>(expr.get());
-    if (if_expr != nullptr) {
-        return isExplicitVoidCall(if_expr->conseq) || isExplicitVoidCall(if_expr->alter);
-    }
-    
-    Cond* cond_expr = dynamic_cast<Cond*>(expr.get());
-    if (cond_expr != nullptr) {
-        for (const auto& clause : cond_expr->clauses) {
-            if (clause.size() > 1 && isExplicitVoidCall(clause.back())) {
+
+        if (e->e_type == E_APPLY) {
+            Apply* apply_expr = static_cast<Apply*>(e);
+            if (apply_expr->rator->e_type == E_VAR && static_cast<Var*>(apply_expr->rator.get())->x == void_sym) {
                 return true;
             }
         }
+
+        if (e->e_type == E_BEGIN) {
+            Begin* begin_expr = static_cast<Begin*>(e);
+            if (!begin_expr->es.empty()) work.push_back(begin_expr->es.back().get());
+        }
+
+        if (e->e_type == E_IF) {
+            If* if_expr = static_cast<If*>(e);
+            work.push_back(if_expr->alter.get());
+            work.push_back(if_expr->conseq.get());
+        }
+
+        if (e->e_type == E_COND) {
+            Cond* cond_expr = static_cast<Cond*>(e);
+            for (auto it = cond_expr->clauses.rbegin(); it != cond_expr->clauses.rend(); ++it) {
+                if (it->size() > 1) work.push_back(it->back().get());
+            }
+        }
     }
     return false;
 }
 
-void REPL(){
+enum Engine {
+    TREE_WALKER,    // eval() on the Expr tree, recursing on the C++ stack
+    BYTECODE_VM,    // compile to bytecode, run on the stack VM (--vm)
+    CEK_MACHINE     // explicit continuations in heap segments (--cek)
+};
+
+// Parses, evaluates and prints one top-level form; false once it has
+// called (exit), which prints nothing
+static bool runForm(const Syntax &stx, Scope &top_level, Assoc &top_env, Engine engine, int opt_level) {
+    try{
+        Expr expr = stx -> parse(top_level); // parse
+        // stx -> show(std :: cout); // syntax print
+        // Asked of the parsed form: optimize rewrites it in place, and
+        // what is printed must not depend on the optimization level
+        bool explicit_void = isExplicitVoidCall(expr);
+        Expr code = optimize(expr, opt_level);
+        Value val = engine == BYTECODE_VM ? execute(compile(code), top_env)
+                  : engine == CEK_MACHINE ? cekEval(code, top_env)
+                  : code -> eval(top_env);
+        if (val.type() == V_TERMINATE)
+            return false;
+        // Suppress printing of #<void> except for explicit (void) calls
+        if (val.type() == V_VOID && !explicit_void) {
+            // do not print
+        } else {
+            val.show(std :: cout); // value print
+        }
+    }
+    catch (const RuntimeError &RE){
+        // std :: cout << RE.message();
+        std :: cout << "RuntimeError";
+    }
+    return true;
+}
+
+void REPL(Engine engine, int opt_level){
     // read - evaluation - print loop
-    Assoc global_env = empty();
+    Assoc top_env = empty(); // top-level forms run outside any frame
+    Scope top_level;
+    // Input that is not typed in is read in one go, see SourceBuffer
+    bool interactive = isatty(0);
+    std::unique_ptr<SourceBuffer> input(interactive ? nullptr : new SourceBuffer(0));
+    Reader reader = interactive ? Reader(nullptr, nullptr) : input->reader();
+    read_source = interactive ? nullptr : &reader;
     while (1){
         #ifndef ONLINE_JUDGE
             std::cout << "scm> ";
         #endif
-        Syntax stx = readSyntax(std :: cin); // read
-        try{
-            Expr expr = stx -> parse(global_env); // parse
-            // stx -> show(std :: cout); // syntax print
-            Value val = expr -> eval(global_env);
-            if (val -> v_type == V_TERMINATE)
-                break;
-            // Suppress printing of #<void> except for explicit (void) calls
-            if (val->v_type == V_VOID && !isExplicitVoidCall(expr)) {
-                // do not print
-            } else {
-                val -> show(std :: cout); // value print
-            }
+        Syntax stx = interactive ? readSyntax(std :: cin) : readSyntax(reader); // read
+        if (!runForm(stx, top_level, top_env, engine, opt_level))
+            break;
+        puts("");
+        // Nothing reads std::cin to flush it any more: what each form
+        // printed goes out before the next runs, so a crash loses none of it
+        fflush(stdout);
+    }
+}
+
+/**
+ * @brief Standard output of batch mode: one large block, handed to
+ * write(2) whenever it fills and at the end
+ */
+class BlockOutput : public std::streambuf {
+public:
+    explicit BlockOutput(int fd) : fd(fd), block(1 << 20) {
+        setp(block.data(), block.data() + block.size());
+    }
+    ~BlockOutput() { flush(); }
+protected:
+    int overflow(int c) override {
+        if (!flush()) return traits_type::eof();
+        if (c != traits_type::eof()) sputc((char)c);
+        return traits_type::not_eof(c);
+    }
+    int sync() override {
+        return flush() ? 0 : -1;
+    }
+private:
+    int fd;
+    std::vector<char> block;
+    bool flush() {
+        for (const char *p = pbase(); p < pptr();) {
+            ssize_t n = write(fd, p, pptr() - p);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            p += n;
         }
-        catch (const RuntimeError &RE){
-            // std :: cout << RE.message();
-            std :: cout << "RuntimeError";
+        setp(block.data(), block.data() + block.size());
+        return true;
+    }
+};
+
+/**
+ * @brief Runs a program file: `code program.scm`
+ *
+ * The file is mapped whole, and everything printed, by display as well as
+ * the results, goes into one BlockOutput in place of std::cout's stdio
+ * stream. The output is the REPL's without its prompts. Each form is
+ * still parsed only once the forms before it have run, as in the REPL:
+ * the parser asks which globals are defined so far, and read takes the
+ * text after the form calling it.
+ *
+ * A ')' that closes nothing, where the REPL would keep reading an empty
+ * datum, is reported on stderr and skipped, and the forms after it still
+ * run; the exit status is then 1.
+ */
+int runFile(const char *path, Engine engine, int opt_level) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        std::cerr << path << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+    SourceBuffer input(fd);
+    close(fd);
+    Reader reader = input.reader();
+    read_source = &reader;
+    BlockOutput out(1);
+    std::streambuf *console = std::cout.rdbuf(&out);
+    Assoc top_env = empty();
+    Scope top_level;
+    int status = 0;
+    while (true) {
+        if (!atDatum(reader)) {
+            if (reader.atEnd()) break;
+            std::cout.flush();     // what the forms before it printed comes first
+            std::cerr << path << ':' << 1 + std::count(input.data, reader.pos, '\n')
+                      << ": unexpected '" << *reader.pos << "'" << std::endl;
+            ++reader.pos;
+            status = 1;
+            continue;
         }
-        puts("");
+        if (!runForm(readSyntax(reader), top_level, top_env, engine, opt_level))
+            break;
+        std::cout << '\n';
     }
+    std::cout.rdbuf(console);
+    read_source = nullptr;
+    return status;
 }
 
+// Reader throughput on standard input, with each scan kernel this CPU has:
+// the scan alone, then reading every datum
+void readBenchmark() {
+    typedef std::chrono::steady_clock Clock;
+    SourceBuffer input(0);
+    double mb = input.size / 1e6;
+    size_t blocks = input.size / SCAN_BLOCK;
+    std::vector<ScanMasks> masks(SCAN_WINDOW);
+    for (int l = SCAN_SCALAR; l <= SCAN_AVX2; ++l) {
+        ScanLevel level = (ScanLevel)l;
+        ScanKernel kernel = scanKernel(level);
+        if (kernel == nullptr) continue;
+        double scan = 1e30, read = 1e30;
+        for (int run = 0; run < 3; ++run) {
+            Clock::time_point t0 = Clock::now();
+            for (size_t i = 0; i < blocks; i += SCAN_WINDOW)
+                kernel(input.data + i * SCAN_BLOCK, std::min(SCAN_WINDOW, blocks - i), masks.data());
+            Clock::time_point t1 = Clock::now();
+            Reader reader(input.data, input.data + input.size, level);
+            while (!reader.atEnd()) {
+                const char *before = reader.pos;
+                readSyntax(reader);
+                if (reader.pos == before) ++reader.pos;     // a stray ')' at top level
+            }
+            Clock::time_point t2 = Clock::now();
+            scan = std::min(scan, std::chrono::duration<double>(t1 - t0).count());
+            read = std::min(read, std::chrono::duration<double>(t2 - t1).count());
+        }
+        std::cout << std::fixed << std::setprecision(1) << scanLevelName(level) << ": scan "
+                  << mb / scan << " MB/s, read " << mb / read << " MB/s" << std::endl;
+    }
+}
 
 int main(int argc, char *argv[]) {
-    REPL();
-    return 0;
+    Engine engine = TREE_WALKER;
+    bool gc_stats = false;
+    bool spec_stats = false;
+    bool call_stats = false;
+    int opt_level = DEFAULT_OPT_LEVEL;
+    const char *program = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--vm") == 0) engine = BYTECODE_VM;
+        else if (strcmp(argv[i], "--cek") == 0) engine = CEK_MACHINE;
+        else if (strcmp(argv[i], "--gc-stats") == 0) gc_stats = true;
+        else if (strcmp(argv[i], "--spec-stats") == 0) spec_stats = true;
+        else if (strcmp(argv[i], "--call-stats") == 0) call_stats = true;
+        else if (strcmp(argv[i], "--read-bench") == 0) {
+            readBenchmark();
+            return 0;
+        }
+        else if (strncmp(argv[i], "-O", 2) == 0 && argv[i][2] >= '0' && argv[i][2] <= '2' && argv[i][3] == 0)
+            opt_level = argv[i][2] - '0';
+        else if (argv[i][0] != '-')
+            program = argv[i];
+    }
+    int status = 0;
+    if (program != nullptr) status = runFile(program, engine, opt_level);
+    else REPL(engine, opt_level);
+    if (gc_stats) {
+        GcStats s = gcStats();
+        std::cerr << "gc: " << s.collections << " collections, " << s.reclaimed << " objects reclaimed, "
+                  << s.live << " live, " << s.peak << " peak" << std::endl;
+        SlabStats a = slabStats();
+        std::cerr << "slab: " << a.hits << " hits, " << a.misses << " misses" << std::endl;
+    }
+    if (spec_stats) {
+        SpecStats s = specStats();
+        std::cerr << "spec: " << s.monomorphic << " monomorphic sites, " << s.generic << " generic ("
+                  << s.rewrites << " rewritten from fixnum)" << std::endl;
+    }
+    if (call_stats) dumpCallSites(std::cerr);
+    return status;
 }
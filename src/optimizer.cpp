@@ -0,0 +1,332 @@
+/**
+ * @file optimizer.cpp
+ * @brief Constant folding and dead-code elimination on the Expr tree
+ *
+ * Folding runs the primitive itself on the literal operands, so a folded
+ * node yields what the engines would have computed. A primitive that fails
+ * on its operands (say (car 1) or (/ 1 0)) is left alone to fail at run
+ * time, and only fixnum and boolean results are substituted.
+ */
+
+#include "optimizer.hpp"
+#include "value.hpp"
+#include "RE.hpp"
+
+namespace {
+
+bool isLiteral(const Expr &e) {
+    switch (e->e_type) {
+        case E_FIXNUM:
+        case E_RATIONAL:
+        case E_BIGNUM:
+        case E_STRING:
+        case E_TRUE:
+        case E_FALSE:
+        case E_QUOTE:
+            return e->shape == S_SPECIAL;
+        default:
+            return false;
+    }
+}
+
+/// Only #f is false, whether written as a literal or quoted
+bool isFalseLiteral(const Expr &e) {
+    if (e->e_type == E_FALSE) return true;
+    return e->e_type == E_QUOTE && dynamic_cast<FalseSyntax *>(static_cast<Quote *>(e.get())->s.get()) != nullptr;
+}
+
+bool isTrueLiteral(const Expr &e) {
+    return isLiteral(e) && !isFalseLiteral(e);
+}
+
+bool isElse(const std::vector<Expr> &clause) {
+    static const SymbolId else_sym = intern("else");
+    return clause.size() > 1 && clause[0]->e_type == E_VAR && static_cast<Var *>(clause[0].get())->x == else_sym;
+}
+
+/// Primitives without effects, whose result depends on their operands only
+bool isFoldable(ExprType t) {
+    switch (t) {
+        case E_PLUS: case E_MINUS: case E_MUL: case E_DIV: case E_MODULO: case E_EXPT:
+        case E_LT: case E_LE: case E_EQ: case E_GE: case E_GT:
+        case E_CAR: case E_CDR: case E_NOT:
+        case E_BOOLQ: case E_INTQ: case E_NULLQ: case E_PAIRQ: case E_PROCQ:
+        case E_SYMBOLQ: case E_LISTQ: case E_STRINGQ:
+            return true;
+        default:
+            return false;
+    }
+}
+
+Value literalValue(const Expr &e) {
+    Assoc env = empty();
+    return e->eval(env);
+}
+
+/**
+ * The literal evaluating to v, or a null Expr if there is none. Only
+ * immediates qualify: a literal bignum or rational is one pooled object,
+ * where computing it makes a new one each time, and eq? must not tell
+ * the optimization levels apart.
+ */
+Expr toLiteral(const Value &v) {
+    switch (v.type()) {
+        case V_INT:
+            return Expr(new Fixnum(v.asInt()));
+        case V_BOOL:
+            return v.asBool() ? Expr(new True()) : Expr(new False());
+        default:
+            return Expr(nullptr);
+    }
+}
+
+struct Optimizer {
+    int level;
+
+    explicit Optimizer(int level) : level(level) {}
+
+    /**
+     * Optimizes the tree at root, each node after its subexpressions. The
+     * nodes in progress are kept on a stack of their own, each entered once
+     * to push its subexpressions and left once they are done, so a deeply
+     * nested tree does not recurse.
+     */
+    void run(Expr &root) {
+        struct Visit {
+            Expr *slot;
+            bool entered;
+        };
+        std::vector<Visit> work(1, Visit{&root, false});
+        std::vector<Expr *> subs;
+        while (!work.empty()) {
+            Visit &v = work.back();
+            if (v.entered) {
+                Expr *slot = v.slot;
+                work.pop_back();
+                *slot = leave(*slot);
+                continue;
+            }
+            v.entered = true;
+            subs.clear();
+            subexpressions(*v.slot, subs);
+            for (auto it = subs.rbegin(); it != subs.rend(); ++it) work.push_back(Visit{*it, false});
+        }
+    }
+
+    static void subexpressions(const Expr &e, std::vector<Expr *> &out) {
+        switch (e->shape) {
+            case S_UNARY:
+                out.push_back(&static_cast<Unary *>(e.get())->rand);
+                return;
+            case S_BINARY: {
+                Binary *b = static_cast<Binary *>(e.get());
+                out.push_back(&b->rand1);
+                out.push_back(&b->rand2);
+                return;
+            }
+            case S_VARIADIC:
+                for (Expr &r : static_cast<Variadic *>(e.get())->rands) out.push_back(&r);
+                return;
+            case S_SPECIAL:
+                break;
+        }
+        switch (e->e_type) {
+            case E_BEGIN:
+                for (Expr &x : static_cast<Begin *>(e.get())->es) out.push_back(&x);
+                return;
+            case E_IF: {
+                If *i = static_cast<If *>(e.get());
+                out.push_back(&i->cond);
+                out.push_back(&i->conseq);
+                out.push_back(&i->alter);
+                return;
+            }
+            case E_COND:
+                for (auto &cl : static_cast<Cond *>(e.get())->clauses)
+                    for (Expr &x : cl) out.push_back(&x);
+                return;
+            case E_AND:
+                for (Expr &r : static_cast<AndVar *>(e.get())->rands) out.push_back(&r);
+                return;
+            case E_OR:
+                for (Expr &r : static_cast<OrVar *>(e.get())->rands) out.push_back(&r);
+                return;
+            case E_APPLY: {
+                Apply *a = static_cast<Apply *>(e.get());
+                out.push_back(&a->rator);
+                for (Expr &r : a->rand) out.push_back(&r);
+                return;
+            }
+            case E_LAMBDA:
+                out.push_back(&static_cast<Lambda *>(e.get())->e);
+                return;
+            case E_DEFINE:
+                out.push_back(&static_cast<Define *>(e.get())->e);
+                return;
+            case E_SET:
+                out.push_back(&static_cast<Set *>(e.get())->e);
+                return;
+            case E_LET: {
+                Let *l = static_cast<Let *>(e.get());
+                for (auto &b : l->bind) out.push_back(&b.second);
+                out.push_back(&l->body);
+                return;
+            }
+            case E_LETREC: {
+                Letrec *l = static_cast<Letrec *>(e.get());
+                for (auto &b : l->bind) out.push_back(&b.second);
+                out.push_back(&l->body);
+                return;
+            }
+            case E_CALLCC:
+                out.push_back(&static_cast<CallCC *>(e.get())->rand);
+                return;
+            default:
+                return;
+        }
+    }
+
+    /// The node to put in place of e, whose subexpressions are optimized
+    Expr leave(const Expr &e) {
+        switch (e->shape) {
+            case S_UNARY: {
+                Unary *u = static_cast<Unary *>(e.get());
+                if (!isFoldable(e->e_type) || !isLiteral(u->rand)) return e;
+                return fold(e, [&] { return u->evalRator(literalValue(u->rand)); });
+            }
+            case S_BINARY: {
+                Binary *b = static_cast<Binary *>(e.get());
+                if (!isFoldable(e->e_type) || !isLiteral(b->rand1) || !isLiteral(b->rand2)) return e;
+                // evalRator rather than operate: folding is not a use of the site
+                return fold(e, [&] { return b->evalRator(literalValue(b->rand1), literalValue(b->rand2)); });
+            }
+            case S_VARIADIC: {
+                Variadic *v = static_cast<Variadic *>(e.get());
+                if (!isFoldable(e->e_type)) return e;
+                for (const Expr &r : v->rands)
+                    if (!isLiteral(r)) return e;
+                return fold(e, [&] {
+                    std::vector<Value> args;
+                    for (const Expr &r : v->rands) args.push_back(literalValue(r));
+                    return v->evalRator(args);
+                });
+            }
+            case S_SPECIAL:
+                break;
+        }
+        switch (e->e_type) {
+            case E_BEGIN:
+                return begin(e);
+            case E_IF: {
+                If *i = static_cast<If *>(e.get());
+                if (!isLiteral(i->cond)) return e;
+                return isFalseLiteral(i->cond) ? i->alter : i->conseq;
+            }
+            case E_COND:
+                return cond(e);
+            case E_AND:
+                return conjunction(e);
+            case E_OR:
+                return disjunction(e);
+            default:
+                return e;
+        }
+    }
+
+    template <typename F>
+    Expr fold(const Expr &e, F compute) {
+        try {
+            Expr lit = toLiteral(compute());
+            return lit.get() ? lit : e;
+        } catch (const RuntimeError &) {
+            return e;
+        }
+    }
+
+    Expr begin(const Expr &e) {
+        Begin *b = static_cast<Begin *>(e.get());
+        if (level >= 2 && b->es.size() > 1) {
+            std::vector<Expr> kept;
+            for (size_t i = 0; i + 1 < b->es.size(); ++i)
+                if (!isDiscardable(b->es[i])) kept.push_back(b->es[i]);
+            kept.push_back(b->es.back());
+            b->es.swap(kept);
+        }
+        if (b->es.size() == 1) return b->es[0];
+        return e;
+    }
+
+    /// Evaluating e can neither fail nor be observed, so its value can go
+    static bool isDiscardable(const Expr &e) {
+        return isLiteral(e) || e->e_type == E_LAMBDA || (e->e_type == E_VOID && e->shape == S_SPECIAL);
+    }
+
+    Expr cond(const Expr &e) {
+        Cond *c = static_cast<Cond *>(e.get());
+        std::vector<std::vector<Expr>> kept;
+        for (auto &cl : c->clauses) {
+            if (isElse(cl) || isTrueLiteral(cl[0])) {
+                // Always taken: the clauses after it are unreachable
+                kept.push_back(cl);
+                break;
+            }
+            if (isFalseLiteral(cl[0])) continue;
+            kept.push_back(cl);
+        }
+        c->clauses.swap(kept);
+        if (c->clauses.empty()) return Expr(new MakeVoid());
+        std::vector<Expr> &first = c->clauses[0];
+        if (!isElse(first) && !isTrueLiteral(first[0])) return e;
+        if (first.size() == 1) return first[0];
+        std::vector<Expr> body(first.begin() + 1, first.end());
+        if (body.size() == 1) return body[0];
+        return begin(Expr(new Begin(body)));
+    }
+
+    Expr conjunction(const Expr &e) {
+        AndVar *a = static_cast<AndVar *>(e.get());
+        std::vector<Expr> kept;
+        for (size_t i = 0; i < a->rands.size(); ++i) {
+            const Expr &r = a->rands[i];
+            bool last = i + 1 == a->rands.size();
+            if (isFalseLiteral(r)) {
+                kept.push_back(Expr(new False()));
+                break;
+            }
+            if (!last && isTrueLiteral(r)) continue;
+            kept.push_back(r);
+        }
+        if (kept.empty()) return Expr(new True());
+        if (kept.size() == 1 && isLiteral(kept[0])) return kept[0];
+        a->rands.swap(kept);
+        return e;
+    }
+
+    Expr disjunction(const Expr &e) {
+        OrVar *o = static_cast<OrVar *>(e.get());
+        std::vector<Expr> kept;
+        for (size_t i = 0; i < o->rands.size(); ++i) {
+            const Expr &r = o->rands[i];
+            bool last = i + 1 == o->rands.size();
+            if (isTrueLiteral(r)) {
+                kept.push_back(r);
+                break;
+            }
+            if (!last && isFalseLiteral(r)) continue;
+            kept.push_back(r);
+        }
+        if (kept.empty()) return Expr(new False());
+        if (kept.size() == 1 && isLiteral(kept[0])) return kept[0];
+        o->rands.swap(kept);
+        return e;
+    }
+};
+
+} // namespace
+
+Expr optimize(const Expr &e, int level) {
+    if (level <= 0) return e;
+    Expr result = e;
+    Optimizer(level).run(result);
+    return result;
+}
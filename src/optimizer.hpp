@@ -0,0 +1,31 @@
+#ifndef OPTIMIZER_HPP
+#define OPTIMIZER_HPP
+
+/**
+ * @file optimizer.hpp
+ * @brief Rewrites of the parsed Expr tree before it is run
+ *
+ * The passes only use what the parser has already resolved: a primitive node
+ * exists only where its name was not shadowed, so folding one never changes
+ * what a program means. Every engine runs the rewritten tree.
+ *
+ * - Level 0 leaves the tree as parsed.
+ * - Level 1 folds primitives applied to literals, and prunes if, cond, and
+ *   and or on tests known at parse time.
+ * - Level 2 also drops the forms of a begin whose value is unused and that
+ *   can neither fail nor have an effect (literals, quotes, lambdas).
+ */
+
+#include "Def.hpp"
+#include "expr.hpp"
+
+/// Level used when none is given on the command line
+const int DEFAULT_OPT_LEVEL = 2;
+
+/**
+ * @brief Optimizes the tree in place, bottom-up
+ * @return the node to run instead of the argument (possibly the argument)
+ */
+Expr optimize(const Expr &, int level);
+
+#endif
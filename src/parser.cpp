@@ -15,281 +15,664 @@
 #include <map>
 #include <string>
 #include <iostream>
+#include <algorithm>
+#include <memory>
 
 #define mp make_pair
 using std::string;
 using std::vector;
 using std::pair;
 
-extern std::map<std::string, ExprType> primitives;
-extern std::map<std::string, ExprType> reserved_words;
+Scope::Scope(Scope *parent, bool function) : parent(parent), function(function) {}
+
+bool Scope::isTopLevel() const {
+    return parent == nullptr;
+}
+
+void Scope::bind(const vector<SymbolId> &xs) {
+    names = xs;
+    bindings.assign(xs.size(), Binding());
+}
+
+/**
+ * @brief Resolves a name to its lexical address
+ *
+ * Walks the contours from the innermost outwards. Returns the binding with
+ * the frame depth and slot for a local, nullptr for a global. A name bound
+ * twice in one contour resolves to its last binding. A name found outside
+ * the innermost enclosing lambda is captured by it and addressed in its
+ * capture frame, just past the lambda's own frame; the lambdas crossed on
+ * the way out capture it in turn, each from the next one out.
+ */
+Binding *Scope::resolve(SymbolId x, int &depth, int &slot) {
+    vector<pair<Scope *, int>> crossed;     // Lambda bodies left, with their depth
+    Binding *b = nullptr;
+    depth = 0;
+    for (Scope *sc = this; sc->parent != nullptr; sc = sc->parent, ++depth) {
+        for (slot = (int)sc->names.size() - 1; slot >= 0; --slot)
+            if (sc->names[slot] == x) break;
+        if (slot >= 0) {
+            b = &sc->bindings[slot];
+            break;
+        }
+        if (!sc->function) continue;
+        auto it = std::find(sc->captured.begin(), sc->captured.end(), x);
+        if (it != sc->captured.end()) {
+            slot = (int)(it - sc->captured.begin());
+            b = sc->captured_bindings[slot];
+            ++depth;
+            break;
+        }
+        crossed.push_back({sc, depth});
+        depth = -1;     // Depths beyond a lambda count from its parent contour
+    }
+    if (b == nullptr) return nullptr;
+    // Outermost first, each lambda captures the address found beyond it
+    while (!crossed.empty()) {
+        Scope *sc = crossed.back().first;
+        b->captured = true;
+        sc->captured.push_back(x);
+        sc->captured_bindings.push_back(b);
+        sc->captures.push_back({depth, slot});
+        slot = (int)sc->captured.size() - 1;
+        depth = crossed.back().second + 1;
+        crossed.pop_back();
+    }
+    return b;
+}
+
+/**
+ * @brief Ends the contour: every use of a binding that needs a box is told
+ * so, and the slots to box when the frame is made are returned
+ */
+vector<int> Scope::close() {
+    vector<int> boxed;
+    for (size_t i = 0; i < bindings.size(); ++i) {
+        if (!bindings[i].boxed()) continue;
+        for (bool *use : bindings[i].uses) *use = true;
+        boxed.push_back((int)i);
+    }
+    return boxed;
+}
+
+// True if x names a variable: bound in scope or already defined at top level
+static bool isVariable(SymbolId x, Scope &env) {
+    int depth, slot;
+    return env.resolve(x, depth, slot) != nullptr || !globalCell(x)->v.unbound();
+}
+
+/**
+ * @brief Collects the names introduced by internal defines of a body
+ *
+ * The runtime reserves one binding per internal define when a body is
+ * entered, so the environment has a fixed shape and every reference in the
+ * body can be addressed statically. Nested binding forms are not entered:
+ * their defines belong to their own bodies. Names are collected in the
+ * order the defines appear, walking an explicit stack of subforms.
+ */
+static void collectDefines(const Syntax &stx, vector<SymbolId> &names) {
+    vector<SyntaxBase *> work(1, stx.get());
+    while (!work.empty()) {
+        List *lst = dynamic_cast<List*>(work.back());
+        work.pop_back();
+        if (lst == nullptr || lst->stxs.empty()) continue;
+        size_t from = 0;
+        if (auto head = dynamic_cast<SymbolSyntax*>(lst->stxs[0].get())) {
+            int op = head->s->reserved;
+            if (op == E_QUOTE || op == E_LAMBDA || op == E_LET || op == E_LETREC) continue;
+            if (op == E_DEFINE && lst->stxs.size() >= 2) {
+                auto name = dynamic_cast<SymbolSyntax*>(lst->stxs[1].get());
+                auto sig = dynamic_cast<List*>(lst->stxs[1].get());
+                if (sig != nullptr && !sig->stxs.empty())
+                    name = dynamic_cast<SymbolSyntax*>(sig->stxs[0].get());
+                if (name != nullptr && std::find(names.begin(), names.end(), name->s) == names.end())
+                    names.push_back(name->s);
+                // (define (f ...) ...) opens its own contour
+                if (sig != nullptr) continue;
+                from = 2;
+            }
+        }
+        // Pushed last first, so they are visited in order
+        for (size_t i = lst->stxs.size(); i-- > from;) work.push_back(lst->stxs[i].get());
+    }
+}
+
+/**
+ * @brief Opens a body contour: binds the given names plus the body's
+ * internal defines (returned through locals) in a new scope
+ */
+static void openBody(Scope &body_scope, const vector<SymbolId> &bound,
+                     const vector<Syntax> &stxs, size_t from, vector<SymbolId> &locals) {
+    vector<SymbolId> defs;
+    for (size_t i = from; i < stxs.size(); ++i) collectDefines(stxs[i], defs);
+    for (auto &name : defs) {
+        if (std::find(bound.begin(), bound.end(), name) == bound.end())
+            locals.push_back(name);
+    }
+    vector<SymbolId> names = bound;
+    names.insert(names.end(), locals.begin(), locals.end());
+    body_scope.bind(names);
+}
+
+/**
+ * @brief Marks the applications in tail position of a lambda body
+ *
+ * Descends through the forms that return the value of one of their
+ * subexpressions unchanged: if, cond, begin, let, letrec, and, or.
+ */
+static void markTailCalls(const Expr &body) {
+    vector<ExprBase *> work(1, body.get());
+    while (!work.empty()) {
+        ExprBase *e = work.back();
+        work.pop_back();
+        switch (e->e_type) {
+            case E_APPLY:
+                static_cast<Apply*>(e)->tail = true;
+                break;
+            case E_IF:
+                work.push_back(static_cast<If*>(e)->conseq.get());
+                work.push_back(static_cast<If*>(e)->alter.get());
+                break;
+            case E_COND:
+                for (auto &clause : static_cast<Cond*>(e)->clauses)
+                    if (clause.size() > 1) work.push_back(clause.back().get());
+                break;
+            case E_BEGIN: {
+                auto &es = static_cast<Begin*>(e)->es;
+                if (!es.empty()) work.push_back(es.back().get());
+                break;
+            }
+            case E_LET:
+                work.push_back(static_cast<Let*>(e)->body.get());
+                break;
+            case E_LETREC:
+                work.push_back(static_cast<Letrec*>(e)->body.get());
+                break;
+            case E_AND: {
+                auto &rands = static_cast<AndVar*>(e)->rands;
+                if (!rands.empty()) work.push_back(rands.back().get());
+                break;
+            }
+            case E_OR: {
+                auto &rands = static_cast<OrVar*>(e)->rands;
+                if (!rands.empty()) work.push_back(rands.back().get());
+                break;
+            }
+            default:
+                break;
+        }
+    }
+}
+
+/**
+ * @brief The parsed forms of a body from parsed[from], wrapping several in a Begin
+ */
+static Expr makeBody(const vector<Expr> &parsed, size_t from) {
+    if (parsed.size() == from + 1) return parsed[from];
+    return Expr(new Begin(vector<Expr>(parsed.begin() + from, parsed.end())));
+}
 
 /**
  * @brief Default parse method (should be overridden by subclasses)
  */
-Expr Syntax::parse(Assoc &env) {
+Expr Syntax::parse(Scope &env) {
     throw RuntimeError("Unimplemented parse method");
 }
 
-Expr Number::parse(Assoc &env) {
+Expr Number::parse(Scope &env) {
     return Expr(new Fixnum(n));
 }
 
-Expr RationalSyntax::parse(Assoc &env) {
+Expr BignumSyntax::parse(Scope &env) {
+    return Expr(new BignumExpr(n));
+}
+
+Expr RationalSyntax::parse(Scope &env) {
     return Expr(new RationalNum(numerator, denominator));
 }
 
-Expr SymbolSyntax::parse(Assoc &env) {
+Expr SymbolSyntax::parse(Scope &env) {
+    int depth, slot;
+    if (Binding *b = env.resolve(s, depth, slot)) {
+        Var *var = new Var(s, depth, slot);
+        b->uses.push_back(&var->boxed);
+        return Expr(var);
+    }
     return Expr(new Var(s));
 }
 
-Expr StringSyntax::parse(Assoc &env) {
+Expr StringSyntax::parse(Scope &env) {
     return Expr(new StringExpr(s));
 }
 
-Expr TrueSyntax::parse(Assoc &env) {
+Expr TrueSyntax::parse(Scope &env) {
     return Expr(new True());
 }
 
-Expr FalseSyntax::parse(Assoc &env) {
+Expr FalseSyntax::parse(Scope &env) {
     return Expr(new False());
 }
 
-Expr List::parse(Assoc &env) {
+namespace {
+
+/// A subform of a list form, with the scope it is parsed in
+struct Subform {
+    SyntaxBase *stx;
+    Scope *env;
+};
+
+/**
+ * @brief A list form being parsed
+ *
+ * The constructor checks the form's shape, opens the scope of its body if
+ * it has one, and lists its subforms in the order they are parsed. Once
+ * List::parse has parsed all of them, build makes the node.
+ */
+struct Form {
+    enum Kind {
+        CALL,           ///< Operator parsed first, then the operands
+        CALL_NAMED,     ///< Operands parsed first, then the operator's name
+        PRIMITIVE,
+        QUOTE,
+        BEGIN,
+        IF,
+        COND,
+        LAMBDA,
+        DEFINE,         ///< (define var expr...)
+        DEFINE_PROC,    ///< (define (f params...) body...)
+        SET,
+        LET,
+        LETREC
+    };
+    Kind kind;
+    List *list;
+    Scope &env;
+    vector<Subform> subforms;
+    size_t next;                        ///< First subform not parsed yet
+    vector<Expr> parsed;                ///< Parallel to subforms[0, next)
+    SymbolId name;                      ///< Defined or assigned variable
+    vector<SymbolId> names;             ///< Parameters, or the names a let binds
+    vector<SymbolId> locals;            ///< Internal defines of the body
+    std::unique_ptr<Scope> body_scope;
+    size_t body;                        ///< Index in parsed of the first body form
+    vector<size_t> clauses;             ///< Sizes of the cond clauses
+    Form(List *, Scope &);
+    Expr build();
+private:
+    void parseFrom(size_t from, Scope &);
+    void openLambda();
+    Expr lambda();
+};
+
+void Form::parseFrom(size_t from, Scope &scope) {
+    for (size_t i = from; i < list->stxs.size(); ++i) subforms.push_back(Subform{list->stxs[i].get(), &scope});
+}
+
+void Form::openLambda() {
+    body_scope.reset(new Scope(&env, true));
+    openBody(*body_scope, names, list->stxs, 2, locals);
+    parseFrom(2, *body_scope);
+}
+
+Expr Form::lambda() {
+    Expr body_expr = makeBody(parsed, body);
+    markTailCalls(body_expr);
+    vector<int> boxed = body_scope->close();
+    return Expr(new Lambda(names, locals, body_expr, body_scope->captures, boxed));
+}
+
+Form::Form(List *list, Scope &env) : list(list), env(env), next(0), name(nullptr), body(0) {
+    const vector<Syntax> &stxs = list->stxs;
     if (stxs.empty()) {
         // Empty list literal -> '()
-        return Expr(new Quote(Syntax(new List())));
+        kind = QUOTE;
+        return;
     }
 
-    // If first element is not a symbol, treat as ((expr) args...) apply
+    // If first element is not a symbol, treat as ((expr) args...) apply;
+    // a user binding shadows primitives and reserved words alike
     SymbolSyntax *id = dynamic_cast<SymbolSyntax*>(stxs[0].get());
-    if (id == nullptr) {
-        // Parse operator and operands
-        Expr rator = stxs[0]->parse(env);
-        vector<Expr> params;
-        for (size_t i = 1; i < stxs.size(); ++i) params.push_back(stxs[i]->parse(env));
-        return Expr(new Apply(rator, params));
+    if (id == nullptr || isVariable(id->s, env)) {
+        kind = CALL;
+        parseFrom(0, env);
+        return;
     }
 
-    string op = id->s;
+    SymbolId op = id->s;
 
     // Handle primitives (built-in procedures)
-    if (primitives.count(op) != 0) {
-        vector<Expr> parameters;
-        for (size_t i = 1; i < stxs.size(); ++i) parameters.push_back(stxs[i]->parse(env));
-
-        ExprType op_type = primitives[op];
-        switch (op_type) {
-            case E_PLUS:
-                if (parameters.size() == 2) return Expr(new Plus(parameters[0], parameters[1]));
-                return Expr(new PlusVar(parameters));
-            case E_MINUS:
-                if (parameters.size() == 1) return Expr(new Minus(parameters[0], Expr(new Fixnum(0)))); // Will be handled in eval var-arg too
-                if (parameters.size() == 2) return Expr(new Minus(parameters[0], parameters[1]));
-                return Expr(new MinusVar(parameters));
-            case E_MUL:
-                if (parameters.size() == 2) return Expr(new Mult(parameters[0], parameters[1]));
-                return Expr(new MultVar(parameters));
-            case E_DIV:
-                if (parameters.size() == 2) return Expr(new Div(parameters[0], parameters[1]));
-                return Expr(new DivVar(parameters));
-            case E_MODULO:
-                if (parameters.size() != 2) throw RuntimeError("Wrong number of arguments for modulo");
-                return Expr(new Modulo(parameters[0], parameters[1]));
-            case E_EXPT:
-                if (parameters.size() != 2) throw RuntimeError("Wrong number of arguments for expt");
-                return Expr(new Expt(parameters[0], parameters[1]));
-            case E_CONS:
-                if (parameters.size() != 2) throw RuntimeError("Wrong number of arguments for cons");
-                return Expr(new Cons(parameters[0], parameters[1]));
-            case E_CAR:
-                if (parameters.size() != 1) throw RuntimeError("Wrong number of arguments for car");
-                return Expr(new Car(parameters[0]));
-            case E_CDR:
-                if (parameters.size() != 1) throw RuntimeError("Wrong number of arguments for cdr");
-                return Expr(new Cdr(parameters[0]));
-            case E_LIST:
-                return Expr(new ListFunc(parameters));
-            case E_SETCAR:
-                if (parameters.size() != 2) throw RuntimeError("Wrong number of arguments for set-car!");
-                return Expr(new SetCar(parameters[0], parameters[1]));
-            case E_SETCDR:
-                if (parameters.size() != 2) throw RuntimeError("Wrong number of arguments for set-cdr!");
-                return Expr(new SetCdr(parameters[0], parameters[1]));
-            case E_LT:
-                if (parameters.size() == 2) return Expr(new Less(parameters[0], parameters[1]));
-                return Expr(new LessVar(parameters));
-            case E_LE:
-                if (parameters.size() == 2) return Expr(new LessEq(parameters[0], parameters[1]));
-                return Expr(new LessEqVar(parameters));
-            case E_EQ:
-                if (parameters.size() == 2) return Expr(new Equal(parameters[0], parameters[1]));
-                return Expr(new EqualVar(parameters));
-            case E_EQQ:
-                if (parameters.size() != 2) throw RuntimeError("Wrong number of arguments for eq?");
-                return Expr(new IsEq(parameters[0], parameters[1]));
-            case E_GE:
-                if (parameters.size() == 2) return Expr(new GreaterEq(parameters[0], parameters[1]));
-                return Expr(new GreaterEqVar(parameters));
-            case E_GT:
-                if (parameters.size() == 2) return Expr(new Greater(parameters[0], parameters[1]));
-                return Expr(new GreaterVar(parameters));
-            case E_NOT:
-                if (parameters.size() != 1) throw RuntimeError("Wrong number of arguments for not");
-                return Expr(new Not(parameters[0]));
-            case E_AND:
-                return Expr(new AndVar(parameters));
-            case E_OR:
-                return Expr(new OrVar(parameters));
-            case E_BOOLQ:
-                if (parameters.size() != 1) throw RuntimeError("Wrong number of arguments for boolean?");
-                return Expr(new IsBoolean(parameters[0]));
-            case E_INTQ:
-                if (parameters.size() != 1) throw RuntimeError("Wrong number of arguments for number?");
-                return Expr(new IsFixnum(parameters[0]));
-            case E_NULLQ:
-                if (parameters.size() != 1) throw RuntimeError("Wrong number of arguments for null?");
-                return Expr(new IsNull(parameters[0]));
-            case E_PAIRQ:
-                if (parameters.size() != 1) throw RuntimeError("Wrong number of arguments for pair?");
-                return Expr(new IsPair(parameters[0]));
-            case E_PROCQ:
-                if (parameters.size() != 1) throw RuntimeError("Wrong number of arguments for procedure?");
-                return Expr(new IsProcedure(parameters[0]));
-            case E_SYMBOLQ:
-                if (parameters.size() != 1) throw RuntimeError("Wrong number of arguments for symbol?");
-                return Expr(new IsSymbol(parameters[0]));
-            case E_LISTQ:
-                if (parameters.size() != 1) throw RuntimeError("Wrong number of arguments for list?");
-                return Expr(new IsList(parameters[0]));
-            case E_STRINGQ:
-                if (parameters.size() != 1) throw RuntimeError("Wrong number of arguments for string?");
-                return Expr(new IsString(parameters[0]));
-            case E_DISPLAY:
-                if (parameters.size() != 1) throw RuntimeError("Wrong number of arguments for display");
-                return Expr(new Display(parameters[0]));
-            case E_VOID:
-                if (!parameters.empty()) throw RuntimeError("Wrong number of arguments for void");
-                return Expr(new MakeVoid());
-            case E_EXIT:
-                if (!parameters.empty()) throw RuntimeError("Wrong number of arguments for exit");
-                return Expr(new Exit());
-            default:
-                break;
-        }
+    if (op->primitive >= 0) {
+        kind = PRIMITIVE;
+        parseFrom(1, env);
+        return;
+    }
+
+    // default: treat as application to a variable/operator
+    if (op->reserved < 0) {
+        kind = CALL_NAMED;
+        parseFrom(1, env);
+        subforms.push_back(Subform{stxs[0].get(), &env});
+        return;
     }
 
     // Handle reserved words (special forms)
-    if (reserved_words.count(op) != 0) {
-        switch (reserved_words[op]) {
-            case E_QUOTE: {
-                if (stxs.size() != 2) throw RuntimeError("quote expects a single argument");
-                return Expr(new Quote(stxs[1]));
-            }
-            case E_BEGIN: {
-                vector<Expr> seq;
-                for (size_t i = 1; i < stxs.size(); ++i) seq.push_back(stxs[i]->parse(env));
-                return Expr(new Begin(seq));
+    switch (op->reserved) {
+        case E_QUOTE:
+            if (stxs.size() != 2) throw RuntimeError("quote expects a single argument");
+            kind = QUOTE;
+            break;
+        case E_BEGIN:
+            kind = BEGIN;
+            parseFrom(1, env);
+            break;
+        case E_IF:
+            if (stxs.size() != 4) throw RuntimeError("if expects three arguments");
+            kind = IF;
+            parseFrom(1, env);
+            break;
+        case E_COND:
+            // Each clause is a list: (pred expr...)
+            kind = COND;
+            for (size_t i = 1; i < stxs.size(); ++i) {
+                List* clauseList = dynamic_cast<List*>(stxs[i].get());
+                if (!clauseList) throw RuntimeError("cond clause must be a list");
+                if (clauseList->stxs.empty()) throw RuntimeError("empty cond clause");
+                for (auto &sx : clauseList->stxs) subforms.push_back(Subform{sx.get(), &env});
+                clauses.push_back(clauseList->stxs.size());
             }
-            case E_IF: {
-                if (stxs.size() != 4) throw RuntimeError("if expects three arguments");
-                Expr c = stxs[1]->parse(env);
-                Expr t = stxs[2]->parse(env);
-                Expr e = stxs[3]->parse(env);
-                return Expr(new If(c, t, e));
+            break;
+        case E_LAMBDA: {
+            if (stxs.size() < 3) throw RuntimeError("lambda expects parameters and body");
+            // parameters must be a list of symbols
+            List* params = dynamic_cast<List*>(stxs[1].get());
+            if (!params) throw RuntimeError("lambda parameters must be a list");
+            for (auto &sx : params->stxs) {
+                auto sym = dynamic_cast<SymbolSyntax*>(sx.get());
+                if (!sym) throw RuntimeError("lambda parameter must be a symbol");
+                names.push_back(sym->s);
             }
-            case E_COND: {
-                // Each clause is a list: (pred expr...)
-                vector<vector<Expr>> clauses;
-                for (size_t i = 1; i < stxs.size(); ++i) {
-                    List* clauseList = dynamic_cast<List*>(stxs[i].get());
-                    if (!clauseList) throw RuntimeError("cond clause must be a list");
-                    vector<Expr> one;
-                    for (auto &sx : clauseList->stxs) one.push_back(sx->parse(env));
-                    if (one.empty()) throw RuntimeError("empty cond clause");
-                    clauses.push_back(one);
+            kind = LAMBDA;
+            openLambda();
+            break;
+        }
+        case E_DEFINE: {
+            if (stxs.size() < 3) throw RuntimeError("define expects at least 2 arguments");
+            // (define var expr) or (define (fname args...) body...)
+            if (auto sym = dynamic_cast<SymbolSyntax*>(stxs[1].get())) {
+                kind = DEFINE;
+                name = sym->s;
+                parseFrom(2, env);
+            } else if (auto lst = dynamic_cast<List*>(stxs[1].get())) {
+                if (lst->stxs.empty()) throw RuntimeError("invalid define");
+                auto fname = dynamic_cast<SymbolSyntax*>(lst->stxs[0].get());
+                if (!fname) throw RuntimeError("invalid function name in define");
+                name = fname->s;
+                for (size_t i = 1; i < lst->stxs.size(); ++i) {
+                    auto p = dynamic_cast<SymbolSyntax*>(lst->stxs[i].get());
+                    if (!p) throw RuntimeError("lambda parameter must be a symbol");
+                    names.push_back(p->s);
                 }
-                return Expr(new Cond(clauses));
+                kind = DEFINE_PROC;
+                openLambda();
+            } else {
+                throw RuntimeError("invalid define form");
             }
-            case E_LAMBDA: {
-                if (stxs.size() < 3) throw RuntimeError("lambda expects parameters and body");
-                // parameters must be a list of symbols
-                List* params = dynamic_cast<List*>(stxs[1].get());
-                if (!params) throw RuntimeError("lambda parameters must be a list");
-                vector<string> xs;
-                for (auto &sx : params->stxs) {
-                    auto sym = dynamic_cast<SymbolSyntax*>(sx.get());
-                    if (!sym) throw RuntimeError("lambda parameter must be a symbol");
-                    xs.push_back(sym->s);
-                }
-                // Body: if multiple expressions, wrap in begin
-                Expr body_expr = (stxs.size() == 3) ? stxs[2]->parse(env) : Expr(new Begin([&]{
-                    vector<Expr> seq; for (size_t i = 2; i < stxs.size(); ++i) seq.push_back(stxs[i]->parse(env)); return seq; }()));
-                return Expr(new Lambda(xs, body_expr));
+            break;
+        }
+        case E_SET: {
+            if (stxs.size() != 3) throw RuntimeError("invalid set! form");
+            auto sym = dynamic_cast<SymbolSyntax*>(stxs[1].get());
+            if (!sym) throw RuntimeError("set! expects a variable");
+            kind = SET;
+            name = sym->s;
+            parseFrom(2, env);
+            break;
+        }
+        case E_LET:
+        case E_LETREC: {
+            // let ((p1 v1) (p2 v2) ...) body...
+            if (stxs.size() < 3) throw RuntimeError("binding form expects bindings and body");
+            List* bindsList = dynamic_cast<List*>(stxs[1].get());
+            if (!bindsList) throw RuntimeError("bindings must be a list");
+            vector<SyntaxBase *> inits;
+            for (auto &b : bindsList->stxs) {
+                List* pairList = dynamic_cast<List*>(b.get());
+                if (!pairList || pairList->stxs.size() != 2)
+                    throw RuntimeError("each binding must be a pair");
+                auto nameSym = dynamic_cast<SymbolSyntax*>(pairList->stxs[0].get());
+                if (!nameSym) throw RuntimeError("binding name must be a symbol");
+                names.push_back(nameSym->s);
+                inits.push_back(pairList->stxs[1].get());
             }
-            case E_DEFINE: {
-                if (stxs.size() < 3) throw RuntimeError("define expects at least 2 arguments");
-                // (define var expr) or (define (fname args...) body...)
-                if (auto sym = dynamic_cast<SymbolSyntax*>(stxs[1].get())) {
-                    Expr val = (stxs.size() == 3) ? stxs[2]->parse(env)
-                                                 : Expr(new Begin([&]{ vector<Expr> seq; for (size_t i = 2; i < stxs.size(); ++i) seq.push_back(stxs[i]->parse(env)); return seq; }()));
-                    return Expr(new Define(sym->s, val));
-                } else if (auto lst = dynamic_cast<List*>(stxs[1].get())) {
-                    if (lst->stxs.empty()) throw RuntimeError("invalid define");
-                    auto fname = dynamic_cast<SymbolSyntax*>(lst->stxs[0].get());
-                    if (!fname) throw RuntimeError("invalid function name in define");
-                    vector<string> xs;
-                    for (size_t i = 1; i < lst->stxs.size(); ++i) {
-                        auto p = dynamic_cast<SymbolSyntax*>(lst->stxs[i].get());
-                        if (!p) throw RuntimeError("lambda parameter must be a symbol");
-                        xs.push_back(p->s);
-                    }
-                    // Body
-                    Expr body_expr = (stxs.size() == 3) ? stxs[2]->parse(env)
-                                                       : Expr(new Begin([&]{ vector<Expr> seq; for (size_t i = 2; i < stxs.size(); ++i) seq.push_back(stxs[i]->parse(env)); return seq; }()));
-                    return Expr(new Define(fname->s, Expr(new Lambda(xs, body_expr))));
-                } else {
-                    throw RuntimeError("invalid define form");
-                }
+            kind = op->reserved == E_LET ? LET : LETREC;
+            body_scope.reset(new Scope(&env));
+            openBody(*body_scope, names, stxs, 2, locals);
+            // let evaluates its inits outside the new contour, letrec inside it
+            // (and fills each binding after the frame is made)
+            Scope &init_scope = kind == LET ? env : *body_scope;
+            if (kind == LETREC)
+                for (size_t i = 0; i < names.size(); ++i) body_scope->bindings[i].assigned = true;
+            for (SyntaxBase *init : inits) subforms.push_back(Subform{init, &init_scope});
+            body = subforms.size();
+            parseFrom(2, *body_scope);
+            break;
+        }
+        default:
+            throw RuntimeError("Unknown reserved word: " + op->name);
+    }
+}
+
+/// The node of a primitive applied to parsed operands
+Expr primitiveForm(ExprType op_type, const vector<Expr> &parameters) {
+    switch (op_type) {
+        case E_PLUS:
+            if (parameters.size() == 2) return Expr(new Plus(parameters[0], parameters[1]));
+            return Expr(new PlusVar(parameters));
+        case E_MINUS:
+            if (parameters.size() == 1) return Expr(new Minus(parameters[0], Expr(new Fixnum(0)))); // Will be handled in eval var-arg too
+            if (parameters.size() == 2) return Expr(new Minus(parameters[0], parameters[1]));
+            return Expr(new MinusVar(parameters));
+        case E_MUL:
+            if (parameters.size() == 2) return Expr(new Mult(parameters[0], parameters[1]));
+            return Expr(new MultVar(parameters));
+        case E_DIV:
+            if (parameters.size() == 2) return Expr(new Div(parameters[0], parameters[1]));
+            return Expr(new DivVar(parameters));
+        case E_MODULO:
+            if (parameters.size() != 2) throw RuntimeError("Wrong number of arguments for modulo");
+            return Expr(new Modulo(parameters[0], parameters[1]));
+        case E_EXPT:
+            if (parameters.size() != 2) throw RuntimeError("Wrong number of arguments for expt");
+            return Expr(new Expt(parameters[0], parameters[1]));
+        case E_CONS:
+            if (parameters.size() != 2) throw RuntimeError("Wrong number of arguments for cons");
+            return Expr(new Cons(parameters[0], parameters[1]));
+        case E_CAR:
+            if (parameters.size() != 1) throw RuntimeError("Wrong number of arguments for car");
+            return Expr(new Car(parameters[0]));
+        case E_CDR:
+            if (parameters.size() != 1) throw RuntimeError("Wrong number of arguments for cdr");
+            return Expr(new Cdr(parameters[0]));
+        case E_LIST:
+            return Expr(new ListFunc(parameters));
+        case E_SETCAR:
+            if (parameters.size() != 2) throw RuntimeError("Wrong number of arguments for set-car!");
+            return Expr(new SetCar(parameters[0], parameters[1]));
+        case E_SETCDR:
+            if (parameters.size() != 2) throw RuntimeError("Wrong number of arguments for set-cdr!");
+            return Expr(new SetCdr(parameters[0], parameters[1]));
+        case E_LT:
+            if (parameters.size() == 2) return Expr(new Less(parameters[0], parameters[1]));
+            return Expr(new LessVar(parameters));
+        case E_LE:
+            if (parameters.size() == 2) return Expr(new LessEq(parameters[0], parameters[1]));
+            return Expr(new LessEqVar(parameters));
+        case E_EQ:
+            if (parameters.size() == 2) return Expr(new Equal(parameters[0], parameters[1]));
+            return Expr(new EqualVar(parameters));
+        case E_EQQ:
+            if (parameters.size() != 2) throw RuntimeError("Wrong number of arguments for eq?");
+            return Expr(new IsEq(parameters[0], parameters[1]));
+        case E_GE:
+            if (parameters.size() == 2) return Expr(new GreaterEq(parameters[0], parameters[1]));
+            return Expr(new GreaterEqVar(parameters));
+        case E_GT:
+            if (parameters.size() == 2) return Expr(new Greater(parameters[0], parameters[1]));
+            return Expr(new GreaterVar(parameters));
+        case E_NOT:
+            if (parameters.size() != 1) throw RuntimeError("Wrong number of arguments for not");
+            return Expr(new Not(parameters[0]));
+        case E_AND:
+            return Expr(new AndVar(parameters));
+        case E_OR:
+            return Expr(new OrVar(parameters));
+        case E_BOOLQ:
+            if (parameters.size() != 1) throw RuntimeError("Wrong number of arguments for boolean?");
+            return Expr(new IsBoolean(parameters[0]));
+        case E_INTQ:
+            if (parameters.size() != 1) throw RuntimeError("Wrong number of arguments for number?");
+            return Expr(new IsFixnum(parameters[0]));
+        case E_NULLQ:
+            if (parameters.size() != 1) throw RuntimeError("Wrong number of arguments for null?");
+            return Expr(new IsNull(parameters[0]));
+        case E_PAIRQ:
+            if (parameters.size() != 1) throw RuntimeError("Wrong number of arguments for pair?");
+            return Expr(new IsPair(parameters[0]));
+        case E_PROCQ:
+            if (parameters.size() != 1) throw RuntimeError("Wrong number of arguments for procedure?");
+            return Expr(new IsProcedure(parameters[0]));
+        case E_SYMBOLQ:
+            if (parameters.size() != 1) throw RuntimeError("Wrong number of arguments for symbol?");
+            return Expr(new IsSymbol(parameters[0]));
+        case E_LISTQ:
+            if (parameters.size() != 1) throw RuntimeError("Wrong number of arguments for list?");
+            return Expr(new IsList(parameters[0]));
+        case E_STRINGQ:
+            if (parameters.size() != 1) throw RuntimeError("Wrong number of arguments for string?");
+            return Expr(new IsString(parameters[0]));
+        case E_DISPLAY:
+            if (parameters.size() != 1) throw RuntimeError("Wrong number of arguments for display");
+            return Expr(new Display(parameters[0]));
+        case E_VOID:
+            if (!parameters.empty()) throw RuntimeError("Wrong number of arguments for void");
+            return Expr(new MakeVoid());
+        case E_EXIT:
+            if (!parameters.empty()) throw RuntimeError("Wrong number of arguments for exit");
+            return Expr(new Exit());
+        case E_GC:
+            if (!parameters.empty()) throw RuntimeError("Wrong number of arguments for gc");
+            return Expr(new Collect());
+        case E_READ:
+            if (!parameters.empty()) throw RuntimeError("Wrong number of arguments for read");
+            return Expr(new Read());
+        case E_CALLCC:
+            if (parameters.size() != 1) throw RuntimeError("Wrong number of arguments for call/cc");
+            return Expr(new CallCC(parameters[0]));
+        default:
+            return Expr(nullptr);
+    }
+}
+
+} // namespace
+
+Expr Form::build() {
+    const vector<Syntax> &stxs = list->stxs;
+    switch (kind) {
+        case CALL:
+            return Expr(new Apply(parsed[0], vector<Expr>(parsed.begin() + 1, parsed.end())));
+        case CALL_NAMED: {
+            Expr rator = parsed.back();
+            parsed.pop_back();
+            return Expr(new Apply(rator, parsed));
+        }
+        case PRIMITIVE: {
+            SymbolId op = static_cast<SymbolSyntax*>(stxs[0].get())->s;
+            Expr e = primitiveForm((ExprType)op->primitive, parsed);
+            if (e.get() != nullptr) return e;
+            return Expr(new Apply(stxs[0]->parse(env), parsed));
+        }
+        case QUOTE:
+            if (stxs.empty()) return Expr(new Quote(Syntax(new List())));
+            return Expr(new Quote(stxs[1]));
+        case BEGIN:
+            return Expr(new Begin(parsed));
+        case IF:
+            return Expr(new If(parsed[0], parsed[1], parsed[2]));
+        case COND: {
+            vector<vector<Expr>> cls;
+            size_t at = 0;
+            for (size_t n : clauses) {
+                cls.push_back(vector<Expr>(parsed.begin() + at, parsed.begin() + at + n));
+                at += n;
             }
-            case E_LET:
-            case E_LETREC:
-            case E_SET:
-                // Parse but leave evaluation to evaluator (extensions)
-                // let ((p1 v1) (p2 v2) ...) body...
-                if (stxs.size() < 3) throw RuntimeError("binding form expects bindings and body");
-                {
-                    List* bindsList = dynamic_cast<List*>(stxs[1].get());
-                    if (!bindsList) throw RuntimeError("bindings must be a list");
-                    vector<pair<string, Expr>> binds;
-                    for (auto &b : bindsList->stxs) {
-                        List* pairList = dynamic_cast<List*>(b.get());
-                        if (!pairList || pairList->stxs.size() != 2)
-                            throw RuntimeError("each binding must be a pair");
-                        auto nameSym = dynamic_cast<SymbolSyntax*>(pairList->stxs[0].get());
-                        if (!nameSym) throw RuntimeError("binding name must be a symbol");
-                        binds.push_back({nameSym->s, pairList->stxs[1]->parse(env)});
-                    }
-                    // Body
-                    Expr body = (stxs.size() == 3) ? stxs[2]->parse(env)
-                                                  : Expr(new Begin([&]{ vector<Expr> seq; for (size_t i = 2; i < stxs.size(); ++i) seq.push_back(stxs[i]->parse(env)); return seq; }()));
-                    if (reserved_words[op] == E_LET)
-                        return Expr(new Let(binds, body));
-                    else if (reserved_words[op] == E_LETREC)
-                        return Expr(new Letrec(binds, body));
-                    else {
-                        // set!
-                        if (binds.size() != 1) throw RuntimeError("invalid set! form");
-                        return Expr(new Set(binds[0].first, binds[0].second));
-                    }
-                }
-            default:
-                throw RuntimeError("Unknown reserved word: " + op);
+            return Expr(new Cond(cls));
+        }
+        case LAMBDA:
+            return lambda();
+        case DEFINE:
+        case DEFINE_PROC: {
+            Expr val = kind == DEFINE ? makeBody(parsed, 0) : lambda();
+            if (env.isTopLevel()) return Expr(new Define(name, val));
+            // Internal define: the enclosing body reserved a binding for it
+            int depth, slot;
+            Binding *b = env.resolve(name, depth, slot);
+            if (b == nullptr) throw RuntimeError("define not allowed here");
+            b->assigned = true;
+            Define *def = new Define(name, depth, slot, val);
+            b->uses.push_back(&def->boxed);
+            return Expr(def);
+        }
+        case SET: {
+            int depth, slot;
+            if (Binding *b = env.resolve(name, depth, slot)) {
+                b->assigned = true;
+                Set *set = new Set(name, depth, slot, parsed[0]);
+                b->uses.push_back(&set->boxed);
+                return Expr(set);
+            }
+            return Expr(new Set(name, parsed[0]));
+        }
+        case LET:
+        case LETREC: {
+            vector<pair<SymbolId, Expr>> binds;
+            for (size_t i = 0; i < names.size(); ++i) binds.push_back({names[i], parsed[i]});
+            Expr body_expr = makeBody(parsed, body);
+            vector<int> boxed = body_scope->close();
+            if (kind == LET)
+                return Expr(new Let(binds, locals, body_expr, boxed));
+            return Expr(new Letrec(binds, locals, body_expr, boxed));
         }
     }
+    throw RuntimeError("unknown form");
+}
 
-    // default: treat as application to a variable/operator
-    vector<Expr> params;
-    for (size_t i = 1; i < stxs.size(); ++i) params.push_back(stxs[i]->parse(env));
-    return Expr(new Apply(Expr(new Var(op)), params));
+// A datum parsed as code, where quote is rebound: as the syntax it was read from
+Expr DatumSyntax::parse(Scope &env) {
+    return syntax()->parse(env);
+}
+
+/**
+ * @brief Parses a list form and every list nested in it
+ *
+ * The forms being parsed are kept on a stack of their own rather than on
+ * the C++ stack, so how deep a program nests is limited by memory only.
+ */
+Expr List::parse(Scope &env) {
+    vector<std::unique_ptr<Form>> forms;
+    forms.push_back(std::unique_ptr<Form>(new Form(this, env)));
+    for (;;) {
+        Form &f = *forms.back();
+        if (f.next < f.subforms.size()) {
+            const Subform &sub = f.subforms[f.next++];
+            if (List *lst = dynamic_cast<List*>(sub.stx))
+                forms.push_back(std::unique_ptr<Form>(new Form(lst, *sub.env)));
+            else
+                f.parsed.push_back(sub.stx->parse(*sub.env));
+            continue;
+        }
+        Expr e = f.build();
+        forms.pop_back();
+        if (forms.empty()) return e;
+        forms.back()->parsed.push_back(e);
+    }
 }
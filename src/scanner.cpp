@@ -0,0 +1,167 @@
+/**
+ * @file scanner.cpp
+ * @brief Scan kernels and their dispatch
+ *
+ * Every kernel computes the same masks. The SIMD ones compare 16 or 32
+ * bytes at once against each class and gather the comparison results with
+ * movemask; the scalar one looks each byte up in a table.
+ */
+
+#include "scanner.hpp"
+#include <cstring>
+
+// SSE2 is part of x86-64, AVX2 is checked for at run time
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+namespace {
+
+enum ByteClass {
+    C_SPACE = 1,
+    C_PUNCT = 2,
+    C_TEXT = 4
+};
+
+struct ClassTable {
+    unsigned char of[256];
+    ClassTable() {
+        memset(of, 0, sizeof of);
+        for (const char *c = " \t\n\v\f\r"; *c; ++c) of[(unsigned char)*c] = C_SPACE;
+        for (const char *c = "()[];"; *c; ++c) of[(unsigned char)*c] = C_PUNCT;
+        of['"'] = of['\\'] = C_TEXT;
+    }
+};
+
+void scanScalar(const char *p, size_t blocks, ScanMasks *out) {
+    static const ClassTable table;
+    for (size_t b = 0; b < blocks; ++b, p += SCAN_BLOCK) {
+        ScanMasks m = {0, 0, 0};
+        for (size_t i = 0; i < SCAN_BLOCK; ++i) {
+            unsigned c = table.of[(unsigned char)p[i]];
+            m.space |= (uint64_t)(c & C_SPACE) << i;
+            m.punct |= (uint64_t)((c & C_PUNCT) >> 1) << i;
+            m.text |= (uint64_t)((c & C_TEXT) >> 2) << i;
+        }
+        out[b] = m;
+    }
+}
+
+#ifdef SCAN_X86
+
+// Classifies 16 bytes; the masks come back in the low bits of the ints
+inline void classify16(__m128i c, int &space, int &punct, int &text) {
+    // Whitespace is ' ' or '\t' through '\r' (9 to 13)
+    __m128i ctl = _mm_sub_epi8(c, _mm_set1_epi8(9));
+    __m128i sp = _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8(' ')),
+                              _mm_cmpeq_epi8(_mm_min_epu8(ctl, _mm_set1_epi8(4)), ctl));
+    // '(' and ')' differ in the low bit only
+    __m128i pu = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(_mm_or_si128(c, _mm_set1_epi8(1)), _mm_set1_epi8(')')),
+                     _mm_cmpeq_epi8(c, _mm_set1_epi8(';'))),
+        _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('[')), _mm_cmpeq_epi8(c, _mm_set1_epi8(']'))));
+    __m128i tx = _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('"')), _mm_cmpeq_epi8(c, _mm_set1_epi8('\\')));
+    space = _mm_movemask_epi8(sp);
+    punct = _mm_movemask_epi8(pu);
+    text = _mm_movemask_epi8(tx);
+}
+
+void scanSSE2(const char *p, size_t blocks, ScanMasks *out) {
+    for (size_t b = 0; b < blocks; ++b, p += SCAN_BLOCK) {
+        ScanMasks m = {0, 0, 0};
+        for (int i = 0; i < 4; ++i) {
+            int sp, pu, tx;
+            classify16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16 * i)), sp, pu, tx);
+            m.space |= (uint64_t)(unsigned)sp << (16 * i);
+            m.punct |= (uint64_t)(unsigned)pu << (16 * i);
+            m.text |= (uint64_t)(unsigned)tx << (16 * i);
+        }
+        out[b] = m;
+    }
+}
+
+__attribute__((target("avx2")))
+void scanAVX2(const char *p, size_t blocks, ScanMasks *out) {
+    const __m256i nine = _mm256_set1_epi8(9), four = _mm256_set1_epi8(4), one = _mm256_set1_epi8(1);
+    const __m256i blank = _mm256_set1_epi8(' '), close = _mm256_set1_epi8(')'), semi = _mm256_set1_epi8(';');
+    const __m256i open_b = _mm256_set1_epi8('['), close_b = _mm256_set1_epi8(']');
+    const __m256i dquote = _mm256_set1_epi8('"'), backslash = _mm256_set1_epi8('\\');
+    for (size_t b = 0; b < blocks; ++b, p += SCAN_BLOCK) {
+        ScanMasks m = {0, 0, 0};
+        for (int i = 0; i < 2; ++i) {
+            __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + 32 * i));
+            __m256i ctl = _mm256_sub_epi8(c, nine);
+            __m256i sp = _mm256_or_si256(_mm256_cmpeq_epi8(c, blank),
+                                         _mm256_cmpeq_epi8(_mm256_min_epu8(ctl, four), ctl));
+            __m256i pu = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_or_si256(c, one), close), _mm256_cmpeq_epi8(c, semi)),
+                _mm256_or_si256(_mm256_cmpeq_epi8(c, open_b), _mm256_cmpeq_epi8(c, close_b)));
+            __m256i tx = _mm256_or_si256(_mm256_cmpeq_epi8(c, dquote), _mm256_cmpeq_epi8(c, backslash));
+            m.space |= (uint64_t)(unsigned)_mm256_movemask_epi8(sp) << (32 * i);
+            m.punct |= (uint64_t)(unsigned)_mm256_movemask_epi8(pu) << (32 * i);
+            m.text |= (uint64_t)(unsigned)_mm256_movemask_epi8(tx) << (32 * i);
+        }
+        out[b] = m;
+    }
+}
+
+#endif
+
+} // namespace
+
+ScanKernel scanKernel(ScanLevel level) {
+    switch (level) {
+        case SCAN_SCALAR:
+            return scanScalar;
+#ifdef SCAN_X86
+        case SCAN_SSE2:
+            return scanSSE2;
+        case SCAN_AVX2:
+            return __builtin_cpu_supports("avx2") ? scanAVX2 : nullptr;
+#endif
+        default:
+            return nullptr;
+    }
+}
+
+ScanLevel bestScanLevel() {
+    static const ScanLevel best = scanKernel(SCAN_AVX2) ? SCAN_AVX2
+                                : scanKernel(SCAN_SSE2) ? SCAN_SSE2
+                                : SCAN_SCALAR;
+    return best;
+}
+
+const char *scanLevelName(ScanLevel level) {
+    switch (level) {
+        case SCAN_SCALAR: return "scalar";
+        case SCAN_SSE2: return "sse2";
+        case SCAN_AVX2: return "avx2";
+    }
+    return "?";
+}
+
+ScanIndex::ScanIndex(const char *begin, const char *end, ScanLevel level)
+    : begin(begin), end(end), kernel(scanKernel(level)), first(0) {
+    if (kernel == nullptr) kernel = scanScalar;
+}
+
+// Classifies the window starting at block i. The last block is classified
+// from a copy padded with blanks, so no kernel reads past the end and the
+// padding ends any token that runs into it.
+void ScanIndex::refill(size_t i) {
+    size_t size = end - begin;
+    size_t full = size / SCAN_BLOCK;
+    size_t blocks = (size + SCAN_BLOCK - 1) / SCAN_BLOCK;
+    size_t n = blocks - i < SCAN_WINDOW ? blocks - i : SCAN_WINDOW;
+    window.resize(n);
+    first = i;
+    size_t direct = i + n <= full ? n : full - i;
+    kernel(begin + i * SCAN_BLOCK, direct, window.data());
+    if (direct < n) {
+        char last[SCAN_BLOCK];
+        memset(last, ' ', sizeof last);
+        memcpy(last, begin + full * SCAN_BLOCK, size - full * SCAN_BLOCK);
+        kernel(last, 1, &window[direct]);
+    }
+}
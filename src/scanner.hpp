@@ -0,0 +1,105 @@
+#ifndef SCANNER_HPP
+#define SCANNER_HPP
+
+/**
+ * @file scanner.hpp
+ * @brief Vectorized classification of source text for the reader
+ *
+ * Ahead of the reader, the scanner sorts the input 64 bytes at a time into
+ * bit masks: whitespace, the punctuation that ends a token, and the two
+ * characters that end a run of string text. The reader then moves by
+ * finding the next set bit rather than by testing characters one by one:
+ * a whitespace run, the rest of a token or the plain text of a string
+ * literal is crossed in one step.
+ *
+ * Whether a '"' or ';' opens a string or a comment depends on where it
+ * stands (a"b is one symbol), so that is left to the reader, which knows.
+ *
+ * The masks are computed by the widest kernel the CPU supports, chosen at
+ * run time, and only for a window of the input at a time, so they stay in
+ * cache while the reader uses them.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+const size_t SCAN_BLOCK = 64;       ///< Bytes per mask word
+const size_t SCAN_WINDOW = 1024;    ///< Blocks classified at a time
+
+/// Classes of the bytes of one block, bit i for byte i
+struct ScanMasks {
+    uint64_t space;     ///< isspace in the C locale
+    uint64_t punct;     ///< ( ) [ ] ;
+    uint64_t text;      ///< " and backslash
+};
+
+/// Classifies blocks * SCAN_BLOCK bytes from p
+typedef void (*ScanKernel)(const char *p, size_t blocks, ScanMasks *out);
+
+enum ScanLevel {
+    SCAN_SCALAR,
+    SCAN_SSE2,
+    SCAN_AVX2
+};
+
+/// The kernel for a level, or nullptr if this build or CPU lacks it
+ScanKernel scanKernel(ScanLevel);
+ScanLevel bestScanLevel();
+const char *scanLevelName(ScanLevel);
+
+/**
+ * @brief Bit masks of [begin, end), computed a window at a time as asked for
+ *
+ * Searches return end when nothing matches. Any position may be asked
+ * about, but moving forward through the input is what keeps the window
+ * from being recomputed.
+ */
+struct ScanIndex {
+    ScanIndex(const char *begin, const char *end, ScanLevel = bestScanLevel());
+    const char *skipSpace(const char *p);       ///< First byte from p that is not whitespace
+    const char *findDelimiter(const char *p);   ///< First whitespace, parenthesis, bracket or ';'
+    const char *findText(const char *p);        ///< First '"' or backslash
+private:
+    const char *begin;
+    const char *end;
+    ScanKernel kernel;
+    size_t first;                   ///< Block number of window[0]
+    std::vector<ScanMasks> window;
+    void refill(size_t);
+    const ScanMasks &block(size_t i) {
+        if (i - first >= window.size()) refill(i);
+        return window[i - first];
+    }
+    template <typename Select>
+    const char *seek(const char *p, Select bits);
+};
+
+template <typename Select>
+inline const char *ScanIndex::seek(const char *p, Select bits) {
+    if (p >= end) return end;
+    size_t offset = p - begin;
+    size_t i = offset / SCAN_BLOCK;
+    size_t blocks = (end - begin + SCAN_BLOCK - 1) / SCAN_BLOCK;
+    uint64_t m = bits(block(i)) & (~0ULL << (offset % SCAN_BLOCK));
+    while (m == 0) {
+        if (++i == blocks) return end;
+        m = bits(block(i));
+    }
+    const char *q = begin + i * SCAN_BLOCK + __builtin_ctzll(m);
+    return q < end ? q : end;
+}
+
+inline const char *ScanIndex::skipSpace(const char *p) {
+    return seek(p, [](const ScanMasks &m) { return ~m.space; });
+}
+
+inline const char *ScanIndex::findDelimiter(const char *p) {
+    return seek(p, [](const ScanMasks &m) { return m.space | m.punct; });
+}
+
+inline const char *ScanIndex::findText(const char *p) {
+    return seek(p, [](const ScanMasks &m) { return m.text; });
+}
+
+#endif
@@ -1,17 +1,24 @@
 #include "syntax.hpp"
+#include "value.hpp"
+#include "RE.hpp"
+#include <cerrno>
 #include <cstring>
 #include <vector>
-
-Syntax::Syntax(SyntaxBase *stx) : ptr(stx) {}
-SyntaxBase* Syntax::operator->() const { return ptr.get(); }
-SyntaxBase& Syntax::operator*() { return *ptr; }
-SyntaxBase* Syntax::get() const { return ptr.get(); }
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 Number::Number(int n) : n(n) {}
 void Number::show(std::ostream &os) {
   os << "the-number-" << n;
 }
 
+BignumSyntax::BignumSyntax(const BigInt &n) : n(n) {}
+void BignumSyntax::show(std::ostream &os) {
+  os << "the-number-" << n.toString();
+}
+
 RationalSyntax::RationalSyntax(int num, int den) : numerator(num), denominator(den) {}
 void RationalSyntax::show(std::ostream &os) {
   os << numerator << "/" << denominator;
@@ -25,9 +32,9 @@ void FalseSyntax::show(std::ostream &os) {
   os << "#f";
 }
 
-SymbolSyntax::SymbolSyntax(const std::string &s1) : s(s1) {}
+SymbolSyntax::SymbolSyntax(SymbolId s1) : s(s1) {}
 void SymbolSyntax::show(std::ostream &os) {
-    os << s;
+    os << s->name;
 }
 
 StringSyntax::StringSyntax(const std::string &s1) : s(s1) {}
@@ -35,7 +42,83 @@ void StringSyntax::show(std::ostream &os) {
     os << "\"" << s << "\"";
 }
 
+DatumSyntax::DatumSyntax(int constant) : constant(constant) {}
+void DatumSyntax::show(std::ostream &os) {
+  pooled(constant).show(os);
+}
+
+static Syntax atomSyntax(const Value &v) {
+  switch (v.type()) {
+    case V_INT: return Syntax(new Number(v.asInt()));
+    case V_BOOL: return v.asBool() ? Syntax(new TrueSyntax()) : Syntax(new FalseSyntax());
+    case V_BIGNUM: return Syntax(new BignumSyntax(static_cast<Bignum *>(v.get())->n));
+    case V_RATIONAL: {
+      Rational *q = static_cast<Rational *>(v.get());
+      return Syntax(new RationalSyntax((int)q->numerator, (int)q->denominator));
+    }
+    case V_STRING: return Syntax(new StringSyntax(static_cast<String *>(v.get())->s));
+    default: return Syntax(new SymbolSyntax(static_cast<Symbol *>(v.get())->s));
+  }
+}
+
+// Only plainly written data are read as values, so writing the value back
+// gives the syntax the reader would have made. Lists are rebuilt on a
+// stack of their own, with what is left of each list's value.
+Syntax DatumSyntax::syntax() const {
+  static const SymbolId dot = intern(".");
+  std::vector<std::pair<Syntax, Value>> open;
+  Syntax root(nullptr);
+  Value cur = pooled(constant);
+  for (;;) {
+    bool list = cur.type() == V_PAIR || cur.type() == V_NULL;
+    Syntax item = list ? Syntax(new List()) : atomSyntax(cur);
+    if (open.empty()) root = item;
+    else static_cast<List *>(open.back().first.get())->stxs.push_back(item);
+    if (list) open.emplace_back(item, cur);
+    // Find the next element to rebuild
+    for (;;) {
+      if (open.empty()) return root;
+      Value &rest = open.back().second;
+      if (rest.type() == V_PAIR) {
+        Pair *p = static_cast<Pair *>(rest.get());
+        cur = p->car;
+        Value next = p->cdr;
+        rest = std::move(next);
+        break;
+      }
+      if (rest.type() != V_NULL) {
+        static_cast<List *>(open.back().first.get())->stxs.push_back(Syntax(new SymbolSyntax(dot)));
+        cur = std::move(rest);
+        rest = NullV();
+        break;
+      }
+      open.pop_back();
+    }
+  }
+}
+
 List::List() {}
+
+// The elements whose last handle goes with their list are freed by the
+// outermost ~List, one at a time, so freeing a deep datum does not recurse
+List::~List() {
+  // Never destroyed: lists held by statics may be freed after main returns
+  static std::vector<SyntaxBase *> *orphans = new std::vector<SyntaxBase *>();
+  static bool freeing = false;
+  for (Syntax &stx : stxs) {
+    if (stx.ptr != nullptr && --stx.ptr->refs == 0) orphans->push_back(stx.ptr);
+    stx.ptr = nullptr;
+  }
+  if (freeing) return;
+  freeing = true;
+  while (!orphans->empty()) {
+    SyntaxBase *stx = orphans->back();
+    orphans->pop_back();
+    delete stx;
+  }
+  freeing = false;
+}
+
 void List::show(std::ostream &os) {
     os << '(';
     for (auto stx : stxs) {
@@ -45,177 +128,458 @@ void List::show(std::ostream &os) {
     os << ')';
 }
 
-std::istream &readSpace(std::istream &is) {
-  while (true) {
-    // Skip whitespace characters
-    while (isspace(is.peek()))
-      is.get();
-    
-    // Check if it's a comment
-    if (is.peek() == ';') {
-      // Skip comment until end of line
-      while (is.peek() != '\n' && is.peek() != EOF)
-        is.get();
-      // Continue loop to skip whitespace after comment
-    } else {
-      // No more whitespace or comments, exit loop
-      break;
-    }
-  }
-  return is;
+static bool isDelimiter(int c) {
+  return c == '(' || c == ')' || c == '[' || c == ']' || c == ';' || isspace(c);
 }
 
-Syntax readList(std::istream &is);
+static void readSpace(Reader &r) {
+  for (;;) {
+    r.pos = r.index.skipSpace(r.pos);
+    if (r.atEnd() || *r.pos != ';') return;
+    // Skip comment until end of line
+    const char *nl = static_cast<const char *>(memchr(r.pos, '\n', r.end - r.pos));
+    r.pos = nl != nullptr ? nl : r.end;
+  }
+}
 
-// Helper function to try parsing as integer or rational
-bool tryParseNumber(const std::string &s, int &result) {
+// Parses [b, e) as a fixnum; fails on integers outside the fixnum range,
+// see BignumSyntax. An empty token reads as 0.
+static bool tryParseNumber(const char *b, const char *e, int &result) {
   bool neg = false;
-  int n = 0;
-  int i = 0;
-  
+  long long n = 0;
+
   // Single '+' or '-' are not numbers
-  if (s.size() == 1 && (s[0] == '+' || s[0] == '-'))
+  if (e - b == 1 && (*b == '+' || *b == '-'))
     return false;
-  
+
   // Handle sign
-  if (s[0] == '-') {
-    i += 1;
+  if (b != e && *b == '-') {
+    ++b;
     neg = true;
-  } else if (s[0] == '+') {
-    i += 1;
+  } else if (b != e && *b == '+') {
+    ++b;
   }
-  
+
   // Check if all remaining characters are digits
-  for (; i < s.size(); i++) {
-    if ('0' <= s[i] && s[i] <= '9') {
-      n = n * 10 + s[i] - '0';
+  for (; b != e; ++b) {
+    if ('0' <= *b && *b <= '9') {
+      n = n * 10 + *b - '0';
+      if (n > 2147483648LL)
+        return false;
     } else {
       return false;  // Not a valid number
     }
   }
-  
-  result = neg ? -n : n;
+
+  if (!neg && n > 2147483647LL)
+    return false;
+  result = (int)(neg ? -n : n);
   return true;
 }
 
-// Helper function to try parsing as rational number
-bool tryParseRational(const std::string &s, int &numerator, int &denominator) {
-  size_t slash_pos = s.find('/');
-  if (slash_pos == std::string::npos || slash_pos == 0 || slash_pos == s.size() - 1) {
+// Parses [b, e) as num/den with a positive denominator
+static bool tryParseRational(const char *b, const char *e, int &numerator, int &denominator) {
+  const char *slash = static_cast<const char *>(memchr(b, '/', e - b));
+  if (slash == nullptr || slash == b || slash == e - 1) {
     return false; // No slash or slash at beginning/end
   }
-  
-  std::string num_str = s.substr(0, slash_pos);
-  std::string den_str = s.substr(slash_pos + 1);
-  
-  // Parse numerator (can be negative)
-  if (!tryParseNumber(num_str, numerator)) {
-    return false;
-  }
-  
-  // Parse denominator (must be positive)
-  if (!tryParseNumber(den_str, denominator) || denominator <= 0) {
-    return false;
-  }
-  
-  return true;
+  return tryParseNumber(b, slash, numerator) && tryParseNumber(slash + 1, e, denominator) && denominator > 0;
+}
+
+// Only tokens of digits, maybe signed, can be bignums
+static bool mayBeBignum(const char *b, const char *e) {
+  if (b != e && (*b == '+' || *b == '-')) ++b;
+  return b != e && '0' <= *b && *b <= '9';
 }
 
-// Helper function to create identifier/symbol syntax
-Syntax createIdentifierSyntax(const std::string &s) {
-  if (s == "#t")
-    return Syntax(new TrueSyntax());
-  if (s == "#f")
-    return Syntax(new FalseSyntax());
-  return Syntax(new SymbolSyntax(s));
-}
-
-// no leading space
-Syntax readItem(std::istream &is) {
-  if (is.peek() == '(' || is.peek() == '[') {
-    is.get();
-    return readList(is);
-  }
-  if (is.peek() == '\'')
-  {
-    is.get();
-    // Read syntax element after single quote
-    Syntax quoted_syntax = readItem(is);
-    
-    // Create list structure for (quote <syntax>)
-    List *quote_list = new List();
-    quote_list->stxs.push_back(Syntax(new SymbolSyntax("quote")));
-    quote_list->stxs.push_back(quoted_syntax);
-    
-    return Syntax(quote_list);
+namespace {
+
+// What readAtom makes of each kind of atom, for the parser
+struct SyntaxAtoms {
+  typedef Syntax Result;
+  Syntax string(const std::string &s) { return Syntax(new StringSyntax(s)); }
+  Syntax rational(int num, int den) { return Syntax(new RationalSyntax(num, den)); }
+  Syntax fixnum(int n) { return Syntax(new Number(n)); }
+  Syntax bignum(const BigInt &n) { return Syntax(new BignumSyntax(n)); }
+  Syntax boolean(bool b) { return b ? Syntax(new TrueSyntax()) : Syntax(new FalseSyntax()); }
+  Syntax symbol(const char *b, const char *e) { return Syntax(new SymbolSyntax(intern(std::string(b, e)))); }
+};
+
+// ... and for data read as values. The atoms of a quoted literal come from
+// the constant pool, shared as Quote::datum shares them; those of read are
+// made afresh.
+struct ValueAtoms {
+  typedef Value Result;
+  bool literal;
+  Value string(const std::string &s) { return literal ? pooled(poolString(s)) : StringV(s); }
+  Value rational(int num, int den) {
+    if (literal) return pooled(poolRational(num, den));
+    Value v = RationalV(num, den);
+    static_cast<Rational *>(v.get())->normalize();
+    return v;
   }
+  Value fixnum(int n) { return IntegerV(n); }
+  Value bignum(const BigInt &n) { return literal ? pooled(poolBignum(n)) : IntegerV(n); }
+  Value boolean(bool b) { return BooleanV(b); }
+  Value symbol(SymbolId s) { return literal ? pooled(poolSymbol(s)) : SymbolV(s); }
+  Value symbol(const char *b, const char *e) { return symbol(intern(std::string(b, e))); }
+};
+
+} // namespace
+
+// A string literal or a token, at r.pos
+template <typename Atoms>
+static typename Atoms::Result readAtom(Reader &r, Atoms &make) {
   // Handle string literals
-  if (is.peek() == '"') {
-    is.get(); // Consume opening double quote
+  if (!r.atEnd() && *r.pos == '"') {
+    ++r.pos; // Consume opening double quote
     std::string str;
-    while (is.peek() != '"' && is.peek() != EOF) {
-      char c = is.get();
-      if (c == '\\') {
+    // The text between escapes is copied a run at a time
+    while (r.pos != r.end && *r.pos != '"') {
+      if (*r.pos != '\\') {
+        const char *b = r.pos;
+        r.pos = r.index.findText(r.pos);
+        str.append(b, r.pos);
+      } else if (++r.pos != r.end) {
         // Handle escape characters
-        char next = is.get();
+        char next = *r.pos++;
         switch (next) {
           case 'n': str.push_back('\n'); break;
           case 't': str.push_back('\t'); break;
           case 'r': str.push_back('\r'); break;
-          case '\\': str.push_back('\\'); break;
-          case '"': str.push_back('"'); break;
           default: str.push_back(next); break;
         }
-      } else {
-        str.push_back(c);
       }
     }
-    if (is.peek() == '"') {
-      is.get(); // Consume closing double quote
+    if (r.pos != r.end) {
+      ++r.pos; // Consume closing double quote
     }
-    return Syntax(new StringSyntax(str));
+    return make.string(str);
   }
-  
+
   // Read token
-  std::string s;
-  do {
-    int c = is.peek();
-    if (c == '(' || c == ')' ||
-        c == '[' || c == ']' || 
-        c == ';' ||  // Add semicolon as delimiter
-        isspace(c) ||
-        c == EOF)
-      break;
-    is.get();
-    s.push_back(c);
-  } while (true);
-  
+  const char *b = r.pos;
+  r.pos = r.index.findDelimiter(r.pos);
+  const char *e = r.pos;
+
   // Try parsing as rational first
   int numerator, denominator;
-  if (tryParseRational(s, numerator, denominator)) {
-    return Syntax(new RationalSyntax(numerator, denominator));
+  if (tryParseRational(b, e, numerator, denominator)) {
+    return make.rational(numerator, denominator);
   }
-  
+
   // Try parsing as integer
   int number_value;
-  if (tryParseNumber(s, number_value)) {
-    return Syntax(new Number(number_value));
+  if (tryParseNumber(b, e, number_value)) {
+    return make.fixnum(number_value);
+  }
+  BigInt big;
+  if (mayBeBignum(b, e) && BigInt::parse(std::string(b, e), big)) {
+    return make.bignum(big);
   }
-  
+
   // Not a number, treat as identifier/symbol
-  return createIdentifierSyntax(s);
+  if (e - b == 2 && b[0] == '#' && (b[1] == 't' || b[1] == 'f')) {
+    return make.boolean(b[1] == 't');
+  }
+  return make.symbol(b, e);
 }
 
-Syntax readList(std::istream &is) {
-    List *stx = new List();
-    while (readSpace(is).peek() != ')' && readSpace(is).peek() != ')')
-        stx->stxs.push_back(readItem(is));
-    is.get(); // ')'
-    return Syntax(stx);
+// How a datum read as a value was written, worst last
+enum DatumForm {
+  DATUM_PLAIN,        // As its value would be written back
+  DATUM_IRREGULAR,    // With a dot the value does not show, like (. a) or (a . b c)
+  DATUM_MALFORMED     // With a dot and no tail after it
+};
+
+// A lone "." token at r.pos
+static bool atDot(const Reader &r) {
+  return *r.pos == '.' && (r.pos + 1 == r.end || isDelimiter((unsigned char)r.pos[1]));
+}
+
+// Reads the datum at r.pos straight into a value, keeping the lists it is
+// inside of on a stack, as readItem does. Pairs are appended to a list as
+// its elements are read. A dot is taken as Quote::datum takes it: the
+// element after the first dot is the tail, and any after that are
+// dropped. The datum is read to its end whatever its form.
+static DatumForm readValue(Reader &r, ValueAtoms &make, Value &result) {
+  static const SymbolId quote = intern("quote");
+  static const SymbolId dot = intern(".");
+  struct Open {
+    Value head;     // The list so far
+    Pair *last;     // Its last pair, nullptr while it is empty
+    int dot;        // 0 before the dot, 1 when the tail is next, 2 after the tail
+    bool prefix;    // A quote awaiting its datum rather than a list
+  };
+  std::vector<Open> open;
+  DatumForm form = DATUM_PLAIN;
+  auto mark = [&](DatumForm f) { if (f > form) form = f; };
+  for (;;) {
+    Value item(nullptr);
+    bool have = false;          // item holds an element
+    bool compound = false;      // a list or quotation
+    int c = r.atEnd() ? EOF : *r.pos;
+    if (c == '(' || c == '[') {
+      ++r.pos;
+      open.push_back(Open{NullV(), nullptr, 0, false});
+    } else if (c == '\'') {
+      ++r.pos;
+      open.push_back(Open{NullV(), nullptr, 0, true});
+      continue;
+    } else if (!open.empty() && !open.back().prefix && open.back().dot == 0 && atDot(r)) {
+      ++r.pos;
+      open.back().dot = 1;
+      if (open.back().last == nullptr) mark(DATUM_IRREGULAR);
+    } else {
+      item = readAtom(r, make);
+      have = true;
+    }
+    // Hand the item to what encloses it, closing the lists that end here
+    for (;;) {
+      if (have) {
+        if (open.empty()) {
+          result = item;
+          return form;
+        }
+        Open &o = open.back();
+        if (o.prefix) {
+          // '. is the list (quote .), whose dot has no tail
+          if (!compound && item.type() == V_SYM && static_cast<Symbol *>(item.get())->s == dot)
+            mark(DATUM_MALFORMED);
+          item =PairV(make.symbol(quote), PairV(item, NullV()));
+          compound = true;
+          open.pop_back();
+          continue;
+        }
+        if (o.dot == 0) {
+          Value p = PairV(item, NullV());
+          Pair *pair = static_cast<Pair *>(p.get());
+          if (o.last == nullptr) o.head = p;
+          else o.last->cdr = p;
+          o.last = pair;
+        } else if (o.dot == 1) {
+          // A list tail would be read back as elements of this list
+          if (compound) mark(DATUM_IRREGULAR);
+          if (o.last == nullptr) o.head = item;
+          else o.last->cdr = item;
+          o.dot = 2;
+        } else {
+          mark(DATUM_IRREGULAR);
+        }
+      }
+      readSpace(r);
+      if (!r.atEnd() && *r.pos != ')' && *r.pos != ']') break;
+      if (!r.atEnd()) ++r.pos;
+      if (open.back().dot == 1) mark(DATUM_MALFORMED);
+      item = std::move(open.back().head);
+      have = compound = true;
+      open.pop_back();
+    }
+  }
+}
+
+// The datum of a quotation, at r.pos, if it is a list or another quotation
+// that can be read as a value; otherwise r is left as it was and the
+// handle is null
+static Syntax readLiteral(Reader &r) {
+  if (r.atEnd() || (*r.pos != '(' && *r.pos != '[' && *r.pos != '\'')) return Syntax(nullptr);
+  const char *start = r.pos;
+  ValueAtoms literal{true};
+  Value v(nullptr);
+  if (readValue(r, literal, v) != DATUM_PLAIN) {
+    r.pos = start;
+    return Syntax(nullptr);
+  }
+  return Syntax(new DatumSyntax(v.type() == V_NULL ? poolImmediate(v) : poolValue(v)));
+}
+
+// (quote <datum>)
+static Syntax quotation(const Syntax &datum) {
+  static const SymbolId quote = intern("quote");
+  List *quote_list = new List();
+  quote_list->stxs.push_back(Syntax(new SymbolSyntax(quote)));
+  quote_list->stxs.push_back(datum);
+  return Syntax(quote_list);
+}
+
+// The innermost open list is (quote so far
+static bool quoteOpen(const std::vector<Syntax> &open) {
+  static const SymbolId quote = intern("quote");
+  if (open.empty() || open.back().get() == nullptr) return false;
+  List *lst = static_cast<List *>(open.back().get());
+  if (lst->stxs.size() != 1) return false;
+  SymbolSyntax *sym = dynamic_cast<SymbolSyntax *>(lst->stxs[0].get());
+  return sym != nullptr && sym->s == quote;
+}
+
+// no leading space. The lists the item is inside of are kept on a stack
+// of their own, so nesting is limited by memory only; a list ends at ')'
+// or ']', or unterminated at the end of the input
+static Syntax readItem(Reader &r) {
+  SyntaxAtoms atoms;
+  // Innermost last; a null handle stands for a quote awaiting its datum
+  std::vector<Syntax> open;
+  for (;;) {
+    Syntax item(nullptr);
+    int c = r.atEnd() ? EOF : *r.pos;
+    if (c == '\'') {
+      // The quoted item follows at once, with no space skipped. Compound
+      // data are read as values, see DatumSyntax
+      ++r.pos;
+      Syntax datum = readLiteral(r);
+      if (datum.get() == nullptr) {
+        open.push_back(Syntax(nullptr));
+        continue;
+      }
+      item = quotation(datum);
+    } else if (quoteOpen(open) && (item = readLiteral(r)).get() != nullptr) {
+      // The datum of (quote <datum>), likewise
+    } else if (c == '(' || c == '[') {
+      ++r.pos;
+      open.push_back(Syntax(new List()));
+    } else {
+      item = readAtom(r, atoms);
+    }
+    // Hand the item to what encloses it, closing the lists that end here
+    for (;;) {
+      if (item.get() != nullptr) {
+        if (open.empty()) return item;
+        if (open.back().get() == nullptr) {
+          item = quotation(item);
+          open.pop_back();
+          continue;
+        }
+        static_cast<List *>(open.back().get())->stxs.push_back(item);
+      }
+      readSpace(r);
+      if (!r.atEnd() && *r.pos != ')' && *r.pos != ']') break;
+      if (!r.atEnd()) ++r.pos;
+      item = std::move(open.back());
+      open.pop_back();
+    }
+  }
+}
+
+Syntax readSyntax(Reader &r) {
+  readSpace(r);
+  return readItem(r);
+}
+
+bool atDatum(Reader &r) {
+  readSpace(r);
+  return !r.atEnd() && *r.pos != ')' && *r.pos != ']';
+}
+
+// Stream side of readSyntax: copies the characters readSyntax(Reader &)
+// will consume, following the same grammar
+static void gatherSpace(std::istream &is, std::string &text) {
+  while (true) {
+    int c = is.peek();
+    if (isspace(c)) {
+      text.push_back((char)is.get());
+    } else if (c == ';') {
+      while (is.peek() != '\n' && is.peek() != EOF)
+        text.push_back((char)is.get());
+    } else {
+      break;
+    }
+  }
+}
+
+static void gatherItem(std::istream &is, std::string &text) {
+  int depth = 0;      // Lists open
+  for (;;) {
+    int c = is.peek();
+    if (c == '(' || c == '[') {
+      text.push_back((char)is.get());
+      ++depth;
+    } else if (c == '\'') {
+      text.push_back((char)is.get());
+      continue;
+    } else if (c == '"') {
+      text.push_back((char)is.get());
+      while (is.peek() != '"' && is.peek() != EOF) {
+        c = is.get();
+        text.push_back((char)c);
+        if (c == '\\' && is.peek() != EOF) text.push_back((char)is.get());
+      }
+      if (is.peek() == '"') text.push_back((char)is.get());
+    } else {
+      while (is.peek() != EOF && !isDelimiter(is.peek()))
+        text.push_back((char)is.get());
+    }
+    // Close the lists that end after this item
+    for (;;) {
+      if (depth == 0) return;
+      gatherSpace(is, text);
+      c = is.peek();
+      if (c == EOF) return;
+      if (c != ')' && c != ']') break;
+      text.push_back((char)is.get());
+      --depth;
+    }
+  }
 }
 
 Syntax readSyntax(std::istream &is) {
-  return readItem(readSpace(is));
+  std::string text;
+  gatherSpace(is, text);
+  gatherItem(is, text);
+  Reader r(text.data(), text.data() + text.size());
+  return readSyntax(r);
+}
+
+Reader *read_source = nullptr;
+
+Value readDatum(Reader &r) {
+  readSpace(r);
+  if (r.atEnd()) throw RuntimeError("read: end of input");
+  ValueAtoms fresh{false};
+  Value v(nullptr);
+  if (readValue(r, fresh, v) == DATUM_MALFORMED) throw RuntimeError("invalid dotted list");
+  return v;
+}
+
+Value readDatum() {
+  if (read_source != nullptr) return readDatum(*read_source);
+  std::string text;
+  gatherSpace(std::cin, text);
+  gatherItem(std::cin, text);
+  Reader r(text.data(), text.data() + text.size());
+  return readDatum(r);
+}
+
+SourceBuffer::SourceBuffer(int fd) : data(nullptr), size(0), mapped(nullptr), mapped_size(0) {
+  struct stat st;
+  off_t offset = lseek(fd, 0, SEEK_CUR);
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && offset >= 0 && st.st_size > offset) {
+    void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED) {
+      mapped = p;
+      mapped_size = st.st_size;
+      data = static_cast<const char *>(p) + offset;
+      size = st.st_size - offset;
+      return;
+    }
+  }
+  const size_t BLOCK = 1 << 16;
+  for (;;) {
+    size_t used = copy.size();
+    copy.resize(used + BLOCK);
+    ssize_t n = read(fd, copy.data() + used, BLOCK);
+    if (n <= 0) {
+      copy.resize(used);
+      if (n < 0 && errno == EINTR) continue;
+      break;
+    }
+    copy.resize(used + n);
+  }
+  data = copy.data();
+  size = copy.size();
+}
+
+SourceBuffer::~SourceBuffer() {
+  if (mapped != nullptr) munmap(mapped, mapped_size);
 }
 
 std::istream &operator>>(std::istream &is, Syntax &stx) {
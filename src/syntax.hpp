@@ -5,26 +5,135 @@
 #include <memory>
 #include <vector>
 #include "Def.hpp"
+#include "bigint.hpp"
+#include "scanner.hpp"
+
+/**
+ * @brief What the parser learns about one local binding
+ *
+ * A binding that is captured by a closure and also assigned after its frame
+ * is made (by set!, or because letrec or an internal define fills it in
+ * later) must be shared between the frame and the closures, so it lives in
+ * a Box. Every other binding is copied into closures by value.
+ */
+struct Binding {
+    bool assigned = false;
+    bool captured = false;
+    std::vector<bool *> uses;        ///< `boxed` flags of the nodes accessing it
+    bool boxed() const { return assigned && captured; }
+};
+
+/**
+ * @brief Compile-time scope used for lexical addressing
+ *
+ * Mirrors the shape of the runtime environment: each lambda, let or letrec
+ * body is one contour and becomes one Frame at run time, with its bindings
+ * (followed by the body's internal defines) in slot order. The outermost
+ * scope (parent == nullptr) is the top level; names not bound by any
+ * enclosing scope are globals.
+ *
+ * A lambda body's frame does not chain to the frame the closure was made
+ * in, but to a flat frame of the variables the lambda captured. Resolving a
+ * name that is free in a lambda adds it to that lambda's captures, listed
+ * by their address in the enclosing contour.
+ */
+struct Scope {
+    std::vector<SymbolId> names;     ///< Bindings of this contour, in slot order
+    std::vector<Binding> bindings;   ///< Parallel to names
+    Scope *parent;                   ///< Enclosing contour
+    bool function;                   ///< A lambda body
+    std::vector<SymbolId> captured;                  ///< Free variables of a lambda body
+    std::vector<Binding *> captured_bindings;
+    std::vector<std::pair<int, int>> captures;       ///< Their addresses in the parent contour
+    Scope(Scope * = nullptr, bool = false);
+    bool isTopLevel() const;
+    void bind(const std::vector<SymbolId> &);
+    Binding *resolve(SymbolId, int &, int &);
+    std::vector<int> close();
+};
 
 struct SyntaxBase {
-    virtual Expr parse(Assoc &) = 0;
+    int refs = 0;       ///< Number of Syntax handles referring to this datum
+    virtual Expr parse(Scope &) = 0;
     virtual void show(std::ostream &) = 0;
     virtual ~SyntaxBase() = default;
 };
 
+/**
+ * @brief Reference-counted handle to a syntax datum, like Expr
+ */
 struct Syntax {
-    std::shared_ptr<SyntaxBase> ptr;
+    SyntaxBase *ptr;
     Syntax(SyntaxBase *);
+    Syntax(const Syntax &);
+    Syntax(Syntax &&);
+    Syntax &operator=(const Syntax &);
+    Syntax &operator=(Syntax &&);
+    ~Syntax();
     SyntaxBase* operator->() const;
     SyntaxBase& operator*();
     SyntaxBase* get() const;
-    Expr parse(Assoc &);
+    Expr parse(Scope &);
 };
 
+inline Syntax::Syntax(SyntaxBase *x) : ptr(x) {
+    if (ptr != nullptr) ++ptr->refs;
+}
+
+inline Syntax::Syntax(const Syntax &other) : ptr(other.ptr) {
+    if (ptr != nullptr) ++ptr->refs;
+}
+
+inline Syntax::Syntax(Syntax &&other) : ptr(other.ptr) {
+    other.ptr = nullptr;
+}
+
+inline Syntax &Syntax::operator=(const Syntax &other) {
+    if (other.ptr != nullptr) ++other.ptr->refs;
+    SyntaxBase *old = ptr;
+    ptr = other.ptr;
+    if (old != nullptr && --old->refs == 0) delete old;
+    return *this;
+}
+
+inline Syntax &Syntax::operator=(Syntax &&other) {
+    if (this != &other) {
+        SyntaxBase *old = ptr;
+        ptr = other.ptr;
+        other.ptr = nullptr;
+        if (old != nullptr && --old->refs == 0) delete old;
+    }
+    return *this;
+}
+
+inline Syntax::~Syntax() {
+    if (ptr != nullptr && --ptr->refs == 0) delete ptr;
+}
+
+inline SyntaxBase* Syntax::operator->() const {
+    return ptr;
+}
+
+inline SyntaxBase& Syntax::operator*() {
+    return *ptr;
+}
+
+inline SyntaxBase* Syntax::get() const {
+    return ptr;
+}
+
 struct Number : SyntaxBase {
     int n;
     Number(int);
-    virtual Expr parse(Assoc &) override;
+    virtual Expr parse(Scope &) override;
+    virtual void show(std::ostream &) override;
+};
+
+/// Integer literal too large for a fixnum
+struct BignumSyntax : SyntaxBase {
+    BigInt n;
+    BignumSyntax(const BigInt &);
+    virtual Expr parse(Scope &) override;
     virtual void show(std::ostream &) override;
 };
 
@@ -32,44 +141,120 @@ struct RationalSyntax : SyntaxBase {
     int numerator;
     int denominator;
     RationalSyntax(int num, int den);
-    virtual Expr parse(Assoc &) override;
+    virtual Expr parse(Scope &) override;
     virtual void show(std::ostream &) override;
 };
 
 struct TrueSyntax : SyntaxBase {
     // This will not match
-    virtual Expr parse(Assoc &) override;
+    virtual Expr parse(Scope &) override;
     virtual void show(std::ostream &) override;
 };
 
 struct FalseSyntax : SyntaxBase {
     // FalseSyntax();
-    virtual Expr parse(Assoc &) override;
+    virtual Expr parse(Scope &) override;
     virtual void show(std::ostream &) override;
 };
 
 struct SymbolSyntax : SyntaxBase {
-    std::string s;
-    SymbolSyntax(const std::string &);
-    virtual Expr parse(Assoc &) override;
+    SymbolId s;
+    SymbolSyntax(SymbolId);
+    virtual Expr parse(Scope &) override;
     virtual void show(std::ostream &) override;
 };
 
 struct StringSyntax : SyntaxBase {
     std::string s;
     StringSyntax(const std::string &);
-    virtual Expr parse(Assoc &) override;
+    virtual Expr parse(Scope &) override;
     virtual void show(std::ostream &) override;
 };
 
 struct List : SyntaxBase {
     std::vector<Syntax> stxs;
     List();
-    virtual Expr parse(Assoc &) override;
+    ~List();
+    virtual Expr parse(Scope &) override;
     virtual void show(std::ostream &) override;
 };
 
+/**
+ * @brief A quoted list, written out, that the reader built as a value
+ *
+ * The reader reads the datum of '(...) or (quote (...)) straight into
+ * pairs in the constant pool, so literal data never exist as a syntax tree
+ * as well. Quote takes the constant as it is. Parsed as code, which only
+ * happens where quote is rebound, the datum is turned back into the syntax
+ * it was read from.
+ */
+struct DatumSyntax : SyntaxBase {
+    int constant;       ///< Index in the constant pool
+    DatumSyntax(int);
+    Syntax syntax() const;
+    virtual Expr parse(Scope &) override;
+    virtual void show(std::ostream &) override;
+};
+
+/**
+ * @brief Cursor over source text held in one contiguous buffer
+ *
+ * Tokens are read as slices of the buffer and numbers are parsed in place;
+ * only the text of symbols and strings is copied out, into the symbol
+ * table or the literal. The reader moves from one boundary to the next
+ * through the scanner's masks of the buffer, see ScanIndex.
+ */
+struct Reader {
+    const char *pos;
+    const char *end;
+    ScanIndex index;
+    Reader(const char *begin, const char *end, ScanLevel level = bestScanLevel())
+        : pos(begin), end(end), index(begin, end, level) {}
+    bool atEnd() const { return pos == end; }
+};
+
+/**
+ * @brief A whole input in memory, for Reader
+ * A regular file is mapped with mmap; anything else (a pipe, a terminal)
+ * is read to the end in large blocks.
+ */
+struct SourceBuffer {
+    const char *data;
+    size_t size;
+    explicit SourceBuffer(int fd);      ///< From the current offset of fd
+    SourceBuffer(const SourceBuffer &) = delete;
+    SourceBuffer &operator=(const SourceBuffer &) = delete;
+    ~SourceBuffer();
+    Reader reader() const { return Reader(data, data + size); }
+private:
+    void *mapped;               ///< The mapping, or nullptr if copied
+    size_t mapped_size;
+    std::vector<char> copy;
+};
+
+Syntax readSyntax(Reader &);
+
+/// Skips blanks and comments; false at the end or at a ')' or ']' that closes nothing
+bool atDatum(Reader &);
+
+/**
+ * @brief Reads one datum from a stream, consuming no more than it
+ * The datum's text is gathered first, then read by the buffer reader.
+ */
 Syntax readSyntax(std::istream &);
 
+/**
+ * @brief The next datum as a value, for read; throws at the end of input
+ * Lists are read into pairs directly, with no syntax in between.
+ */
+Value readDatum(Reader &);
+
+/**
+ * @brief The next datum of the program's input
+ * From read_source when set, else from std::cin.
+ */
+Value readDatum();
+extern Reader *read_source;     ///< The REPL's reader of a non-interactive input
+
 std::istream &operator>>(std::istream &, Syntax);
 #endif
\ No newline at end of file
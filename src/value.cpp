@@ -7,6 +7,9 @@
  */
 
 #include "value.hpp"
+#include <new>
+#include <map>
+#include <unordered_map>
 
 // ============================================================================
 // Base ValueBase Implementation
@@ -21,123 +24,127 @@ void ValueBase::showCdr(std::ostream &os) {
 }
 
 // ============================================================================
-// Value Smart Pointer Implementation
+// Value Word Implementation
 // ============================================================================
 
-Value::Value(ValueBase *ptr) : ptr(ptr) {}
-
-ValueBase* Value::operator->() const { 
-    return ptr.get(); 
+void Value::show(std::ostream &os) const {
+    switch (type()) {
+        case V_INT:       os << asInt(); break;
+        case V_BOOL:      os << (asBool() ? "#t" : "#f"); break;
+        case V_NULL:      os << "()"; break;
+        case V_VOID:      os << "#<void>"; break;
+        case V_TERMINATE: os << "()"; break;
+        default:          get()->show(os); break;
+    }
 }
 
-ValueBase& Value::operator*() { 
-    return *ptr; 
+// Prints the tail of a list whose previous element has just been shown
+void Value::showCdr(std::ostream &os) const {
+    if (boxed()) {
+        get()->showCdr(os);
+    } else if (type() == V_NULL) {
+        os << ')';
+    } else {
+        os << " . ";
+        show(os);
+        os << ')';
+    }
 }
 
-ValueBase* Value::get() const { 
-    return ptr.get(); 
-}
+// ============================================================================
+// Environment (Frame) Implementation
+// ============================================================================
+
+Frame::Frame(int n, const Assoc &parent) : size(n), parent(parent) {}
 
-void Value::show(std::ostream &os) {
-    ptr->show(os);
+Value *Frame::slots() {
+    return reinterpret_cast<Value *>(this + 1);
 }
 
-// ============================================================================
-// Environment (Association List) Implementation
-// ============================================================================
+// One allocation for the header and all slots; slots start out unbound
+Frame *Frame::make(int n, const Assoc &parent) {
+    void *mem = slabAlloc(sizeof(Frame) + n * sizeof(Value));
+    Frame *frame = new (mem) Frame(n, parent);
+    Value *slots = frame->slots();
+    for (int i = 0; i < n; ++i) new (slots + i) Value(nullptr);
+    return frame;
+}
 
-AssocList::AssocList(const std::string &x, const Value &v, Assoc &next)
-    : x(x), v(v), next(next) {}
+Frame::~Frame() {
+    Value *values = slots();
+    for (int i = 0; i < size; ++i) values[i].~Value();
+}
 
-Assoc::Assoc(AssocList *x) : ptr(x) {}
+// Frames have no fixed size, so they are freed here rather than by delete
+void Frame::release(Frame *frame) {
+    size_t bytes = sizeof(Frame) + frame->size * sizeof(Value);
+    frame->~Frame();
+    slabFree(frame, bytes);
+}
 
-AssocList* Assoc::operator->() const { 
-    return ptr.get(); 
+void Frame::destroy() {
+    release(this);
 }
 
-AssocList& Assoc::operator*() { 
-    return *ptr; 
+void Frame::trace(Tracer &t) {
+    visit(t, parent);
+    Value *values = slots();
+    for (int i = 0; i < size; ++i) visit(t, values[i]);
 }
 
-AssocList* Assoc::get() const { 
-    return ptr.get(); 
+void Frame::clear() {
+    parent = Assoc(nullptr);
+    Value *values = slots();
+    for (int i = 0; i < size; ++i) values[i] = Value(nullptr);
 }
 
 Assoc empty() {
     return Assoc(nullptr);
 }
 
-Assoc extend(const std::string &x, const Value &v, Assoc &lst) {
-    return Assoc(new AssocList(x, v, lst));
+Assoc extend(int n, const Assoc &parent) {
+    return Assoc(Frame::make(n, parent));
 }
 
-void modify(const std::string &x, const Value &v, Assoc &lst) {
-    for (auto i = lst; i.get() != nullptr; i = i->next) {
-        if (x == i->x) {
-            i->v = v;
-            return;
-        }
-    }
+// Follows a lexical address without comparing names
+Value &locate(int depth, int slot, Assoc &l) {
+    Frame *frame = l.get();
+    while (depth-- > 0)
+        frame = frame->parent.get();
+    return frame->slots()[slot];
 }
 
-Value find(const std::string &x, Assoc &l) {
-    for (auto i = l; i.get() != nullptr; i = i->next) {
-        if (x == i->x) {
-            return i->v;
-        }
-    }
-    return Value(nullptr);
+// Top-level environment: the cell hangs off the interned symbol
+GlobalCell::GlobalCell(SymbolId name) : name(name), v(nullptr) {}
+
+GlobalCell *globalCell(SymbolId x) {
+    if (x->cell == nullptr)
+        x->cell = new GlobalCell(x);
+    return x->cell;
 }
 
 // ============================================================================
-// Simple Value Types Implementation
+// Heap Value Types Implementation
 // ============================================================================
 
-// Void
-Void::Void() : ValueBase(V_VOID) {}
-
-void Void::show(std::ostream &os) {
-    os << "#<void>";
-}
-
-Value VoidV() {
-    return Value(new Void());
-}
-
-// Integer
-Integer::Integer(int n) : ValueBase(V_INT), n(n) {}
+// Bignum
+Bignum::Bignum(const BigInt &n) : ValueBase(V_BIGNUM), n(n) {}
 
-void Integer::show(std::ostream &os) {
-    os << n;
+void Bignum::show(std::ostream &os) {
+    os << n.toString();
 }
 
-Value IntegerV(int n) {
-    return Value(new Integer(n));
+Value IntegerV(const BigInt &n) {
+    if (n.fitsInt()) return IntegerV(n.toInt());
+    return Value(new Bignum(n));
 }
 
 // Rational
-// Helper function to calculate greatest common divisor
-static int gcd(int a, int b) {
-    if (a < 0) a = -a;
-    if (b < 0) b = -b;
-    while (b != 0) {
-        int temp = b;
-        b = a % b;
-        a = temp;
-    }
-    return a;
-}
-
-Rational::Rational(int num, int den) : ValueBase(V_RATIONAL) {
+Rational::Rational(long long num, long long den) : ValueBase(V_RATIONAL), numerator(num), denominator(den) {
     if (den == 0) {
         throw std::runtime_error("Division by zero");
     }
     
-    // Simplify the fraction
-    int g = gcd(num, den);
-    numerator = num / g;
-    denominator = den / g;
-    
     // Ensure denominator is positive
     if (denominator < 0) {
         numerator = -numerator;
@@ -145,7 +152,17 @@ Rational::Rational(int num, int den) : ValueBase(V_RATIONAL) {
     }
 }
 
+void Rational::normalize() {
+    unsigned long long magnitude = numerator < 0 ? 0 - (unsigned long long)numerator : numerator;
+    long long g = (long long)binaryGcd(magnitude, (unsigned long long)denominator);
+    if (g > 1) {
+        numerator /= g;
+        denominator /= g;
+    }
+}
+
 void Rational::show(std::ostream &os) {
+    normalize();
     if (denominator == 1) {
         os << numerator;
     } else {
@@ -153,29 +170,30 @@ void Rational::show(std::ostream &os) {
     }
 }
 
-Value RationalV(int num, int den) {
+Value RationalV(long long num, long long den) {
     return Value(new Rational(num, den));
 }
 
-// Boolean
-Boolean::Boolean(bool b) : ValueBase(V_BOOL), b(b) {}
+// BigRational
+BigRational::BigRational(const BigInt &num, const BigInt &den)
+    : ValueBase(V_BIGRATIONAL), numerator(num), denominator(den) {}
 
-void Boolean::show(std::ostream &os) {
-    os << (b ? "#t" : "#f");
+void BigRational::show(std::ostream &os) {
+    os << numerator.toString() << "/" << denominator.toString();
 }
 
-Value BooleanV(bool b) {
-    return Value(new Boolean(b));
+Value BigRationalV(const BigInt &num, const BigInt &den) {
+    return Value(new BigRational(num, den));
 }
 
 // Symbol
-Symbol::Symbol(const std::string &s) : ValueBase(V_SYM), s(s) {}
+Symbol::Symbol(SymbolId s) : ValueBase(V_SYM), s(s) {}
 
 void Symbol::show(std::ostream &os) {
-    os << s;
+    os << s->name;
 }
 
-Value SymbolV(const std::string &s) {
+Value SymbolV(SymbolId s) {
     return Value(new Symbol(s));
 }
 
@@ -191,74 +209,200 @@ Value StringV(const std::string &s) {
 }
 
 // ============================================================================
-// Special Value Types Implementation
+// Composite Value Types Implementation
 // ============================================================================
 
-// Null
-Null::Null() : ValueBase(V_NULL) {}
+// Pair
+Pair::Pair(const Value &car, const Value &cdr) 
+    : ValueBase(V_PAIR), car(car), cdr(cdr) {}
 
-void Null::show(std::ostream &os) {
-    os << "()";
+void Pair::show(std::ostream &os) {
+    os << '(' << car;
+    cdr.showCdr(os);
 }
 
-void Null::showCdr(std::ostream &os) {
-    os << ')';
+void Pair::showCdr(std::ostream &os) {
+    os << ' ' << car;
+    cdr.showCdr(os);
+}
+
+// The pairs whose last handle goes with a pair, through its car or its
+// cdr, are freed by the outermost ~Pair, one at a time, so freeing a long
+// list or a deeply nested datum does not recurse, like List::~List
+Pair::~Pair() {
+    // Never destroyed: pairs held by statics may be freed after main returns
+    static std::vector<Value> *orphans = new std::vector<Value>();
+    static bool freeing = false;
+    if (car.boxed() && car->v_type == V_PAIR && car->refs == 1) orphans->push_back(std::move(car));
+    if (cdr.boxed() && cdr->v_type == V_PAIR && cdr->refs == 1) orphans->push_back(std::move(cdr));
+    if (freeing) return;
+    freeing = true;
+    while (!orphans->empty()) {
+        // Dropped at the end of the body, queueing its own children
+        Value orphan = std::move(orphans->back());
+        orphans->pop_back();
+    }
+    freeing = false;
+}
+
+void Pair::trace(Tracer &t) {
+    visit(t, car);
+    visit(t, cdr);
+}
+
+void Pair::clear() {
+    car = Value(nullptr);
+    cdr = Value(nullptr);
+}
+
+Value PairV(const Value &car, const Value &cdr) {
+    return Value(new Pair(car, cdr));
+}
+
+// Procedure
+Procedure::Procedure(const std::vector<SymbolId> &xs, const Expr &e, const Assoc &env, int locals,
+                     const std::vector<int> &boxed)
+    : ValueBase(V_PROC), parameters(xs), locals(locals), e(e), env(env), boxed(boxed) {}
+
+void Procedure::show(std::ostream &os) {
+    os << "#<procedure>";
+}
+
+void Procedure::trace(Tracer &t) {
+    visit(t, env);
+}
+
+void Procedure::clear() {
+    env = Assoc(nullptr);
+}
+
+Value ProcedureV(const std::vector<SymbolId> &xs, const Expr &e, const Assoc &env, int locals,
+                 const std::vector<int> &boxed) {
+    return Value(new Procedure(xs, e, env, locals, boxed));
+}
+
+// PrimitiveProcedure
+PrimitiveProcedure::PrimitiveProcedure(ExprType op, PrimitiveEntry fn, int min_args, int max_args)
+    : ValueBase(V_PRIMITIVE), op(op), fn(fn), min_args(min_args), max_args(max_args) {}
+
+void PrimitiveProcedure::show(std::ostream &os) {
+    os << "#<procedure>";
+}
+
+Value PrimitiveProcedureV(ExprType op, PrimitiveEntry fn, int min_args, int max_args) {
+    return Value(new PrimitiveProcedure(op, fn, min_args, max_args));
+}
+
+Box::Box(const Value &v) : ValueBase(V_BOX), v(v) {}
+
+void Box::show(std::ostream &os) {
+    v.show(os);
+}
+
+void Box::trace(Tracer &t) {
+    visit(t, v);
 }
 
-Value NullV() {
-    return Value(new Null());
+void Box::clear() {
+    v = Value(nullptr);
 }
 
-// Terminate
-Terminate::Terminate() : ValueBase(V_TERMINATE) {}
+Value BoxV(const Value &v) {
+    return Value(new Box(v));
+}
 
-void Terminate::show(std::ostream &os) {
-    os << "()";
+// Moves the current contents of each listed slot (possibly unbound) into a box
+void boxSlots(const Assoc &frame, const std::vector<int> &slots) {
+    Value *values = frame->slots();
+    for (int i : slots) values[i] = BoxV(values[i]);
 }
 
-Value TerminateV() {
-    return Value(new Terminate());
+Continuation::Continuation() : ValueBase(V_CONTINUATION) {}
+
+void Continuation::show(std::ostream &os) {
+    os << "#<continuation>";
 }
 
 // ============================================================================
-// Composite Value Types Implementation
+// Constant Pool Implementation
 // ============================================================================
 
-// Pair
-Pair::Pair(const Value &car, const Value &cdr) 
-    : ValueBase(V_PAIR), car(car), cdr(cdr) {}
+std::vector<Value> *constant_pool = new std::vector<Value>();
 
-void Pair::show(std::ostream &os) {
-    os << '(' << car;
-    cdr->showCdr(os);
+namespace {
+
+struct PoolIndex {
+    std::unordered_map<uintptr_t, int> immediates;
+    std::unordered_map<std::string, int> strings;
+    std::unordered_map<SymbolId, int> symbols;
+    std::map<std::vector<uint32_t>, int> bignums[2];    ///< By sign, then magnitude
+    std::map<std::pair<long long, long long>, int> rationals;
+};
+
+PoolIndex &poolIndex() {
+    static PoolIndex *index = new PoolIndex();
+    return *index;
 }
 
-void Pair::showCdr(std::ostream &os) {
-    os << ' ' << car;
-    cdr->showCdr(os);
+int pool(const Value &v) {
+    constant_pool->push_back(v);
+    return (int)constant_pool->size() - 1;
 }
 
-Value PairV(const Value &car, const Value &cdr) {
-    return Value(new Pair(car, cdr));
+} // namespace
+
+int poolImmediate(const Value &v) {
+    auto &table = poolIndex().immediates;
+    auto it = table.find(v.bits);
+    if (it != table.end()) return it->second;
+    return table[v.bits] = pool(v);
 }
 
-// Procedure
-Procedure::Procedure(const std::vector<std::string> &xs, const Expr &e, const Assoc &env)
-    : ValueBase(V_PROC), parameters(xs), e(e), env(env) {}
+int poolString(const std::string &s) {
+    auto &table = poolIndex().strings;
+    auto it = table.find(s);
+    if (it != table.end()) return it->second;
+    return table[s] = pool(StringV(s));
+}
 
-void Procedure::show(std::ostream &os) {
-    os << "#<procedure>";
+int poolSymbol(SymbolId s) {
+    auto &table = poolIndex().symbols;
+    auto it = table.find(s);
+    if (it != table.end()) return it->second;
+    return table[s] = pool(SymbolV(s));
+}
+
+int poolBignum(const BigInt &n) {
+    auto &table = poolIndex().bignums[n.neg];
+    auto it = table.find(n.mag);
+    if (it != table.end()) return it->second;
+    return table[n.mag] = pool(IntegerV(n));
+}
+
+int poolRational(long long num, long long den) {
+    Value v = RationalV(num, den);
+    Rational *r = static_cast<Rational *>(v.get());
+    r->normalize();
+    auto &table = poolIndex().rationals;
+    std::pair<long long, long long> key(r->numerator, r->denominator);
+    auto it = table.find(key);
+    if (it != table.end()) return it->second;
+    return table[key] = pool(v);
+}
+
+int poolPair(int car, int cdr) {
+    return pool(PairV(pooled(car), pooled(cdr)));
 }
 
-Value ProcedureV(const std::vector<std::string> &xs, const Expr &e, const Assoc &env) {
-    return Value(new Procedure(xs, e, env));
+int poolValue(const Value &v) {
+    return pool(v);
 }
 
 // ============================================================================
 // Utility Functions Implementation
 // ============================================================================
 
-std::ostream &operator<<(std::ostream &os, Value &v) {
-    v->show(os);
+std::ostream &operator<<(std::ostream &os, const Value &v) {
+    v.show(os);
     return os;
 }
@@ -11,121 +11,380 @@
 
 #include "Def.hpp"
 #include "expr.hpp"
+#include "gc.hpp"
+#include "alloc.hpp"
+#include "bigint.hpp"
 #include <memory>
 #include <cstring>
 #include <vector>
+#include <cstdint>
 
 // ============================================================================
 // Base classes and smart pointer wrappers
 // ============================================================================
 
 /**
- * @brief Base class for all values in the Scheme interpreter
+ * @brief Base class for all heap-allocated values in the Scheme interpreter
  */
-struct ValueBase {
+struct ValueBase : Collectable {
     ValueType v_type;
     ValueBase(ValueType);
+    static void *operator new(size_t n) { return slabAlloc(n); }
+    static void operator delete(void *p, size_t n) { slabFree(p, n); }
     virtual void show(std::ostream &) = 0;
     virtual void showCdr(std::ostream &);
     virtual ~ValueBase() = default;
 };
 
 /**
- * @brief Smart pointer wrapper for ValueBase objects
+ * @brief Tagged value word
+ *
+ * Integers, booleans, (), void and the termination signal live inline in
+ * the word; every other value is a pointer to a reference-counted
+ * ValueBase. Layout of `bits`:
+ *   ...nnnn1   integer n, shifted left by one
+ *   ...pt10    immediate of ValueType t (6 bits) with payload p (bits >> 8)
+ *   ...xxx00   ValueBase pointer; 0 is "no value", e.g. an unbound slot
  */
 struct Value {
-    std::shared_ptr<ValueBase> ptr;
+    uintptr_t bits;
     Value(ValueBase *);
-    void show(std::ostream &);
+    Value(const Value &);
+    Value(Value &&);
+    Value &operator=(const Value &);
+    Value &operator=(Value &&);
+    ~Value();
+    ValueType type() const;
+    bool boxed() const;
+    bool unbound() const;
+    bool isFalse() const;
+    int asInt() const;
+    bool asBool() const;
+    void show(std::ostream &) const;
+    void showCdr(std::ostream &) const;
     ValueBase* operator->() const;
     ValueBase& operator*();
     ValueBase* get() const;
+    static Value fromBits(uintptr_t);
+private:
+    Value() {}
 };
 
+// The word operations are on every evaluation path, so they are inline
+
+inline bool Value::boxed() const {
+    return (bits & 3) == 0 && bits != 0;
+}
+
+inline Value::Value(ValueBase *p) : bits(reinterpret_cast<uintptr_t>(p)) {
+    if (p != nullptr) ++p->refs;
+}
+
+inline Value::Value(const Value &other) : bits(other.bits) {
+    if (boxed()) ++get()->refs;
+}
+
+inline Value::Value(Value &&other) : bits(other.bits) {
+    other.bits = 0;
+}
+
+inline Value &Value::operator=(const Value &other) {
+    if (other.boxed()) ++other.get()->refs;
+    Value old;
+    old.bits = bits;
+    bits = other.bits;
+    return *this;
+}
+
+inline Value &Value::operator=(Value &&other) {
+    if (this != &other) {
+        Value old;
+        old.bits = bits;
+        bits = other.bits;
+        other.bits = 0;
+    }
+    return *this;
+}
+
+inline Value::~Value() {
+    if (boxed() && --get()->refs == 0) delete get();
+}
+
+inline Value Value::fromBits(uintptr_t b) {
+    Value v;
+    v.bits = b;
+    return v;
+}
+
+inline ValueType Value::type() const {
+    if (bits & 1) return V_INT;
+    if (bits & 2) return (ValueType)((bits >> 2) & 0x3f);
+    return get()->v_type;
+}
+
+inline bool Value::unbound() const {
+    return bits == 0;
+}
+
+inline int Value::asInt() const {
+    return (int)((intptr_t)bits >> 1);
+}
+
+inline bool Value::asBool() const {
+    return (bits >> 8) != 0;
+}
+
+inline ValueBase* Value::operator->() const {
+    return reinterpret_cast<ValueBase *>(bits);
+}
+
+inline ValueBase& Value::operator*() {
+    return *get();
+}
+
+inline ValueBase* Value::get() const {
+    return reinterpret_cast<ValueBase *>(bits);
+}
+
 // ============================================================================
-// Environment (Association Lists)
+// Environment (Frames)
 // ============================================================================
 
 /**
- * @brief Smart pointer wrapper for AssocList (Environment)
+ * @brief Reference-counted handle to a Frame (Environment)
  */
 struct Assoc {
-    std::shared_ptr<AssocList> ptr;
-    Assoc(AssocList *);
-    AssocList* operator->() const;
-    AssocList& operator*();
-    AssocList* get() const;
+    Frame *ptr;
+    Assoc(Frame *);
+    Assoc(const Assoc &);
+    Assoc(Assoc &&);
+    Assoc &operator=(const Assoc &);
+    Assoc &operator=(Assoc &&);
+    ~Assoc();
+    Frame* operator->() const;
+    Frame& operator*();
+    Frame* get() const;
 };
 
 /**
- * @brief Association list node for variable bindings
+ * @brief Activation frame holding every binding of one contour
+ *
+ * The slots live in the same allocation, right after the header, so
+ * entering a lambda, let or letrec costs a single allocation. Slots are
+ * addressed by the (depth, slot) pairs computed at parse time; an unbound
+ * slot is a binding whose definition has not been evaluated yet.
  */
-struct AssocList {
-    std::string x;      ///< Variable name
-    Value v;            ///< Variable value
-    Assoc next;         ///< Next binding in the chain
-    AssocList(const std::string &, const Value &, Assoc &);
+struct Frame : Collectable {
+    int size;           ///< Number of slots
+    Assoc parent;       ///< Enclosing frame
+    Value *slots();
+    static Frame *make(int, const Assoc &);
+    static void release(Frame *);
+    virtual void trace(Tracer &) override;
+    virtual void clear() override;
+    virtual void destroy() override;
+    virtual ~Frame();
+private:
+    Frame(int, const Assoc &);
 };
 
+// Handles are copied with every frame an evaluator keeps, so they are inline too
+
+inline Assoc::Assoc(Frame *x) : ptr(x) {
+    if (ptr != nullptr) ++ptr->refs;
+}
+
+inline Assoc::Assoc(const Assoc &other) : ptr(other.ptr) {
+    if (ptr != nullptr) ++ptr->refs;
+}
+
+inline Assoc::Assoc(Assoc &&other) : ptr(other.ptr) {
+    other.ptr = nullptr;
+}
+
+inline Assoc &Assoc::operator=(const Assoc &other) {
+    if (other.ptr != nullptr) ++other.ptr->refs;
+    Frame *old = ptr;
+    ptr = other.ptr;
+    if (old != nullptr && --old->refs == 0) Frame::release(old);
+    return *this;
+}
+
+inline Assoc &Assoc::operator=(Assoc &&other) {
+    if (this != &other) {
+        Frame *old = ptr;
+        ptr = other.ptr;
+        other.ptr = nullptr;
+        if (old != nullptr && --old->refs == 0) Frame::release(old);
+    }
+    return *this;
+}
+
+inline Assoc::~Assoc() {
+    if (ptr != nullptr && --ptr->refs == 0) Frame::release(ptr);
+}
+
+inline Frame* Assoc::operator->() const {
+    return ptr;
+}
+
+inline Frame& Assoc::operator*() {
+    return *ptr;
+}
+
+inline Frame* Assoc::get() const {
+    return ptr;
+}
+
+// References the collector follows
+inline void visit(Tracer &t, const Value &v) {
+    if (v.boxed()) t.visit(v.get());
+}
+
+inline void visit(Tracer &t, const Assoc &a) {
+    if (a.get() != nullptr) t.visit(a.get());
+}
+
 // Environment operations
 Assoc empty();
-Assoc extend(const std::string&, const Value &, Assoc &);
-void modify(const std::string&, const Value &, Assoc &);
-Value find(const std::string &, Assoc &);
-
-// ============================================================================
-// Simple Value Types
-// ============================================================================
+Assoc extend(int, const Assoc &);
+Value &locate(int, int, Assoc &);
 
 /**
- * @brief Void value (represents no meaningful return value)
+ * @brief Binding cell of a top-level variable
+ *
+ * Each interned name owns at most one cell, created on first mention. Cells
+ * never move, so the parser links each global reference to its cell once
+ * and the evaluator only dereferences it.
  */
-struct Void : ValueBase {
-    Void();
-    virtual void show(std::ostream &) override;
+struct GlobalCell {
+    SymbolId name;
+    Value v;            ///< Unbound while the variable is undefined
+    GlobalCell(SymbolId);
 };
-Value VoidV();
+
+GlobalCell *globalCell(SymbolId);
+
+// ============================================================================
+// Immediate Value Types
+// ============================================================================
+
+// Encodings of the inline values, see Value; none of them allocates
+
+inline Value ImmediateV(ValueType t, uintptr_t payload) {
+    return Value::fromBits(payload << 8 | (uintptr_t)t << 2 | 2);
+}
+
+inline Value IntegerV(int n) {
+    return Value::fromBits((uintptr_t)(intptr_t)n << 1 | 1);
+}
+
+inline Value BooleanV(bool b) {
+    return ImmediateV(V_BOOL, b);
+}
+
+inline Value VoidV() {
+    return ImmediateV(V_VOID, 0);
+}
+
+inline Value NullV() {
+    return ImmediateV(V_NULL, 0);
+}
+
+inline Value TerminateV() {
+    return ImmediateV(V_TERMINATE, 0);
+}
+
+inline bool Value::isFalse() const {
+    return bits == BooleanV(false).bits;
+}
+
+// ============================================================================
+// Heap Value Types
+// ============================================================================
 
 /**
- * @brief Integer value
+ * @brief Integer value outside the fixnum range
+ * Arithmetic only builds one when a result does not fit in a fixnum, and
+ * IntegerV(const BigInt &) turns results back into fixnums when they fit,
+ * so a Bignum is never a fixnum in disguise.
  */
-struct Integer : ValueBase {
-    int n;
-    Integer(int);
+struct Bignum : ValueBase {
+    BigInt n;
+    Bignum(const BigInt &);
     virtual void show(std::ostream &) override;
 };
-Value IntegerV(int);
+Value IntegerV(const BigInt &);
 
 /**
  * @brief Rational number value
+ * Arithmetic leaves its results in whatever terms they come out in, as
+ * long as they fit, and reduces them only where it pays: when they are
+ * shown, stored in a global, or about to overflow.
  */
 struct Rational : ValueBase {
-    int numerator;
-    int denominator;
-    Rational(int, int);
+    long long numerator;
+    long long denominator;  ///< Always positive
+    Rational(long long, long long);
+    void normalize();       ///< Reduces to lowest terms, in place
     virtual void show(std::ostream &) override;
 };
-Value RationalV(int, int);
+Value RationalV(long long, long long);
 
 /**
- * @brief Boolean value
+ * @brief Rational number whose terms do not fit in 64 bits
+ * Always in lowest terms, with a denominator above 1.
  */
-struct Boolean : ValueBase {
-    bool b;
-    Boolean(bool);
+struct BigRational : ValueBase {
+    BigInt numerator;
+    BigInt denominator;
+    BigRational(const BigInt &, const BigInt &);
     virtual void show(std::ostream &) override;
 };
-Value BooleanV(bool);
+Value BigRationalV(const BigInt &, const BigInt &);
+
+inline int trailingZeros(unsigned long long x) {
+    return __builtin_ctzll(x);
+}
+
+inline int trailingZeros(unsigned __int128 x) {
+    uint64_t low = (uint64_t)x;
+    return low != 0 ? __builtin_ctzll(low) : 64 + __builtin_ctzll((uint64_t)(x >> 64));
+}
+
+/// Binary GCD: shifts and subtractions only, no division
+template <typename T>
+T binaryGcd(T a, T b) {
+    if (a == 0) return b;
+    if (b == 0) return a;
+    int shift = trailingZeros(a | b);
+    a >>= trailingZeros(a);
+    do {
+        b >>= trailingZeros(b);
+        if (a > b) {
+            T t = a;
+            a = b;
+            b = t;
+        }
+        b -= a;
+    } while (b != 0);
+    return a << shift;
+}
+
+/// Reduces a rational on its way into long-lived storage
+inline void settle(const Value &v) {
+    if (v.type() == V_RATIONAL) static_cast<Rational *>(v.get())->normalize();
+}
 
 /**
  * @brief Symbol value
  */
 struct Symbol : ValueBase {
-    std::string s;
-    Symbol(const std::string &);
+    SymbolId s;
+    Symbol(SymbolId);
     virtual void show(std::ostream &) override;
 };
-Value SymbolV(const std::string &);
+Value SymbolV(SymbolId);
 
 /**
  * @brief String value
@@ -138,60 +397,137 @@ struct String : ValueBase {
 Value StringV(const std::string &);
 
 // ============================================================================
-// Special Value Types
+// Composite Value Types
 // ============================================================================
 
 /**
- * @brief Null value (empty list)
+ * @brief Pair value (cons cell)
  */
-struct Null : ValueBase {
-    Null();
+struct Pair : ValueBase {
+    Value car;  ///< First element
+    Value cdr;  ///< Second element
+    Pair(const Value &, const Value &);
+    ~Pair();
+    virtual void trace(Tracer &) override;
+    virtual void clear() override;
     virtual void show(std::ostream &) override;
     virtual void showCdr(std::ostream &) override;
 };
-Value NullV();
+Value PairV(const Value &, const Value &);
 
 /**
- * @brief Termination signal value
+ * @brief Procedure (function) value
  */
-struct Terminate : ValueBase {
-    Terminate();
+struct Procedure : ValueBase {
+    std::vector<SymbolId> parameters;      ///< Parameter names
+    int locals;                            ///< Internal defines, bound after the parameters
+    Expr e;                                ///< Function body expression
+    Assoc env;                             ///< Captured variables, parent of each call frame
+    std::vector<int> boxed;                ///< Call frame slots to box, see Lambda
+    std::shared_ptr<Chunk> code;           ///< Compiled body, for closures made by the VM
+    Procedure(const std::vector<SymbolId> &, const Expr &, const Assoc &, int = 0,
+              const std::vector<int> & = std::vector<int>());
+    virtual void trace(Tracer &) override;
+    virtual void clear() override;
     virtual void show(std::ostream &) override;
 };
-Value TerminateV();
+Value ProcedureV(const std::vector<SymbolId> &, const Expr &, const Assoc &, int = 0,
+                 const std::vector<int> & = std::vector<int>());
 
-// ============================================================================
-// Composite Value Types
-// ============================================================================
+/**
+ * @brief Entry point of a primitive called as a procedure
+ * The arity has been checked by the caller.
+ */
+typedef Value (*PrimitiveEntry)(const std::vector<Value> &);
 
 /**
- * @brief Pair value (cons cell)
+ * @brief A primitive used as a value, e.g. car in (map car xs)
+ * Called straight through its entry point, without building a frame.
+ * call/cc has no entry point: capturing the continuation is up to each
+ * engine, which checks for it before calling.
  */
-struct Pair : ValueBase {
-    Value car;  ///< First element
-    Value cdr;  ///< Second element
-    Pair(const Value &, const Value &);
+struct PrimitiveProcedure : ValueBase {
+    ExprType op;            ///< The primitive, as in the primitives table
+    PrimitiveEntry fn;      ///< nullptr for call/cc
+    int min_args;
+    int max_args;           ///< -1 if unbounded
+    PrimitiveProcedure(ExprType, PrimitiveEntry, int, int);
+    bool accepts(size_t argc) const;
     virtual void show(std::ostream &) override;
-    virtual void showCdr(std::ostream &) override;
 };
-Value PairV(const Value &, const Value &);
+Value PrimitiveProcedureV(ExprType, PrimitiveEntry, int, int);
+
+inline bool PrimitiveProcedure::accepts(size_t argc) const {
+    return argc >= (size_t)min_args && (max_args < 0 || argc <= (size_t)max_args);
+}
+
+/// Whether v can be applied: a closure, a primitive or a continuation
+inline bool isProcedure(const Value &v) {
+    ValueType t = v.type();
+    return t == V_PROC || t == V_PRIMITIVE || t == V_CONTINUATION;
+}
 
 /**
- * @brief Procedure (function) value
+ * @brief Storage of a local that closures capture and the program assigns
+ * Never seen by programs: the frame slot and every capture hold the box,
+ * and references to the variable read and write through it.
  */
-struct Procedure : ValueBase {
-    std::vector<std::string> parameters;   ///< Parameter names
-    Expr e;                                ///< Function body expression
-    Assoc env;                             ///< Closure environment
-    Procedure(const std::vector<std::string> &, const Expr &, const Assoc &);
+struct Box : ValueBase {
+    Value v;
+    Box(const Value &);
+    virtual void trace(Tracer &) override;
+    virtual void clear() override;
     virtual void show(std::ostream &) override;
 };
-Value ProcedureV(const std::vector<std::string> &, const Expr &, const Assoc &);
+Value BoxV(const Value &);
+
+/// The storage of a local binding: its slot, or the box the slot holds
+inline Value &binding(Value &slot, bool boxed) {
+    return boxed ? static_cast<Box *>(slot.get())->v : slot;
+}
+
+void boxSlots(const Assoc &, const std::vector<int> &);
+
+/**
+ * @brief Continuation captured by call/cc
+ * Each engine derives its own representation of the captured control state.
+ */
+struct Continuation : ValueBase {
+    Continuation();
+    virtual void show(std::ostream &) override;
+};
+
+// ============================================================================
+// Constant Pool
+// ============================================================================
+
+/**
+ * @brief Values of the program's literals, built once at parse time
+ *
+ * A literal node keeps the index of its value here, so evaluating it just
+ * shares that value. Equal atoms (strings, symbols, numbers) are pooled
+ * once, wherever they occur. Pairs are not: each quotation gets its own
+ * list structure, since distinct quotations must not be eq?. Never
+ * destroyed, like the heap registry.
+ */
+extern std::vector<Value> *constant_pool;
+
+inline const Value &pooled(int i) {
+    return (*constant_pool)[i];
+}
+
+int poolImmediate(const Value &);   ///< Fixnums, booleans, ()
+int poolString(const std::string &);
+int poolSymbol(SymbolId);
+int poolBignum(const BigInt &);
+int poolRational(long long, long long);
+int poolPair(int car, int cdr);    ///< Always a new pair
+int poolValue(const Value &);       ///< A datum built elsewhere, always a new entry
 
 // ============================================================================
 // Utility Functions
 // ============================================================================
 
-std::ostream &operator<<(std::ostream &, Value &);
+std::ostream &operator<<(std::ostream &, const Value &);
 
 #endif // VALUE
\ No newline at end of file
@@ -0,0 +1,354 @@
+/**
+ * @file vm.cpp
+ * @brief Stack virtual machine running compiled chunks
+ *
+ * The interpreter loop keeps the running activation (chunk, pc, frame) in
+ * locals and saves it on an explicit call stack only around non-tail calls,
+ * so neither deep recursion nor long tail loops grow the C++ stack.
+ *
+ * call/cc seals the value and call stacks into a segment shared with the
+ * continuation, and the machine goes on with empty ones above it. Returning
+ * past their bottom brings the segment back, stolen if nothing else holds
+ * it and copied otherwise, so a capture costs what was pushed since the
+ * last one, as in the CEK machine.
+ */
+
+#include "vm.hpp"
+#include "RE.hpp"
+
+namespace {
+
+/**
+ * @brief Saved state of a caller waiting for a non-tail call to return
+ */
+struct Activation {
+    const Chunk *chunk;
+    const Instr *pc;
+    Assoc env;
+    Value proc;         ///< Keeps the caller's chunk alive
+};
+
+/**
+ * @brief Stacks sealed by a call/cc, owned by whoever refers to it: the
+ * machine (for the one under its live stacks), the segment above it, and
+ * continuations
+ */
+struct Segment : Collectable {
+    Segment *next;          ///< Older values and callers
+    std::vector<Value> stack;
+    std::vector<Activation> calls;
+    explicit Segment(Segment *next) : next(next) { refs = 1; }
+    void trace(Tracer &t) override;
+    void clear() override;
+};
+
+void release(Segment *s) {
+    while (s != nullptr && --s->refs == 0) {
+        Segment *next = s->next;
+        delete s;
+        s = next;
+    }
+}
+
+void Segment::trace(Tracer &t) {
+    if (next != nullptr) t.visit(next);
+    for (const Value &v : stack) visit(t, v);
+    for (const Activation &a : calls) {
+        visit(t, a.env);
+        visit(t, a.proc);
+    }
+}
+
+void Segment::clear() {
+    stack.clear();
+    calls.clear();
+    release(next);
+    next = nullptr;
+}
+
+/**
+ * @brief The sealed stacks at a call/cc; resuming returns a value to the
+ * innermost caller in them, which is the call/cc's, so it can be resumed
+ * any number of times, including after the call/cc has returned
+ */
+struct VMContinuation : Continuation {
+    Segment *seg;
+    std::shared_ptr<Chunk> top;     ///< The top-level form the bottom activation runs
+    VMContinuation(Segment *seg, const std::shared_ptr<Chunk> &top) : seg(seg), top(top) {}
+    ~VMContinuation() { release(seg); }
+    void trace(Tracer &t) override {
+        if (seg != nullptr) t.visit(seg);
+    }
+    void clear() override {
+        release(seg);
+        seg = nullptr;
+    }
+};
+
+/// The segment under the machine's live stacks, released however execute ends
+struct Sealed {
+    Segment *seg = nullptr;
+    ~Sealed() { release(seg); }
+};
+
+// Where the machine goes to return the value on top of its stack, when the
+// activation that would run on has been sealed or replaced
+const Instr return_op{OP_RETURN, 0, 0};
+
+Value pop(std::vector<Value> &stack) {
+    Value v = std::move(stack.back());
+    stack.pop_back();
+    return v;
+}
+
+} // namespace
+
+Value execute(const std::shared_ptr<Chunk> &form, Assoc &top_env) {
+    std::shared_ptr<Chunk> top = form;
+    std::vector<Value> stack;
+    std::vector<Activation> calls;
+    const Chunk *chunk = top.get();
+    const Instr *pc = chunk->code.data();
+    Assoc env = top_env;
+    Value proc(nullptr);
+    Sealed below;
+
+    // Moves the live stacks into a segment for a continuation; a non-tail
+    // call/cc first saves the current activation as the one to resume
+    auto capture = [&](bool tail) {
+        if (!tail) calls.push_back(Activation{chunk, pc, std::move(env), std::move(proc)});
+        Segment *seg = new Segment(below.seg);
+        seg->stack.swap(stack);
+        seg->calls.swap(calls);
+        ++seg->refs;
+        below.seg = seg;
+        pc = &return_op;
+        return Value(new VMContinuation(seg, top));
+    };
+
+    // Brings back the stacks under the live ones, which hold no callers and
+    // only the value being returned
+    auto underflow = [&]() {
+        Segment *seg = below.seg;
+        Value v = pop(stack);
+        if (seg->refs == 1) {
+            stack.swap(seg->stack);
+            calls.swap(seg->calls);
+            below.seg = seg->next;
+            seg->next = nullptr;
+            delete seg;
+        } else {
+            // Shared with a continuation: work on a copy
+            stack = seg->stack;
+            calls = seg->calls;
+            below.seg = seg->next;
+            if (below.seg != nullptr) ++below.seg->refs;
+            --seg->refs;
+        }
+        stack.push_back(std::move(v));
+    };
+
+    // Calls the procedure below the top argc values, either by entering
+    // its chunk or, for primitives and continuations, right away
+    auto call = [&](int argc, bool tail) {
+        for (;;) {
+            size_t base = stack.size() - argc - 1;
+            Value f = std::move(stack[base]);
+            if (f.type() == V_PRIMITIVE) {
+                PrimitiveProcedure *prim = static_cast<PrimitiveProcedure *>(f.get());
+                if (!prim->accepts(argc)) throw RuntimeError("Wrong number of arguments");
+                if (prim->fn == nullptr) {
+                    // call/cc as a value: as OP_CALLCC, resuming after this call
+                    Value receiver = std::move(stack.back());
+                    stack.erase(stack.begin() + base, stack.end());
+                    if (!isProcedure(receiver)) throw RuntimeError("Attempt to apply a non-procedure");
+                    Value k = capture(tail);
+                    stack.push_back(std::move(receiver));
+                    stack.push_back(std::move(k));
+                    argc = 1;
+                    tail = true;
+                    continue;
+                }
+                std::vector<Value> args(std::make_move_iterator(stack.begin() + base + 1),
+                                        std::make_move_iterator(stack.end()));
+                stack.erase(stack.begin() + base, stack.end());
+                stack.push_back(prim->fn(args));
+                return;
+            }
+            if (f.type() == V_CONTINUATION) {
+                VMContinuation *k = dynamic_cast<VMContinuation *>(f.get());
+                if (k == nullptr) throw RuntimeError("continuation can no longer be resumed");
+                if (argc != 1) throw RuntimeError("Wrong number of arguments");
+                Value v = std::move(stack.back());
+                stack.clear();
+                calls.clear();
+                ++k->seg->refs;
+                release(below.seg);
+                below.seg = k->seg;
+                top = k->top;
+                stack.push_back(std::move(v));
+                pc = &return_op;
+                return;
+            }
+            Procedure *clos = static_cast<Procedure *>(f.get());
+            if ((size_t)argc != clos->parameters.size()) throw RuntimeError("Wrong number of arguments");
+
+            Assoc frame = extend(argc + clos->locals, clos->env);
+            Value *slots = frame->slots();
+            for (int i = 0; i < argc; ++i) slots[i] = std::move(stack[base + 1 + i]);
+            stack.erase(stack.begin() + base, stack.end());
+            if (!clos->boxed.empty()) boxSlots(frame, clos->boxed);
+            gcSafePoint();
+
+            if (!tail) calls.push_back(Activation{chunk, pc, std::move(env), std::move(proc)});
+            chunk = clos->code.get();
+            pc = chunk->code.data();
+            env = std::move(frame);
+            proc = std::move(f);
+            return;
+        }
+    };
+
+    for (;;) {
+        const Instr &in = *pc++;
+        switch (in.op) {
+            case OP_CONST:
+                stack.push_back(chunk->consts[in.a]);
+                break;
+            case OP_EVAL:
+                stack.push_back(chunk->nodes[in.a]->eval(env));
+                break;
+            case OP_LOCAL: {
+                Value &v = locate(in.a, in.b, env);
+                if (v.unbound()) throw RuntimeError("variable used before its definition");
+                stack.push_back(v);
+                break;
+            }
+            case OP_GLOBAL: {
+                const Value &v = chunk->cells[in.a]->v;
+                // An unbound cell may still name a primitive; Var knows how to wrap it
+                if (v.unbound()) stack.push_back(chunk->nodes[in.b]->eval(env));
+                else stack.push_back(v);
+                break;
+            }
+            case OP_STORE_LOCAL:
+                locate(in.a, in.b, env) = pop(stack);
+                break;
+            case OP_STORE_BOX:
+                binding(locate(in.a, in.b, env), true) = pop(stack);
+                break;
+            case OP_UNBOX: {
+                Value v = static_cast<Box *>(stack.back().get())->v;
+                if (v.unbound()) throw RuntimeError("variable used before its definition");
+                stack.back() = std::move(v);
+                break;
+            }
+            case OP_BOX: {
+                Value &slot = env->slots()[in.a];
+                slot = BoxV(slot);
+                break;
+            }
+            case OP_STORE_GLOBAL:
+                settle(stack.back());
+                chunk->cells[in.a]->v = pop(stack);
+                break;
+            case OP_DECLARE:
+                chunk->cells[in.a]->v = VoidV();
+                break;
+            case OP_CHECK_SET: {
+                Set *s = static_cast<Set *>(chunk->nodes[in.a].get());
+                const Value &target = s->local ? binding(locate(s->depth, s->slot, env), s->boxed) : s->cell->v;
+                if (target.unbound()) throw RuntimeError("set!: undefined variable");
+                break;
+            }
+            case OP_POP:
+                stack.pop_back();
+                break;
+            case OP_JUMP:
+                pc = chunk->code.data() + in.a;
+                break;
+            case OP_JUMP_IF_FALSE:
+                if (pop(stack).isFalse()) pc = chunk->code.data() + in.a;
+                break;
+            case OP_AND_JUMP:
+                if (stack.back().isFalse()) pc = chunk->code.data() + in.a;
+                else stack.pop_back();
+                break;
+            case OP_OR_JUMP:
+                if (!stack.back().isFalse()) pc = chunk->code.data() + in.a;
+                else stack.pop_back();
+                break;
+            case OP_PRIM1: {
+                Unary *u = static_cast<Unary *>(chunk->nodes[in.a].get());
+                stack.back() = u->evalRator(stack.back());
+                break;
+            }
+            case OP_PRIM2: {
+                Binary *b = static_cast<Binary *>(chunk->nodes[in.a].get());
+                Value rhs = pop(stack);
+                stack.back() = b->operate(stack.back(), rhs);
+                break;
+            }
+            case OP_PRIMN: {
+                Variadic *v = static_cast<Variadic *>(chunk->nodes[in.a].get());
+                std::vector<Value> args(std::make_move_iterator(stack.end() - in.b),
+                                        std::make_move_iterator(stack.end()));
+                stack.erase(stack.end() - in.b, stack.end());
+                stack.push_back(v->evalRator(args));
+                break;
+            }
+            case OP_CLOSURE: {
+                Value clos = chunk->nodes[in.a]->eval(env);
+                static_cast<Procedure *>(clos.get())->code = chunk->chunks[in.b];
+                stack.push_back(std::move(clos));
+                break;
+            }
+            case OP_CHECK_PROC:
+                if (!isProcedure(stack.back()))
+                    throw RuntimeError("Attempt to apply a non-procedure");
+                break;
+            case OP_CALLCC: {
+                if (!isProcedure(stack.back()))
+                    throw RuntimeError("Attempt to apply a non-procedure");
+                // The continuation resumes right after this instruction
+                Value receiver = pop(stack);
+                Value k = capture(false);
+                stack.push_back(std::move(receiver));
+                stack.push_back(std::move(k));
+                call(1, true);
+                break;
+            }
+            case OP_CALL:
+                call(in.a, false);
+                break;
+            case OP_TAIL_CALL:
+                call(in.a, true);
+                break;
+            case OP_ENTER: {
+                Assoc frame = extend(in.a + in.b, env);
+                Value *slots = frame->slots();
+                size_t base = stack.size() - in.a;
+                for (int i = 0; i < in.a; ++i) slots[i] = std::move(stack[base + i]);
+                stack.erase(stack.begin() + base, stack.end());
+                env = std::move(frame);
+                break;
+            }
+            case OP_LEAVE: {
+                Assoc up = env->parent;
+                env = std::move(up);
+                break;
+            }
+            case OP_RETURN: {
+                while (calls.empty() && below.seg != nullptr) underflow();
+                if (calls.empty()) return pop(stack);
+                Activation &caller = calls.back();
+                chunk = caller.chunk;
+                pc = caller.pc;
+                env = std::move(caller.env);
+                proc = std::move(caller.proc);
+                calls.pop_back();
+                break;
+            }
+        }
+    }
+}
@@ -0,0 +1,71 @@
+#ifndef VM_HPP
+#define VM_HPP
+
+/**
+ * @file vm.hpp
+ * @brief Bytecode compiler and stack virtual machine
+ *
+ * An alternative execution engine to the tree walker in evaluation.cpp. The
+ * parsed Expr tree is flattened into a linear instruction sequence per lambda
+ * body (a Chunk), which the VM runs with an explicit value stack and call
+ * stack. Environments, values and primitives are shared with the tree walker,
+ * so both engines produce the same results.
+ */
+
+#include "Def.hpp"
+#include "expr.hpp"
+#include "value.hpp"
+#include <memory>
+#include <vector>
+
+enum OpCode {
+    OP_CONST,           ///< push consts[a]
+    OP_EVAL,            ///< push nodes[a]->eval(env) (literals that allocate, quote)
+    OP_LOCAL,           ///< push the slot at depth a, index b
+    OP_GLOBAL,          ///< push cells[a], falling back to Var nodes[b] if unbound
+    OP_STORE_LOCAL,     ///< pop into the slot at depth a, index b
+    OP_STORE_BOX,       ///< pop into the box held by the slot at depth a, index b
+    OP_UNBOX,           ///< replace the box on top by its contents
+    OP_BOX,             ///< put slot a of the current frame into a new box
+    OP_STORE_GLOBAL,    ///< pop into cells[a]
+    OP_DECLARE,         ///< bind cells[a] to void
+    OP_CHECK_SET,       ///< throw unless the target of Set nodes[a] is bound
+    OP_POP,             ///< drop the top of the stack
+    OP_JUMP,            ///< pc = a
+    OP_JUMP_IF_FALSE,   ///< pop; pc = a if it was #f
+    OP_AND_JUMP,        ///< if top is #f keep it and pc = a, else pop
+    OP_OR_JUMP,         ///< if top is not #f keep it and pc = a, else pop
+    OP_PRIM1,           ///< apply Unary nodes[a] to the top value
+    OP_PRIM2,           ///< apply Binary nodes[a] to the top two values
+    OP_PRIMN,           ///< apply Variadic nodes[a] to the top b values
+    OP_CLOSURE,         ///< push a closure of Lambda nodes[a] with body chunks[b]
+    OP_CHECK_PROC,      ///< throw unless the top value is a procedure
+    OP_CALL,            ///< call the procedure below the top a arguments
+    OP_TAIL_CALL,       ///< as OP_CALL, replacing the current activation
+    OP_CALLCC,          ///< call the procedure on top with the current continuation
+    OP_ENTER,           ///< push a frame of a + b slots, popping a values into it
+    OP_LEAVE,           ///< return to the enclosing frame
+    OP_RETURN           ///< return the top value to the caller
+};
+
+struct Instr {
+    OpCode op;
+    int a;
+    int b;
+};
+
+/**
+ * @brief Compiled code of one lambda body (or one top-level form)
+ */
+struct Chunk {
+    std::vector<Instr> code;
+    std::vector<Value> consts;                    ///< Immediate constants
+    std::vector<Expr> nodes;                      ///< Expr operands of instructions
+    std::vector<GlobalCell *> cells;              ///< Global variables referenced
+    std::vector<std::shared_ptr<Chunk>> chunks;   ///< Bodies of nested lambdas
+};
+
+std::shared_ptr<Chunk> compile(const Expr &);
+Value execute(const std::shared_ptr<Chunk> &, Assoc &);
+
+#endif
@@ -0,0 +1,63 @@
+#!/bin/bash
+# usage: deep_nesting.sh <code binary> <-O level>
+# Programs nested 10^6 levels deep must get through the reader, parser,
+# optimizer and compiler, and be freed, on every engine. Only --vm and
+# --cek also run the deep function: the tree walker evaluates on the C++
+# stack by design.
+BIN=$1
+OPT=$2
+N=1000000
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# (define (g x) (+ x (if x (begin x (+ x ... x) 0)))), N forms deep
+awk -v n=$N 'BEGIN {
+  printf "(define (g x) ";
+  for (i = 0; i < n; ++i) printf (i % 3 == 0 ? "(+ x " : i % 3 == 1 ? "(if x " : "(begin x ");
+  printf "x";
+  for (i = n - 1; i >= 0; --i) printf (i % 3 == 1 ? " 0)" : ")");
+  printf ")\n";
+}' > "$dir/g.scm"
+awk -v n=$N 'BEGIN {
+  printf "(define d '\''";
+  for (i = 0; i < n; ++i) printf "(";
+  for (i = 0; i < n; ++i) printf ")";
+  printf ")\n(pair? d)\n(define q ";
+  for (i = 0; i < n; ++i) printf "'\''";
+  printf "a)\n(car q)\n(define r (read))\n";
+  for (i = 0; i < n; ++i) printf "(";
+  for (i = 0; i < n; ++i) printf ")";
+  printf "\n(set! r 0)\n(define d 0)\n";
+}' > "$dir/data.scm"
+plus=$(( (N + 2) / 3 ))
+
+status=0
+check() {
+  local name=$1 expected=$2 engine=$3
+  shift 3
+  cat "$@" <(echo "(exit)") | "$BIN" $OPT $engine > "$dir/out"
+  code=$?
+  out=$(sed 's/scm> //g' "$dir/out")
+  if [ $code != 0 ] || [ "$out" != "$expected" ]; then
+    echo "deep $name, $OPT ${engine:-tree walker}: got"
+    echo "$out" | head -c 300
+    echo "(exit status $code)"
+    status=1
+  fi
+}
+for engine in "" --vm --cek; do
+  check data 'd
+#t
+q
+quote
+r
+
+d' "$engine" "$dir/data.scm"
+  check "function, freed" 'g
+g' "$engine" "$dir/g.scm" <(echo "(define g 0)")
+done
+for engine in --vm --cek; do
+  check "function, called" "g
+$((plus + 1))" "$engine" "$dir/g.scm" <(echo "(g 1)")
+done
+exit $status
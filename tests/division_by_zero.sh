@@ -0,0 +1,40 @@
+#!/bin/bash
+# usage: division_by_zero.sh <code binary> <-O level>
+# Dividing by zero is a RuntimeError, for fixnums, bignums and rationals
+# alike, whether it happens at run time or while the optimizer folds it.
+BIN=$1
+OPT=$2
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+expected='RuntimeError
+RuntimeError
+RuntimeError
+RuntimeError
+RuntimeError
+RuntimeError
+x
+RuntimeError
+1'
+status=0
+for engine in "" --vm --cek; do
+  printf '%s\n' \
+      '(/ 1 0)' \
+      '(modulo 7 0)' \
+      '(/ (expt 10 20) 0)' \
+      '(modulo (expt 10 20) 0)' \
+      '(modulo (- (expt 10 20)) 0)' \
+      '(/ 1/2 0)' \
+      '(define x (expt 10 20))' \
+      '(modulo x (- x x))' \
+      '1' \
+      '(exit)' | "$BIN" $OPT $engine > "$dir/out"
+  code=$?
+  out=$(sed 's/scm> //g' "$dir/out")
+  if [ $code != 0 ] || [ "$out" != "$expected" ]; then
+    echo "division by zero, $OPT ${engine:-tree walker}: got"
+    echo "$out"
+    echo "(exit status $code)"
+    status=1
+  fi
+done
+exit $status
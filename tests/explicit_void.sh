@@ -0,0 +1,25 @@
+#!/bin/bash
+# usage: explicit_void.sh <code binary> <-O level>
+# Whether a void result prints must not depend on the optimizer, which
+# prunes the (void) branches below away at -O1 and up.
+BIN=$1
+OPT=$2
+expected='x
+#<void>
+#<void>
+#<void>'
+status=0
+for engine in "" --vm --cek; do
+  out=$(printf '%s\n' \
+      '(define x 0)' \
+      '(cond (#f (void)) (else (display "")))' \
+      '(cond (#f (void)) (#t (set! x 1)))' \
+      '(if #t (set! x 2) (void))' \
+      '(exit)' | "$BIN" $OPT $engine | sed 's/scm> //g')
+  if [ "$out" != "$expected" ]; then
+    echo "explicit void, $OPT ${engine:-tree walker}: got"
+    echo "$out"
+    status=1
+  fi
+done
+exit $status
@@ -0,0 +1,24 @@
+#!/bin/bash
+# usage: folded_eq.sh <code binary>
+# eq? on computed bignums and rationals prints the same at -O0 and -O2:
+# folding must not turn fresh objects into one shared literal.
+BIN=$1
+program='(eq? (* 1/2 4) (* 1/2 4))
+(eq? (+ 100000000000 0) (+ 100000000000 0))
+(define (f) (+ 100000000000 0))
+(eq? (f) (f))
+(eq? (/ 1 3) (/ 1 3))
+(exit)'
+status=0
+for engine in "" --vm --cek; do
+  o0=$(echo "$program" | "$BIN" -O0 $engine | sed 's/scm> //g')
+  o2=$(echo "$program" | "$BIN" -O2 $engine | sed 's/scm> //g')
+  if [ "$o0" != "$o2" ]; then
+    echo "folded eq?, ${engine:-tree walker}: -O0 printed"
+    echo "$o0"
+    echo "-O2 printed"
+    echo "$o2"
+    status=1
+  fi
+done
+exit $status
@@ -0,0 +1,13 @@
+#!/bin/bash
+# usage: output_before_crash.sh <code binary>
+# The REPL hands what each form printed to stdout before running the next,
+# so a form that kills the interpreter (here unbounded recursion on the
+# tree walker, which evaluates on the C++ stack) loses none of it
+BIN=$1
+out=$(printf '(display 1)\n(define (f n) (+ 1 (f n)))\n(f 0)\n' | (ulimit -s 2048; "$BIN") 2> /dev/null | sed 's/scm> //g')
+if [ "$out" != '1
+f' ]; then
+  echo "got"
+  echo "$out"
+  exit 1
+fi
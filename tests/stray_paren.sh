@@ -0,0 +1,26 @@
+#!/bin/bash
+# usage: stray_paren.sh <code binary>
+# Batch mode reports a ')' or ']' that closes nothing, runs the forms after
+# it, and exits with status 1
+BIN=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+printf '(define x 1)\n(display x))\n]x\n' > "$dir/program.scm"
+
+status=0
+for engine in "" --vm --cek; do
+  out=$("$BIN" $engine "$dir/program.scm" 2> "$dir/err")
+  code=$?
+  err=$(cat "$dir/err")
+  if [ $code != 1 ] || [ "$out" != 'x
+1
+1' ] || [ "$err" != "$dir/program.scm:2: unexpected ')'
+$dir/program.scm:3: unexpected ']'" ]; then
+    echo "${engine:-tree walker}: got status $code, output"
+    echo "$out"
+    echo "and errors"
+    echo "$err"
+    status=1
+  fi
+done
+exit $status